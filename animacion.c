@@ -0,0 +1,176 @@
+#include "stb-master/stb_image.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "animacion.h"
+#include "memoria.h"
+
+// Salta una cadena de sub-bloques GIF (longitud + datos, hasta uno vacio)
+static size_t gif_skip_blocks(const unsigned char *p, size_t n, size_t i) {
+    while (i < n && p[i]) i += (size_t)p[i] + 1;
+    return i + 1;
+}
+
+/*
+ * Cuenta los fotogramas (descriptores de imagen) recorriendo los bloques
+ * sin descomprimir nada, y para en max. Así se sabe lo que ocupará la
+ * animación decodificada antes de decodificarla: unos pocos bytes de LZW
+ * por fotograma pueden pedir cientos de MB.
+ */
+static int gif_count_frames(const unsigned char *p, size_t n, int max) {
+    if (n < 13 || memcmp(p, "GIF8", 4) != 0) return 0;
+    size_t i = 13;
+    if (p[10] & 0x80) i += (size_t)3 << ((p[10] & 7) + 1);  // paleta global
+    int frames = 0;
+    while (i < n && frames < max) {
+        unsigned char block = p[i++];
+        if (block == 0x21) {            // extension: etiqueta y sub-bloques
+            i = gif_skip_blocks(p, n, i + 1);
+        } else if (block == 0x2C) {     // descriptor de imagen
+            if (i + 9 > n) break;
+            unsigned char flags = p[i + 8];
+            i += 9;
+            if (flags & 0x80) i += (size_t)3 << ((flags & 7) + 1);  // paleta local
+            frames++;
+            i = gif_skip_blocks(p, n, i + 1);  // tamano minimo de codigo LZW y datos
+        } else {
+            break;                      // 0x3B (fin) o bloque desconocido
+        }
+    }
+    return frames;
+}
+
+int gif_load_animation(const char *filepath, struct gif_animation *anim) {
+    memset(anim, 0, sizeof(*anim));
+    mem_stage(MEM_STAGE_DECODE);
+    FILE *f = fopen(filepath, "rb");
+    if (!f) return 0;
+
+    unsigned char magic[4];
+    if (fread(magic, 1, 4, f) != 4 || memcmp(magic, "GIF8", 4) != 0 ||
+        fseek(f, 0, SEEK_END) != 0) {
+        fclose(f);
+        return 0;
+    }
+    long size = ftell(f);
+    unsigned char *data = size > 0 && size <= INT_MAX ? mem_alloc(size) : NULL;
+    if (!data || fseek(f, 0, SEEK_SET) != 0 || fread(data, 1, size, f) != (size_t)size) {
+        mem_free(data);
+        fclose(f);
+        return 0;
+    }
+    fclose(f);
+
+    // Todos los fotogramas se componen sobre la pantalla lógica del GIF
+    int frames = gif_count_frames(data, size, GIF_MAX_FRAMES + 1);
+    int width = frames ? data[6] | data[7] << 8 : 0;
+    int height = frames ? data[8] | data[9] << 8 : 0;
+    size_t frame_bytes = (size_t)width * height * 4;
+    if (frames > GIF_MAX_FRAMES) {
+        fprintf(stderr, "GIF %s: mas de %d fotogramas, se procesa solo el primero\n",
+                filepath, GIF_MAX_FRAMES);
+    } else if (frame_bytes && (size_t)frames > GIF_MAX_BYTES / frame_bytes) {
+        fprintf(stderr, "GIF %s: %d fotogramas de %dx%d superan %zu bytes, se procesa solo el primero\n",
+                filepath, frames, width, height, GIF_MAX_BYTES);
+    } else if (frames >= 2) {
+        int comp;
+        anim->frames = stbi_load_gif_from_memory(data, (int)size, NULL, &anim->width, &anim->height,
+                                                 &anim->count, &comp, 4);
+    }
+    mem_free(data);
+    if (!anim->frames || anim->count < 2) {
+        gif_free_animation(anim);
+        return 0;
+    }
+    return 1;
+}
+
+void gif_free_animation(struct gif_animation *anim) {
+    stbi_image_free(anim->frames);
+    memset(anim, 0, sizeof(*anim));
+}
+
+static _Thread_local int in_parallel;
+
+int parallel_threads(int n) {
+    if (in_parallel || n < 1) return 1;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = ncpu > 0 ? (int)ncpu : 1;
+    if (nthreads > PARALLEL_MAX_THREADS) nthreads = PARALLEL_MAX_THREADS;
+    return nthreads < n ? nthreads : n;
+}
+
+struct parallel_job {
+    int (*fn)(void *ctx, int index);
+    void *ctx;
+    int index;
+    int failed;
+    struct mem_context mem;
+};
+
+static void *parallel_worker(void *arg) {
+    struct parallel_job *job = arg;
+    mem_context_attach(job->mem);
+    in_parallel = 1;
+    job->failed = job->fn(job->ctx, job->index) != 0;
+    return NULL;
+}
+
+int parallel_run(int nthreads, int (*fn)(void *ctx, int index), void *ctx) {
+    pthread_t threads[PARALLEL_MAX_THREADS];
+    struct parallel_job jobs[PARALLEL_MAX_THREADS];
+    if (nthreads > PARALLEL_MAX_THREADS) nthreads = PARALLEL_MAX_THREADS;
+    if (nthreads < 1) return 0;
+
+    // Los hilos cuentan sus reservas en la peticion de este
+    struct mem_context mem = mem_context_current();
+    int nested = in_parallel;
+    for (int i = 0; i < nthreads; i++) {
+        jobs[i] = (struct parallel_job){ fn, ctx, i, 0, mem };
+    }
+    int started = 0;
+    for (int i = 1; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, parallel_worker, &jobs[i]) != 0) break;
+        started = i;
+    }
+    parallel_worker(&jobs[0]);
+    int failed = jobs[0].failed;
+    for (int i = 1; i <= started; i++) {
+        pthread_join(threads[i], NULL);
+        failed |= jobs[i].failed;
+    }
+    // Si no se pudieron crear todos los hilos, el resto se hace aqui
+    for (int i = started + 1; i < nthreads; i++) {
+        parallel_worker(&jobs[i]);
+        failed |= jobs[i].failed;
+    }
+    in_parallel = nested;
+    mem_context_attach(mem);
+    return failed ? -1 : 0;
+}
+
+struct frame_job {
+    int (*fn)(void *ctx, int frame);
+    void *ctx;
+    int count;
+    int step;
+};
+
+// Hilo index de parallel_frames: fotogramas index, index + step, ...
+static int frame_worker(void *arg, int index) {
+    struct frame_job *job = arg;
+    int failed = 0;
+    for (int f = index; f < job->count; f += job->step) {
+        if (job->fn(job->ctx, f) != 0) failed = 1;
+    }
+    return failed ? -1 : 0;
+}
+
+int parallel_frames(int count, int (*fn)(void *ctx, int frame), void *ctx) {
+    struct frame_job job = { fn, ctx, count, parallel_threads(count) };
+    if (count < 1) return 0;
+    return parallel_run(job.step, frame_worker, &job);
+}
@@ -0,0 +1,43 @@
+#ifndef ANIMACION_H
+#define ANIMACION_H
+
+#include <stddef.h>
+
+// Un GIF con mas fotogramas, o cuyos fotogramas RGBA ocupen mas, no se
+// decodifica entero: se procesa solo el primero, como imagen fija
+#define GIF_MAX_FRAMES 4096
+#define GIF_MAX_BYTES ((size_t)512 << 20)
+
+// Fotogramas de un GIF animado, decodificados una sola vez para clasificar y ecualizar
+struct gif_animation {
+    unsigned char *frames;  // count fotogramas RGBA de width x height, seguidos y ya compuestos
+    int width;
+    int height;
+    int count;
+};
+
+// 1 si es un GIF con varios fotogramas (cargado en anim), 0 si no lo es, supera
+// GIF_MAX_FRAMES o GIF_MAX_BYTES o no se pudo decodificar (se procesa como imagen fija)
+int gif_load_animation(const char *filepath, struct gif_animation *anim);
+void gif_free_animation(struct gif_animation *anim);
+
+static inline const unsigned char *gif_frame(const struct gif_animation *anim, int frame) {
+    return anim->frames + (size_t)frame * anim->width * anim->height * 4;
+}
+
+#define PARALLEL_MAX_THREADS 16
+
+// Hilos para repartir n trabajos: el minimo de n, los nucleos y
+// PARALLEL_MAX_THREADS, o 1 dentro de un hilo de parallel_run (no se anidan)
+int parallel_threads(int n);
+
+// Llama a fn(ctx, i) para i = 0..nthreads-1 (como mucho PARALLEL_MAX_THREADS),
+// cada una en su hilo y la 0 en el actual. Los hilos cuentan sus reservas en la
+// peticion del que llama. Devuelve 0 si todas las llamadas devolvieron 0
+int parallel_run(int nthreads, int (*fn)(void *ctx, int index), void *ctx);
+
+// Llama a fn(ctx, f) para cada fotograma, repartidos entre parallel_threads hilos.
+// Devuelve 0 si todas las llamadas devolvieron 0
+int parallel_frames(int count, int (*fn)(void *ctx, int frame), void *ctx);
+
+#endif
@@ -5,45 +5,275 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <math.h>
+#include "clasificador.h"
+#include "animacion.h"
+#include "memoria.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define MAX_PATH 4096
 
+/*
+ * Suma los canales R, G y B de una imagen RGB o RGBA. El camino SSE2 usa
+ * psadbw (_mm_sad_epu8) para sumar horizontalmente los bytes de cada canal
+ * en lanes de 64 bits, que no pueden desbordar con ningún tamaño de imagen.
+ */
+static void channel_sums(const unsigned char *img, size_t total_pixels, int channels,
+                         unsigned long long sums[3]) {
+    size_t i = 0;
+    sums[0] = sums[1] = sums[2] = 0;
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc[3] = { zero, zero, zero };
+    if (channels == 4) {
+        __m128i mr = _mm_set1_epi32(0x000000ff);
+        __m128i mg = _mm_set1_epi32(0x0000ff00);
+        __m128i mb = _mm_set1_epi32(0x00ff0000);
+        for (; i + 4 <= total_pixels; i += 4) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(img + 4 * i));
+            acc[0] = _mm_add_epi64(acc[0], _mm_sad_epu8(_mm_and_si128(v, mr), zero));
+            acc[1] = _mm_add_epi64(acc[1], _mm_sad_epu8(_mm_and_si128(v, mg), zero));
+            acc[2] = _mm_add_epi64(acc[2], _mm_sad_epu8(_mm_and_si128(v, mb), zero));
+        }
+    } else {
+        // 16 pixeles RGB = 3 registros; en el registro k el byte j es del canal (16k + j) % 3
+        __m128i m0 = _mm_setr_epi8(-1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1);
+        __m128i m1 = _mm_setr_epi8(0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0);
+        __m128i m2 = _mm_setr_epi8(0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0);
+        for (; i + 16 <= total_pixels; i += 16) {
+            const __m128i *p = (const __m128i *)(img + 3 * i);
+            __m128i v0 = _mm_loadu_si128(p);
+            __m128i v1 = _mm_loadu_si128(p + 1);
+            __m128i v2 = _mm_loadu_si128(p + 2);
+            // Las posiciones de cada canal en v0, v1 y v2 no se solapan: se combinan con OR
+            __m128i r = _mm_or_si128(_mm_or_si128(_mm_and_si128(v0, m0), _mm_and_si128(v1, m2)), _mm_and_si128(v2, m1));
+            __m128i g = _mm_or_si128(_mm_or_si128(_mm_and_si128(v0, m1), _mm_and_si128(v1, m0)), _mm_and_si128(v2, m2));
+            __m128i b = _mm_or_si128(_mm_or_si128(_mm_and_si128(v0, m2), _mm_and_si128(v1, m1)), _mm_and_si128(v2, m0));
+            acc[0] = _mm_add_epi64(acc[0], _mm_sad_epu8(r, zero));
+            acc[1] = _mm_add_epi64(acc[1], _mm_sad_epu8(g, zero));
+            acc[2] = _mm_add_epi64(acc[2], _mm_sad_epu8(b, zero));
+        }
+    }
+    for (int c = 0; c < 3; c++) {
+        unsigned long long lanes[2];
+        _mm_storeu_si128((__m128i *)lanes, acc[c]);
+        sums[c] = lanes[0] + lanes[1];
+    }
+#endif
+    for (; i < total_pixels; i++) {
+        sums[0] += img[i * channels + 0];
+        sums[1] += img[i * channels + 1];
+        sums[2] += img[i * channels + 2];
+    }
+}
+
+void classify_options_default(struct classify_options *opts) {
+    opts->mode = CLASSIFY_FULL;
+    opts->confidence = CLASSIFY_DEFAULT_CONFIDENCE;
+}
+
+// Mismo criterio de desempate que la suma completa: r, luego g, luego b
+static char leading_channel(const unsigned long long sums[3]) {
+    if (sums[0] >= sums[1] && sums[0] >= sums[2]) return 'r';
+    else if (sums[1] >= sums[0] && sums[1] >= sums[2]) return 'g';
+    else return 'b';
+}
+
+// Ventaja media por píxel del canal líder sobre el siguiente
+static double leading_margin(const unsigned long long sums[3], size_t total_pixels) {
+    unsigned long long first = sums[0], second = 0;
+    for (int c = 1; c < 3; c++) {
+        if (sums[c] > first) {
+            second = first;
+            first = sums[c];
+        } else if (sums[c] > second) {
+            second = sums[c];
+        }
+    }
+    return (double)(first - second) / total_pixels;
+}
+
+/*
+ * Sumas sobre una imagen DC (un píxel por bloque 8x8 del JPEG original de
+ * width x height). Cada píxel pesa los píxeles reales de su bloque, que en
+ * la última fila y columna pueden ser menos de 64; sin esto los bordes
+ * desvían las medias de las imágenes pequeñas.
+ */
+static void dc_block_sums(const unsigned char *img, int bw, int bh, int channels,
+                          int width, int height, unsigned long long sums[3]) {
+    int last_w = width - 8 * (bw - 1);
+    int last_h = height - 8 * (bh - 1);
+    sums[0] = sums[1] = sums[2] = 0;
+    for (int y = 0; y < bh; y++) {
+        const unsigned char *row = img + (size_t)y * bw * channels;
+        const unsigned char *last = row + (size_t)(bw - 1) * channels;
+        unsigned long long row_sums[3];
+        unsigned long long wy = y < bh - 1 ? 8 : last_h;
+        channel_sums(row, bw - 1, channels, row_sums);
+        for (int c = 0; c < 3; c++)
+            sums[c] += (row_sums[c] * 8 + (unsigned long long)last[c] * last_w) * wy;
+    }
+}
+
+#define SAMPLE_BATCH 1024
+#define SAMPLE_MIN_PIXELS (1 << 16)   // por debajo de esto la suma completa ya es barata
+#define DC_MIN_PIXELS (1 << 16)       // JPEG mínimo para clasificar sobre la imagen DC
+#define DC_MAX_ERROR 2.0              // niveles que la imagen DC puede mover la diferencia entre canales
+
+/*
+ * Clasificación por muestreo: toma píxeles uniformes al azar por lotes y se
+ * detiene cuando la cota de Hoeffding garantiza (con la confianza pedida)
+ * que la media del canal líder supera a la de los otros dos. La diferencia
+ * entre dos canales de un píxel está en [-255, 255]. La cota se comprueba
+ * tras cada lote, así que el riesgo delta = 1 - confianza se reparte entre
+ * las comprobaciones: la k-ésima usa delta / (k (k + 1)), que suman delta
+ * en total, y la confianza pedida se cumple aunque se pare en cualquier
+ * lote. Si tras muestrear 1/8 de la imagen sigue sin decidir (casi
+ * empate), devuelve 0 para que se haga la suma completa.
+ */
+static char sampled_leading_channel(const unsigned char *img, size_t total_pixels, int channels,
+                                    double confidence) {
+    unsigned long long sums[3] = {0, 0, 0};
+    unsigned long long rng = 0x2545F4914F6CDD1DULL;
+    size_t max_samples = total_pixels / 8;
+    // Dos comparaciones (líder contra cada uno de los otros): cota de unión
+    double log_term = log(4.0 / (1.0 - confidence));
+
+    for (size_t n = 0, check = 1; n < max_samples; check++) {
+        for (int k = 0; k < SAMPLE_BATCH; k++) {
+            rng ^= rng << 13;
+            rng ^= rng >> 7;
+            rng ^= rng << 17;
+            const unsigned char *p = img + (rng % total_pixels) * channels;
+            sums[0] += p[0];
+            sums[1] += p[1];
+            sums[2] += p[2];
+        }
+        n += SAMPLE_BATCH;
+
+        char lead = leading_channel(sums);
+        int li = lead == 'r' ? 0 : (lead == 'g' ? 1 : 2);
+        double k = (double)check;
+        double eps = 510.0 * sqrt((log_term + log(k * (k + 1.0))) / (2.0 * n));
+        int decided = 1;
+        for (int c = 0; c < 3; c++) {
+            if (c != li && (double)(sums[li] - sums[c]) / n <= eps) decided = 0;
+        }
+        if (decided) return lead;
+    }
+    return 0;
+}
+
+struct strip_sums {
+    unsigned long long sums[3];
+    int channels;
+};
+
+// Consumidor de stbi_load_rows: suma cada franja mientras sigue en caché
+static int sum_strip(void *user, int y, int rows, const unsigned char *data, int x, int comp) {
+    struct strip_sums *s = user;
+    unsigned long long part[3];
+    (void)y;
+    s->channels = comp;
+    if (comp < 3) return 0;  // gris: no hace falta decodificar el resto
+    channel_sums(data, (size_t)x * rows, comp, part);
+    for (int c = 0; c < 3; c++) s->sums[c] += part[c];
+    return 1;
+}
+
+/*
+ * Suma completa sin tener la imagen entera en memoria: stbi_load_rows
+ * entrega la imagen por franjas de filas a medida que se decodifica.
+ */
+static char streamed_leading_channel(const char *filepath) {
+    struct strip_sums s = {{0, 0, 0}, 0};
+    int width, height, channels;
+    // Sin conversión de canales: RGB y RGBA se suman directamente
+    int ok = stbi_load_rows(filepath, &width, &height, &channels, 0, sum_strip, &s);
+
+    if (!ok && (s.channels == 0 || s.channels >= 3)) {
+        fprintf(stderr, "Error cargando imagen %s\n", filepath);
+        return 'g'; // por defecto verde
+    }
+    // Gris: R = G = B, el empate se resuelve a rojo como con RGB
+    if (s.channels < 3) return 'r';
+    return leading_channel(s.sums);
+}
+
 // Determina el color predominante de una imagen (r/g/b)
-static char predominant_color(const char *filepath) {
+static char predominant_color(const char *filepath, const struct classify_options *opts) {
     int width, height, channels;
-    unsigned char *img = stbi_load(filepath, &width, &height, &channels, 3); 
-    // fuerza 3 canales (RGB)
+    int full_width = 0, full_height = 0, full_channels;
+    size_t info_pixels = 0;
+    unsigned char *img = NULL;
+    if (stbi_info(filepath, &full_width, &full_height, &full_channels))
+        info_pixels = (size_t)full_width * full_height;
+    /*
+     * Para JPEG basta con el coeficiente DC de cada bloque 8x8: es la media
+     * del bloque, así que las medias por canal se conservan sin IDCT y con
+     * 1/64 de los píxeles. En imágenes pequeñas el submuestreo del croma a
+     * esa escala ya pesa en la media y la decodificación completa es barata.
+     */
+    if (info_pixels >= DC_MIN_PIXELS) {
+        img = stbi_load_jpeg_dc(filepath, &width, &height, &channels, 0);
+    }
+    if (!img) {
+        full_width = 0;
+        // El muestreo necesita acceso aleatorio a la imagen completa; la suma completa no
+        if (opts->mode != CLASSIFY_SAMPLED || info_pixels < SAMPLE_MIN_PIXELS)
+            return streamed_leading_channel(filepath);
+        // Sin conversión de canales: RGB y RGBA se suman directamente
+        img = stbi_load(filepath, &width, &height, &channels, 0);
+    }
 
     if (!img) {
         fprintf(stderr, "Error cargando imagen %s\n", filepath);
         return 'g'; // por defecto verde
     }
 
-    unsigned long long r_sum = 0, g_sum = 0, b_sum = 0;
-    long total_pixels = width * height;
+    if (channels < 3) {
+        // Gris: R = G = B, el empate se resuelve a rojo como con RGB
+        stbi_image_free(img);
+        return 'r';
+    }
 
-    for (long i = 0; i < total_pixels; i++) {
-        r_sum += img[i * 3 + 0];
-        g_sum += img[i * 3 + 1];
-        b_sum += img[i * 3 + 2];
+    size_t total_pixels = (size_t)width * height;
+    char color = 0;
+    if (opts->mode == CLASSIFY_SAMPLED && total_pixels >= SAMPLE_MIN_PIXELS) {
+        color = sampled_leading_channel(img, total_pixels, channels, opts->confidence);
+    }
+    if (!color) {
+        unsigned long long sums[3];
+        if (full_width) {
+            dc_block_sums(img, width, height, channels, full_width, full_height, sums);
+            /*
+             * Cada DC es la media del bloque redondeada a un nivel, y la
+             * decodificación completa además recorta a [0, 255] y convierte
+             * el color por píxel: las medias DC se desvían de la suma
+             * completa, en la práctica menos de un nivel por canal. Con un
+             * margen menor que eso el líder puede cambiar y se suma la
+             * imagen entera.
+             */
+            if (leading_margin(sums, (size_t)full_width * full_height) <= DC_MAX_ERROR) {
+                stbi_image_free(img);
+                return streamed_leading_channel(filepath);
+            }
+        } else {
+            channel_sums(img, total_pixels, channels, sums);
+        }
+        color = leading_channel(sums);
     }
 
     stbi_image_free(img);
-
-    if (r_sum >= g_sum && r_sum >= b_sum) return 'r';
-    else if (g_sum >= r_sum && g_sum >= b_sum) return 'g';
-    else return 'b';
+    return color;
 }
 
-// Clasifica la imagen moviéndola a rojas/, verdes/ o azules/
-int classify_image(const char *filepath,
-                          const char *filename,
-                          const char *dir_rojas,
-                          const char *dir_verdes,
-                          const char *dir_azules) {
+// Mueve el archivo al directorio de su color
+static int move_to_color_dir(const char *filepath, const char *filename, char color,
+                             const char *dir_rojas, const char *dir_verdes, const char *dir_azules) {
     char dest[MAX_PATH];
-    char color = predominant_color(filepath);
-
     if (color == 'r')
         snprintf(dest, sizeof(dest), "%s/%s", dir_rojas, filename);
     else if (color == 'g')
@@ -61,3 +291,59 @@ int classify_image(const char *filepath,
     printf("Imagen %s clasificada en %s\n", filename, dest);
     return 0;
 }
+
+// Clasifica la imagen moviéndola a rojas/, verdes/ o azules/
+int classify_image(const char *filepath,
+                          const char *filename,
+                          const char *dir_rojas,
+                          const char *dir_verdes,
+                          const char *dir_azules,
+                          const struct classify_options *opts) {
+    struct classify_options defaults;
+    if (!opts) {
+        classify_options_default(&defaults);
+        opts = &defaults;
+    }
+    mem_stage(MEM_STAGE_CLASSIFY);
+    char color = predominant_color(filepath, opts);
+    return move_to_color_dir(filepath, filename, color, dir_rojas, dir_verdes, dir_azules);
+}
+
+struct frame_sums {
+    const struct gif_animation *anim;
+    unsigned long long (*sums)[3];
+};
+
+static int sum_frame(void *ctx, int frame) {
+    struct frame_sums *fs = ctx;
+    channel_sums(gif_frame(fs->anim, frame), (size_t)fs->anim->width * fs->anim->height, 4,
+                 fs->sums[frame]);
+    return 0;
+}
+
+/*
+ * GIF animado: el color predominante es el de todos los fotogramas juntos.
+ * Cada fotograma se suma en paralelo en su propia entrada y luego se
+ * acumulan; el muestreo no se usa porque los fotogramas ya están en memoria.
+ */
+int classify_animation(const struct gif_animation *anim,
+                       const char *filepath,
+                       const char *filename,
+                       const char *dir_rojas,
+                       const char *dir_verdes,
+                       const char *dir_azules) {
+    unsigned long long total[3] = {0, 0, 0};
+    char color = 'g'; // por defecto verde
+    mem_stage(MEM_STAGE_CLASSIFY);
+    struct frame_sums fs = { anim, mem_alloc(anim->count * sizeof(*fs.sums)) };
+
+    if (fs.sums && parallel_frames(anim->count, sum_frame, &fs) == 0) {
+        for (int f = 0; f < anim->count; f++)
+            for (int c = 0; c < 3; c++) total[c] += fs.sums[f][c];
+        color = leading_channel(total);
+    } else {
+        fprintf(stderr, "Error sumando fotogramas de %s\n", filepath);
+    }
+    mem_free(fs.sums);
+    return move_to_color_dir(filepath, filename, color, dir_rojas, dir_verdes, dir_azules);
+}
@@ -1,10 +1,37 @@
 #ifndef CLASIFICADOR_H
 #define CLASIFICADOR_H
 
+// Modos de clasificación seleccionables por petición
+enum classify_mode {
+    CLASSIFY_FULL = 0,   // mismo resultado que sumar todos los píxeles; en JPEG grandes usa
+                         // las medias DC y solo suma la imagen entera si quedan casi empatadas
+    CLASSIFY_SAMPLED     // muestreo aleatorio con corte por cota de confianza
+};
+
+#define CLASSIFY_DEFAULT_CONFIDENCE 0.999
+
+struct classify_options {
+    enum classify_mode mode;
+    double confidence;   // probabilidad de que el muestreo decida igual que la suma completa
+};
+
+void classify_options_default(struct classify_options *opts);
+
 int classify_image(const char *input_path,
                    const char *filename,
                    const char *dir_red,
                    const char *dir_green,
-                   const char *dir_blue);
+                   const char *dir_blue,
+                   const struct classify_options *opts);
+
+struct gif_animation;
+
+// Clasifica un GIF animado ya decodificado por la suma de todos sus fotogramas
+int classify_animation(const struct gif_animation *anim,
+                       const char *input_path,
+                       const char *filename,
+                       const char *dir_red,
+                       const char *dir_green,
+                       const char *dir_blue);
 
 #endif
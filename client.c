@@ -10,6 +10,8 @@
 #define DEFAULT_PORT 1717
 #define BUFFER_SIZE 4096
 #define MAX_FILENAME 1024
+// High bit of name_len: a length-prefixed options string follows the filename
+#define NAME_LEN_HAS_OPTIONS 0x80000000u
 
 int64_t get_file_size(const char *filename) {
     struct stat st;
@@ -34,9 +36,38 @@ void print_usage(const char *prog_name) {
     printf("\nModo interactivo:\n");
     printf("- Ingresa nombres de archivos de imagen uno por uno\n");
     printf("- Escribe 'Exit' para terminar\n");
+    printf("\nOpciones por imagen (después del nombre, formato clave=valor):\n");
+    printf("  modo=global|clahe|referencia  tiles=NxM  clip=C  color=si|no  precision=normal|alta\n");
+    printf("  referencia=NOMBRE (histograma .hist o imagen guardada en el servidor)\n");
+    printf("  muestreo=F (0.000001 <= F <= 1, fracción de píxeles para el histograma)\n");
+    printf("  cdf=fotograma|compartida (GIF animados: una CDF por fotograma o una para todos)\n");
+    printf("  clasificacion=completa|muestreo  confianza=P (0 < P < 1)\n");
+    printf("  Ej: foto.jpg modo=clahe tiles=8x8 clip=2.5\n");
 }
 
-int send_image_to_server(const char *server_ip, int port, const char *filepath) {
+// Separa las opciones "clave=valor" del final de la línea; NULL si no hay
+char *split_options(char *line) {
+    for (char *sp = strchr(line, ' '); sp; sp = strchr(sp + 1, ' ')) {
+        int all_options = 1;
+        const char *tok = sp;
+        while (*tok) {
+            while (*tok == ' ') tok++;
+            if (!*tok) break;
+            size_t tok_len = strcspn(tok, " ");
+            if (!memchr(tok, '=', tok_len)) { all_options = 0; break; }
+            tok += tok_len;
+        }
+        if (all_options) {
+            *sp = '\0';
+            char *options = sp + 1;
+            while (*options == ' ') options++;
+            return *options ? options : NULL;
+        }
+    }
+    return NULL;
+}
+
+int send_image_to_server(const char *server_ip, int port, const char *filepath, const char *options) {
     // Get base filename
     const char *base = strrchr(filepath, '/');
     if (base) base++; else base = filepath;
@@ -77,7 +108,7 @@ int send_image_to_server(const char *server_ip, int port, const char *filepath)
     }
 
     // Send name_len
-    uint32_t name_len_net = htonl(name_len);
+    uint32_t name_len_net = htonl(options ? (name_len | NAME_LEN_HAS_OPTIONS) : name_len);
     if (send_all(sock, &name_len_net, sizeof(name_len_net)) <= 0) {
         perror("send name_len");
         close(sock); fclose(f); 
@@ -91,6 +122,18 @@ int send_image_to_server(const char *server_ip, int port, const char *filepath)
         return -1;
     }
 
+    // Send options
+    if (options) {
+        uint32_t opt_len = (uint32_t)strlen(options);
+        uint32_t opt_len_net = htonl(opt_len);
+        if (send_all(sock, &opt_len_net, sizeof(opt_len_net)) <= 0 ||
+            send_all(sock, options, opt_len) <= 0) {
+            perror("send options");
+            close(sock); fclose(f); 
+            return -1;
+        }
+    }
+
     // Send filesize
     int64_t filesize_net = htobe64((int64_t)filesize);
     if (send_all(sock, &filesize_net, sizeof(filesize_net)) <= 0) {
@@ -182,9 +225,11 @@ int main(int argc, char *argv[]) {
             continue;
         }
         
+        char *options = split_options(filename);
+
         printf("\nProcesando imagen #%d: %s ---\n", ++image_count, filename);
         
-        if (send_image_to_server(server_ip, port, filename) == 0) {
+        if (send_image_to_server(server_ip, port, filename, options) == 0) {
             printf("✓ Imagen procesada exitosamente\n");
         } else {
             printf("✗ Error procesando imagen\n");
@@ -1,9 +1,32 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "histogram.h"
+#include "animacion.h"
+#include "memoria.h"
 #include "stb-master/stb_image.h"
 #include "stb-master/stb_image_write.h"
 
+void eq_options_default(struct eq_options *opts){
+	opts->mode = EQ_MODE_GLOBAL;
+	opts->clahe_tiles_x = CLAHE_DEFAULT_TILES;
+	opts->clahe_tiles_y = CLAHE_DEFAULT_TILES;
+	opts->clahe_clip = CLAHE_DEFAULT_CLIP;
+	opts->preserve_color = 0;
+	opts->high_precision = 0;
+	opts->reference_path[0] = '\0';
+	opts->sample_fraction = 1.0;
+	opts->shared_cdf = 0;
+}
+
 void to_grayscale(unsigned char *original_data,unsigned char *new_data,  int width, int height){
  	int size = width * height;
 	for (int i=0; i < size; i++){
@@ -12,16 +35,27 @@ void to_grayscale(unsigned char *original_data,unsigned char *new_data,  int wid
 	
 }
 
-void histogram_equalization(unsigned char* image,unsigned char* out_image, int width, int height){
-	int pixel_intensities[256] = {0};
-	float image_size = width*height;
-
-	for (size_t i=0; i< (size_t) image_size; i++){
-		pixel_intensities[image[i]] ++;
+// Aplica una LUT de 8 bits; desenrollado porque es el bucle mas caliente de todos los modos
+void apply_lut(const unsigned char *lut, const unsigned char *image, unsigned char *out_image, size_t size){
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8){
+		out_image[i] = lut[image[i]];
+		out_image[i + 1] = lut[image[i + 1]];
+		out_image[i + 2] = lut[image[i + 2]];
+		out_image[i + 3] = lut[image[i + 3]];
+		out_image[i + 4] = lut[image[i + 4]];
+		out_image[i + 5] = lut[image[i + 5]];
+		out_image[i + 6] = lut[image[i + 6]];
+		out_image[i + 7] = lut[image[i + 7]];
+	}
+	for (; i < size; i++){
+		out_image[i] = lut[image[i]];
 	}
+}
 
+// LUT de ecualizacion a partir de los conteos de total pixeles
+static void equalization_lut(const size_t *pixel_intensities, float image_size, unsigned char *mapped_pixels){
 	float cdf[256] = {0};
-	unsigned char mapped_pixels[256] = {0};
 
 	cdf[0] = pixel_intensities[0] / image_size;
 	mapped_pixels[0] = cdf[0] * 255;
@@ -31,62 +65,1201 @@ void histogram_equalization(unsigned char* image,unsigned char* out_image, int w
 		cdf[i] = cdf[i-1] + pixel_intensity_probability;
 		mapped_pixels[i] = cdf[i] * 255;
 	}
+}
 
-	for (int i=0; i < image_size; i++){
-		out_image[i] = mapped_pixels[image[i]];
+void histogram_equalization(unsigned char* image,unsigned char* out_image, int width, int height){
+	size_t pixel_intensities[256] = {0};
+	float image_size = width*height;
+
+	for (size_t i=0; i< (size_t) image_size; i++){
+		pixel_intensities[image[i]] ++;
 	}
-} 
-	
-int process_histogram_equalization(const char *input_filepath, const char *output_filepath){
-	
+
+	unsigned char mapped_pixels[256] = {0};
+	equalization_lut(pixel_intensities, image_size, mapped_pixels);
+
+	apply_lut(mapped_pixels, image, out_image, (size_t) image_size);
+}
+
+/*
+ * Histograma aproximado para imagenes enormes: muestreo estratificado, un
+ * pixel al azar por cada bloque de 1/fraction pixeles consecutivos (evita el
+ * aliasing de un paso fijo con patrones periodicos). Es determinista: la
+ * semilla es fija. Devuelve el numero de muestras.
+ */
+// Paso del muestreo; una fraccion menor que 1/size da una sola muestra
+static size_t sample_step(size_t size, double fraction){
+	if (fraction >= 1.0) return 1;
+	if (!(fraction > 0) || 1.0 / fraction >= (double)size) return size > 0 ? size : 1;
+	size_t step = (size_t)(1.0 / fraction + 0.5);
+	return step < 1 ? 1 : step;
+}
+
+static size_t sampled_histogram(const unsigned char *image, size_t size, double fraction, size_t *counts){
+	memset(counts, 0, 256 * sizeof(size_t));
+	if (fraction >= 1.0 || size == 0){
+		for (size_t i = 0; i < size; i++){
+			counts[image[i]]++;
+		}
+		return size;
+	}
+
+	size_t step = sample_step(size, fraction);
+	unsigned long long rng = 0x9E3779B97F4A7C15ULL;
+	size_t samples = 0;
+	for (size_t base = 0; base < size; base += step){
+		rng ^= rng << 13;
+		rng ^= rng >> 7;
+		rng ^= rng << 17;
+		size_t span = size - base < step ? size - base : step;
+		counts[image[base + rng % span]]++;
+		samples++;
+	}
+	return samples;
+}
+
+// Desigualdad DKW con 95% de confianza: sup|F_n - F| <= sqrt(ln(2/0.05)/(2n))
+static double sampling_cdf_error(size_t samples){
+	return sqrt(log(2.0 / 0.05) / (2.0 * samples));
+}
+
+/*
+ * Cota del error de la LUT (en niveles de salida) por usar n muestras: la
+ * de la CDF escalada a 255 niveles, mas 1 nivel por redondeo.
+ */
+static double sampling_error_bound(size_t samples, size_t size){
+	if (samples >= size) return 0;
+	return 255.0 * sampling_cdf_error(samples) + 1.0;
+}
+
+// Cota de la ultima ecualizacion por muestreo de este hilo, para la respuesta al cliente
+static _Thread_local double eq_last_sampling_error;
+
+double eq_sampling_error(void){
+	return eq_last_sampling_error;
+}
+
+double histogram_equalization_sampled(const unsigned char *image, unsigned char *out_image, int width, int height,
+                                      double fraction){
+	size_t size = (size_t)width * height;
+	size_t counts[256];
+	size_t samples = sampled_histogram(image, size, fraction, counts);
+
+	unsigned char lut[256] = {0};
+	equalization_lut(counts, (float)samples, lut);
+	apply_lut(lut, image, out_image, size);
+	return sampling_error_bound(samples, size);
+}
+
+/*
+ * Especificacion de histograma: mapea la distribucion de la imagen sobre la
+ * de una referencia guardada en disco. La CDF de cada referencia se calcula
+ * una sola vez y queda en cache (se recarga si el archivo cambia); por
+ * peticion solo se invierte la CDF en una LUT de 256 entradas.
+ */
+#define REFERENCE_CACHE_SIZE 16
+
+struct reference_entry {
+	char path[MAX_REFERENCE_PATH];
+	time_t mtime;
+	double cdf[256];
+};
+
+static struct reference_entry reference_cache[REFERENCE_CACHE_SIZE];
+static int reference_cache_used = 0;
+static int reference_cache_next = 0;
+static pthread_mutex_t reference_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void histogram_to_cdf(const double *hist, double *cdf){
+	double total = 0;
+	for (int i = 0; i < 256; i++) total += hist[i];
+	double sum = 0;
+	for (int i = 0; i < 256; i++){
+		sum += hist[i];
+		cdf[i] = total > 0 ? sum / total : (i + 1) / 256.0;
+	}
+}
+
+// Un .hist es texto con 256 conteos; cualquier otro archivo se trata como imagen
+static int load_reference_histogram(const char *path, double *hist){
+	const char *dot = strrchr(path, '.');
+	if (dot && strcmp(dot, ".hist") == 0){
+		FILE *f = fopen(path, "r");
+		if (!f) return -1;
+		int i;
+		for (i = 0; i < 256; i++){
+			if (fscanf(f, "%lf", &hist[i]) != 1 || hist[i] < 0) break;
+		}
+		fclose(f);
+		return i == 256 ? 0 : -1;
+	}
+
 	int width, height, channels;
-	unsigned char *data = stbi_load(input_filepath, &width, &height, &channels, 0);
-	
-	if (!data) {
-        fprintf(stderr, "Failed to load image for histogram: %s\n", input_filepath);
-        return -1;
-    }
+	unsigned char *data = stbi_load(path, &width, &height, &channels, 1);
+	if (!data) return -1;
+	memset(hist, 0, 256 * sizeof(double));
+	size_t size = (size_t)width * height;
+	for (size_t i = 0; i < size; i++){
+		hist[data[i]]++;
+	}
+	stbi_image_free(data);
+	return 0;
+}
 
-	size_t size = (width * height);
-	unsigned char *out = malloc(size);
-	
-	if (!out) {
-		stbi_image_free(data);
+static int reference_cdf(const char *path, double *cdf){
+	struct stat st;
+	if (stat(path, &st) != 0){
+		fprintf(stderr, "Reference histogram not found: %s\n", path);
 		return -1;
 	}
 
-	if (channels > 1){
-		unsigned char* gray = malloc((size_t) width*height);
-		if (!gray) {
-			free(out);
-			stbi_image_free(data);
-			return -1;
+	pthread_mutex_lock(&reference_cache_lock);
+	for (int i = 0; i < reference_cache_used; i++){
+		struct reference_entry *e = &reference_cache[i];
+		if (strcmp(e->path, path) == 0 && e->mtime == st.st_mtime){
+			memcpy(cdf, e->cdf, sizeof(e->cdf));
+			pthread_mutex_unlock(&reference_cache_lock);
+			return 0;
 		}
-		to_grayscale(data, gray, width, height);
-		histogram_equalization(gray, out, width, height);	
-		free(gray);
+	}
+	pthread_mutex_unlock(&reference_cache_lock);
+
+	double hist[256];
+	if (load_reference_histogram(path, hist) != 0){
+		fprintf(stderr, "Invalid reference histogram: %s\n", path);
+		return -1;
+	}
+	histogram_to_cdf(hist, cdf);
+
+	pthread_mutex_lock(&reference_cache_lock);
+	struct reference_entry *slot = NULL;
+	for (int i = 0; i < reference_cache_used; i++){
+		if (strcmp(reference_cache[i].path, path) == 0) slot = &reference_cache[i];
+	}
+	if (!slot){
+		if (reference_cache_used < REFERENCE_CACHE_SIZE){
+			slot = &reference_cache[reference_cache_used++];
+		}else{
+			slot = &reference_cache[reference_cache_next];
+			reference_cache_next = (reference_cache_next + 1) % REFERENCE_CACHE_SIZE;
+		}
+	}
+	snprintf(slot->path, sizeof(slot->path), "%s", path);
+	slot->mtime = st.st_mtime;
+	memcpy(slot->cdf, cdf, sizeof(slot->cdf));
+	pthread_mutex_unlock(&reference_cache_lock);
+	return 0;
+}
+
+// El menor nivel de la referencia cuya CDF alcanza c
+static int reference_level(const double *ref_cdf, double c){
+	int r = 0;
+	while (r < 255 && ref_cdf[r] < c - 1e-12) r++;
+	return r;
+}
+
+double histogram_matching(const unsigned char *image, unsigned char *out_image, int width, int height,
+                          const char *reference_path, double sample_fraction){
+	double ref_cdf[256];
+	if (reference_cdf(reference_path, ref_cdf) != 0) return -1;
+
+	size_t size = (size_t)width * height;
+	size_t counts[256];
+	size_t samples = sampled_histogram(image, size, sample_fraction, counts);
+
+	unsigned char lut[256];
+	double cdf[256];
+	size_t sum = 0;
+	for (int v = 0; v < 256; v++){
+		sum += counts[v];
+		cdf[v] = (double)sum / samples;
+		lut[v] = reference_level(ref_cdf, cdf[v]);
+	}
+
+	/*
+	 * Con muestreo, la CDF real de cada nivel esta a menos de eps de la
+	 * muestreada (DKW), asi que el nivel que le daria la LUT exacta queda
+	 * entre los de cdf - eps y cdf + eps. Depende de la pendiente de la
+	 * referencia: no hay cota fija como en la ecualizacion global.
+	 */
+	double bound = 0;
+	if (samples < size){
+		double eps = sampling_cdf_error(samples);
+		for (int v = 0; v < 256; v++){
+			int lo = lut[v] - reference_level(ref_cdf, cdf[v] - eps);
+			int hi = reference_level(ref_cdf, cdf[v] + eps) - lut[v];
+			if (lo > bound) bound = lo;
+			if (hi > bound) bound = hi;
+		}
+	}
+
+	apply_lut(lut, image, out_image, size);
+	return bound;
+}
+
+/*
+ * CLAHE: ecualizacion adaptativa por tiles con limite de contraste.
+ * Cada tile tiene su propia LUT (calculadas en paralelo); cada pixel se
+ * mapea interpolando bilinealmente las LUTs de los 4 tiles mas cercanos.
+ * Los pesos se cuantizan a 7 bits para que la mezcla quepa en enteros de
+ * 16 bits y se pueda hacer con SSE2 (resultado identico al camino escalar).
+ */
+#define CLAHE_W_BITS 7
+#define CLAHE_W_ONE  (1 << CLAHE_W_BITS)
+
+struct clahe_ctx {
+	const unsigned char *image;
+	unsigned char *out;
+	int width, height;
+	int tiles_x, tiles_y;
+	float clip_limit;
+	int tile_x0[CLAHE_MAX_TILES + 1];	// bordes de los tiles
+	int tile_y0[CLAHE_MAX_TILES + 1];
+	short *col_t0, *col_t1, *col_w;		// por columna: tiles vecinos y peso del derecho
+	unsigned char *luts;			// tiles_y * tiles_x * 256
+	int nthreads;
+};
+
+static void clahe_tile_lut(const struct clahe_ctx *c, int tx, int ty, unsigned char *lut){
+	int x0 = c->tile_x0[tx], x1 = c->tile_x0[tx + 1];
+	int y0 = c->tile_y0[ty], y1 = c->tile_y0[ty + 1];
+	unsigned int hist[256] = {0};
+
+	for (int y = y0; y < y1; y++){
+		const unsigned char *row = c->image + (size_t)y * c->width;
+		for (int x = x0; x < x1; x++){
+			hist[row[x]]++;
+		}
+	}
+
+	unsigned long long area = (unsigned long long)(x1 - x0) * (y1 - y0);
+
+	if (c->clip_limit > 0){
+		unsigned long long limit = (unsigned long long)(c->clip_limit * area / 256);
+		if (limit < 1) limit = 1;
+
+		unsigned long long excess = 0;
+		for (int i = 0; i < 256; i++){
+			if (hist[i] > limit){
+				excess += hist[i] - limit;
+				hist[i] = limit;
+			}
+		}
+
+		// Redistribuye el exceso de forma uniforme; el resto, a saltos regulares
+		unsigned int bonus = excess / 256, residual = excess % 256;
+		for (int i = 0; i < 256; i++){
+			hist[i] += bonus;
+		}
+		if (residual){
+			int step = 256 / residual;
+			for (int i = 0; i < 256 && residual; i += step, residual--){
+				hist[i]++;
+			}
+		}
+	}
+
+	unsigned long long sum = 0;
+	for (int i = 0; i < 256; i++){
+		sum += hist[i];
+		lut[i] = (sum * 255 + area / 2) / area;
+	}
+}
+
+static int clahe_lut_worker(void *arg, int index){
+	struct clahe_ctx *c = arg;
+	int ntiles = c->tiles_x * c->tiles_y;
+
+	for (int t = index; t < ntiles; t += c->nthreads){
+		clahe_tile_lut(c, t % c->tiles_x, t / c->tiles_x, c->luts + (size_t)t * 256);
+	}
+	return 0;
+}
+
+// Mezcla vertical de dos filas de LUTs: rowlut = a*(ONE-w) + b*w (15 bits)
+static void clahe_blend_luts(const unsigned char *a, const unsigned char *b, short *rowlut, int w){
+	int i = 0;
+#ifdef __SSE2__
+	__m128i zero = _mm_setzero_si128();
+	__m128i wa = _mm_set1_epi16(CLAHE_W_ONE - w);
+	__m128i wb = _mm_set1_epi16(w);
+	for (; i < 256; i += 8){
+		__m128i va = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(a + i)), zero);
+		__m128i vb = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(b + i)), zero);
+		__m128i r = _mm_add_epi16(_mm_mullo_epi16(va, wa), _mm_mullo_epi16(vb, wb));
+		_mm_storeu_si128((__m128i *)(rowlut + i), r);
+	}
+#endif
+	for (; i < 256; i++){
+		rowlut[i] = a[i] * (CLAHE_W_ONE - w) + b[i] * w;
+	}
+}
+
+static void clahe_map_row(const struct clahe_ctx *c, const unsigned char *src, unsigned char *dst,
+                          const short *rowluts){
+	int x = 0;
+#ifdef __SSE2__
+	__m128i one = _mm_set1_epi16(CLAHE_W_ONE);
+	__m128i round = _mm_set1_epi32(1 << (2 * CLAHE_W_BITS - 1));
+	short a[8] __attribute__((aligned(16)));
+	short b[8] __attribute__((aligned(16)));
+	for (; x + 8 <= c->width; x += 8){
+		for (int k = 0; k < 8; k++){
+			a[k] = rowluts[c->col_t0[x + k] * 256 + src[x + k]];
+			b[k] = rowluts[c->col_t1[x + k] * 256 + src[x + k]];
+		}
+		__m128i va = _mm_load_si128((const __m128i *)a);
+		__m128i vb = _mm_load_si128((const __m128i *)b);
+		__m128i wb = _mm_loadu_si128((const __m128i *)(c->col_w + x));
+		__m128i wa = _mm_sub_epi16(one, wb);
+		__m128i lo = _mm_madd_epi16(_mm_unpacklo_epi16(va, vb), _mm_unpacklo_epi16(wa, wb));
+		__m128i hi = _mm_madd_epi16(_mm_unpackhi_epi16(va, vb), _mm_unpackhi_epi16(wa, wb));
+		lo = _mm_srai_epi32(_mm_add_epi32(lo, round), 2 * CLAHE_W_BITS);
+		hi = _mm_srai_epi32(_mm_add_epi32(hi, round), 2 * CLAHE_W_BITS);
+		__m128i r = _mm_packs_epi32(lo, hi);
+		_mm_storel_epi64((__m128i *)(dst + x), _mm_packus_epi16(r, r));
+	}
+#endif
+	for (; x < c->width; x++){
+		int wb = c->col_w[x];
+		int v = rowluts[c->col_t0[x] * 256 + src[x]] * (CLAHE_W_ONE - wb)
+		      + rowluts[c->col_t1[x] * 256 + src[x]] * wb;
+		dst[x] = (v + (1 << (2 * CLAHE_W_BITS - 1))) >> (2 * CLAHE_W_BITS);
+	}
+}
+
+// Busca los tiles vecinos de la coordenada p y el peso del segundo
+static void clahe_neighbors(const int *edges, int ntiles, int p, int *t0, int *t1, int *w){
+	// centros de los tiles en coordenadas *2 para evitar fracciones
+	int p2 = 2 * p;
+	if (p2 <= edges[0] + edges[1] - 1){
+		*t0 = *t1 = 0; *w = 0;
+		return;
+	}
+	if (p2 >= edges[ntiles - 1] + edges[ntiles] - 1){
+		*t0 = *t1 = ntiles - 1; *w = 0;
+		return;
+	}
+	int t = 0;
+	while (2 * p >= edges[t + 1] + edges[t + 2] - 1) t++;
+	int c0 = edges[t] + edges[t + 1] - 1;
+	int c1 = edges[t + 1] + edges[t + 2] - 1;
+	*t0 = t;
+	*t1 = t + 1;
+	*w = ((p2 - c0) * CLAHE_W_ONE + (c1 - c0) / 2) / (c1 - c0);
+}
+
+static int clahe_map_worker(void *arg, int index){
+	struct clahe_ctx *c = arg;
+	int y_begin = (long long)c->height * index / c->nthreads;
+	int y_end = (long long)c->height * (index + 1) / c->nthreads;
+
+	short *rowluts = mem_alloc(sizeof(short) * 256 * c->tiles_x);
+	if (!rowluts) return -1;
+
+	int cached_t0 = -1, cached_t1 = -1, cached_w = -1;
+	for (int y = y_begin; y < y_end; y++){
+		int t0, t1, w;
+		clahe_neighbors(c->tile_y0, c->tiles_y, y, &t0, &t1, &w);
+		if (t0 != cached_t0 || t1 != cached_t1 || w != cached_w){
+			for (int tx = 0; tx < c->tiles_x; tx++){
+				clahe_blend_luts(c->luts + ((size_t)t0 * c->tiles_x + tx) * 256,
+				                 c->luts + ((size_t)t1 * c->tiles_x + tx) * 256,
+				                 rowluts + tx * 256, w);
+			}
+			cached_t0 = t0; cached_t1 = t1; cached_w = w;
+		}
+		clahe_map_row(c, c->image + (size_t)y * c->width, c->out + (size_t)y * c->width, rowluts);
+	}
+
+	mem_free(rowluts);
+	return 0;
+}
+
+static int clamp_int(int v, int lo, int hi){
+	return v < lo ? lo : (v > hi ? hi : v);
+}
+
+void clahe_equalization(const unsigned char *image, unsigned char *out_image, int width, int height,
+                        int tiles_x, int tiles_y, float clip_limit){
+	struct clahe_ctx c;
+	memset(&c, 0, sizeof(c));
+	c.image = image;
+	c.out = out_image;
+	c.width = width;
+	c.height = height;
+	c.tiles_x = clamp_int(tiles_x, 1, width < CLAHE_MAX_TILES ? width : CLAHE_MAX_TILES);
+	c.tiles_y = clamp_int(tiles_y, 1, height < CLAHE_MAX_TILES ? height : CLAHE_MAX_TILES);
+	c.clip_limit = clip_limit;
+
+	for (int t = 0; t <= c.tiles_x; t++) c.tile_x0[t] = (long long)width * t / c.tiles_x;
+	for (int t = 0; t <= c.tiles_y; t++) c.tile_y0[t] = (long long)height * t / c.tiles_y;
+
+	c.luts = mem_alloc((size_t)c.tiles_x * c.tiles_y * 256);
+	c.col_t0 = mem_alloc(sizeof(short) * 3 * (size_t)width);
+	if (!c.luts || !c.col_t0){
+		// Sin memoria: cae a la ecualizacion global
+		mem_free(c.luts);
+		mem_free(c.col_t0);
+		histogram_equalization((unsigned char *)image, out_image, width, height);
+		return;
+	}
+	c.col_t1 = c.col_t0 + width;
+	c.col_w = c.col_t1 + width;
+	for (int x = 0; x < width; x++){
+		int t0, t1, w;
+		clahe_neighbors(c.tile_x0, c.tiles_x, x, &t0, &t1, &w);
+		c.col_t0[x] = t0;
+		c.col_t1[x] = t1;
+		c.col_w[x] = w;
+	}
+
+	// Desde un hilo de fotograma (GIF) todo se hace en ese hilo
+	c.nthreads = parallel_threads(c.tiles_x * c.tiles_y);
+	parallel_run(c.nthreads, clahe_lut_worker, &c);
+
+	c.nthreads = parallel_threads(height);
+	if (parallel_run(c.nthreads, clahe_map_worker, &c) != 0){
+		histogram_equalization((unsigned char *)image, out_image, width, height);
+	}
+
+	mem_free(c.luts);
+	mem_free(c.col_t0);
+}
+
+static int equalize(const struct eq_options *opts, unsigned char *image, unsigned char *out_image,
+                    int width, int height){
+	mem_stage(MEM_STAGE_EQUALIZE);
+	if (opts->mode == EQ_MODE_CLAHE){
+		clahe_equalization(image, out_image, width, height,
+		                   opts->clahe_tiles_x, opts->clahe_tiles_y, opts->clahe_clip);
+	}else if (opts->mode == EQ_MODE_MATCH){
+		double bound = histogram_matching(image, out_image, width, height, opts->reference_path,
+		                                  opts->sample_fraction);
+		if (bound < 0) return -1;
+		if (bound > eq_last_sampling_error) eq_last_sampling_error = bound;
+	}else if (opts->sample_fraction < 1.0){
+		double bound = histogram_equalization_sampled(image, out_image, width, height, opts->sample_fraction);
+		if (bound > eq_last_sampling_error) eq_last_sampling_error = bound;
 	}else{
-		histogram_equalization(data, out, width, height);
+		histogram_equalization(image, out_image, width, height);
 	}
+	return 0;
+}
+	
+/*
+ * Conversion RGBA <-> YCbCr (BT.601 rango completo, como JPEG) en punto fijo
+ * de 8 bits. El camino SSE2 procesa 4 pixeles RGBA por registro con
+ * _mm_madd_epi16 y da exactamente el mismo resultado que el escalar.
+ */
+static unsigned char clamp_u8(int v){
+	return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
 
-	int result = 0;
+void rgba_to_ycbcr(const unsigned char *rgba, unsigned char *y, unsigned char *cb, unsigned char *cr, size_t count){
+	size_t i = 0;
+#ifdef __SSE2__
+	__m128i lo_byte = _mm_set1_epi32(0xff);
+	__m128i g_byte = _mm_set1_epi32(0xff00);
+	__m128i one_hi = _mm_set1_epi32(0x10000);
+	__m128i round = _mm_set1_epi32(128);
+	__m128i bias = _mm_set1_epi16(128);
+	// pares (R,G) y (B,1) por pixel; el 1 aplica el redondeo/desplazamiento
+	__m128i y_rg = _mm_set_epi16(150, 77, 150, 77, 150, 77, 150, 77);
+	__m128i y_b1 = _mm_set_epi16(0, 29, 0, 29, 0, 29, 0, 29);
+	__m128i cb_rg = _mm_set_epi16(-85, -43, -85, -43, -85, -43, -85, -43);
+	__m128i cb_b1 = _mm_set_epi16(0, 128, 0, 128, 0, 128, 0, 128);
+	__m128i cr_rg = _mm_set_epi16(-107, 128, -107, 128, -107, 128, -107, 128);
+	__m128i cr_b1 = _mm_set_epi16(0, -21, 0, -21, 0, -21, 0, -21);
+	for (; i + 8 <= count; i += 8){
+		__m128i px[2], ys[2], cbs[2], crs[2];
+		px[0] = _mm_loadu_si128((const __m128i *)(rgba + 4 * i));
+		px[1] = _mm_loadu_si128((const __m128i *)(rgba + 4 * i + 16));
+		for (int k = 0; k < 2; k++){
+			__m128i rg = _mm_or_si128(_mm_and_si128(px[k], lo_byte),
+			                          _mm_slli_epi32(_mm_and_si128(px[k], g_byte), 8));
+			__m128i b1 = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(px[k], 16), lo_byte), one_hi);
+			ys[k] = _mm_add_epi32(_mm_madd_epi16(rg, y_rg), _mm_madd_epi16(b1, y_b1));
+			cbs[k] = _mm_add_epi32(_mm_madd_epi16(rg, cb_rg), _mm_madd_epi16(b1, cb_b1));
+			crs[k] = _mm_add_epi32(_mm_madd_epi16(rg, cr_rg), _mm_madd_epi16(b1, cr_b1));
+			ys[k] = _mm_srai_epi32(_mm_add_epi32(ys[k], round), 8);
+			cbs[k] = _mm_srai_epi32(_mm_add_epi32(cbs[k], round), 8);
+			crs[k] = _mm_srai_epi32(_mm_add_epi32(crs[k], round), 8);
+		}
+		__m128i vy = _mm_packs_epi32(ys[0], ys[1]);
+		__m128i vcb = _mm_add_epi16(_mm_packs_epi32(cbs[0], cbs[1]), bias);
+		__m128i vcr = _mm_add_epi16(_mm_packs_epi32(crs[0], crs[1]), bias);
+		_mm_storel_epi64((__m128i *)(y + i), _mm_packus_epi16(vy, vy));
+		_mm_storel_epi64((__m128i *)(cb + i), _mm_packus_epi16(vcb, vcb));
+		_mm_storel_epi64((__m128i *)(cr + i), _mm_packus_epi16(vcr, vcr));
+	}
+#endif
+	for (; i < count; i++){
+		int r = rgba[4 * i], g = rgba[4 * i + 1], b = rgba[4 * i + 2];
+		y[i] = clamp_u8((77 * r + 150 * g + 29 * b + 128) >> 8);
+		cb[i] = clamp_u8(((-43 * r - 85 * g + 128 * b + 128) >> 8) + 128);
+		cr[i] = clamp_u8(((128 * r - 107 * g - 21 * b + 128) >> 8) + 128);
+	}
+}
+
+// Escribe R, G y B en rgba; el canal alfa se conserva
+void ycbcr_to_rgba(const unsigned char *y, const unsigned char *cb, const unsigned char *cr, unsigned char *rgba, size_t count){
+	size_t i = 0;
+#ifdef __SSE2__
+	__m128i zero = _mm_setzero_si128();
+	__m128i bias = _mm_set1_epi16(128);
+	__m128i round = _mm_set1_epi32(128);
+	__m128i alpha = _mm_set1_epi32((int)0xff000000);
+	// pares (Cb,Cr) centrados en 0
+	__m128i r_c = _mm_set_epi16(359, 0, 359, 0, 359, 0, 359, 0);
+	__m128i g_c = _mm_set_epi16(-183, -88, -183, -88, -183, -88, -183, -88);
+	__m128i b_c = _mm_set_epi16(0, 454, 0, 454, 0, 454, 0, 454);
+	for (; i + 8 <= count; i += 8){
+		__m128i vy = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(y + i)), zero);
+		__m128i vcb = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(cb + i)), zero), bias);
+		__m128i vcr = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(cr + i)), zero), bias);
+		__m128i c_lo = _mm_unpacklo_epi16(vcb, vcr);
+		__m128i c_hi = _mm_unpackhi_epi16(vcb, vcr);
+#define YCC_CHANNEL(coef) _mm_add_epi16(vy, _mm_packs_epi32( \
+			_mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(c_lo, coef), round), 8), \
+			_mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(c_hi, coef), round), 8)))
+		__m128i r = YCC_CHANNEL(r_c);
+		__m128i g = YCC_CHANNEL(g_c);
+		__m128i b = YCC_CHANNEL(b_c);
+#undef YCC_CHANNEL
+		r = _mm_packus_epi16(r, r);
+		g = _mm_packus_epi16(g, g);
+		b = _mm_packus_epi16(b, b);
+		__m128i rg = _mm_unpacklo_epi8(r, g);
+		__m128i b0 = _mm_unpacklo_epi8(b, zero);
+		__m128i *dst = (__m128i *)(rgba + 4 * i);
+		__m128i old0 = _mm_loadu_si128(dst);
+		__m128i old1 = _mm_loadu_si128(dst + 1);
+		_mm_storeu_si128(dst, _mm_or_si128(_mm_unpacklo_epi16(rg, b0), _mm_and_si128(old0, alpha)));
+		_mm_storeu_si128(dst + 1, _mm_or_si128(_mm_unpackhi_epi16(rg, b0), _mm_and_si128(old1, alpha)));
+	}
+#endif
+	for (; i < count; i++){
+		int vcb = cb[i] - 128, vcr = cr[i] - 128;
+		rgba[4 * i]     = clamp_u8(y[i] + ((359 * vcr + 128) >> 8));
+		rgba[4 * i + 1] = clamp_u8(y[i] + ((-88 * vcb - 183 * vcr + 128) >> 8));
+		rgba[4 * i + 2] = clamp_u8(y[i] + ((454 * vcb + 128) >> 8));
+	}
+}
 
-	// Guarda el archivo con extension correcta
+/*
+ * Ecualiza solo la luminancia de una imagen RGBA, in-place: RGB -> YCbCr,
+ * ecualiza Y con el modo pedido y vuelve a RGB con el croma original.
+ */
+static int equalize_color(const struct eq_options *opts, unsigned char *rgba, int width, int height){
+	mem_stage(MEM_STAGE_EQUALIZE);
+	size_t size = (size_t)width * height;
+	unsigned char *planes = mem_alloc(size * 4);
+	if (!planes) return -1;
+
+	unsigned char *y = planes, *cb = planes + size, *cr = planes + 2 * size, *y_eq = planes + 3 * size;
+	rgba_to_ycbcr(rgba, y, cb, cr, size);
+	int result = equalize(opts, y, y_eq, width, height);
+	if (result == 0){
+		ycbcr_to_rgba(y_eq, cb, cr, rgba, size);
+	}
+
+	mem_free(planes);
+	return result;
+}
+
+// Guarda el archivo con extension correcta
+static int write_equalized(const char *input_filepath, const char *output_filepath,
+                           int width, int height, int comp, const unsigned char *pixels){
+	int stride = width * comp;
+	mem_stage(MEM_STAGE_ENCODE);
     if (strstr(input_filepath, ".png") || strstr(input_filepath, ".PNG")) {
-        if (!stbi_write_png(output_filepath, width, height, 1, out, width)) {
-            result = -1;
+        if (!stbi_write_png(output_filepath, width, height, comp, pixels, stride)) {
+            return -1;
         }
     } else if (strstr(input_filepath, ".jpg") || strstr(input_filepath, ".jpeg") || 
                strstr(input_filepath, ".JPG") || strstr(input_filepath, ".JPEG")) {
-        if (!stbi_write_jpg(output_filepath, width, height, 1, out, 90)) {
-            result = -1;
+        if (!stbi_write_jpg(output_filepath, width, height, comp, pixels, 90)) {
+            return -1;
         }
     } else {
-        if (!stbi_write_png(output_filepath, width, height, 1, out, width)) {
-            result = -1;
+        if (!stbi_write_png(output_filepath, width, height, comp, pixels, stride)) {
+            return -1;
         }
     }
+	return 0;
+}
+
+/*
+ * Camino de alta precision. Las imagenes de 16 bits se ecualizan con un
+ * histograma de 65536 bins (memoria fija de ~384 KB, sin importar el
+ * tamano de la imagen) y se guardan como PNG de 16 bits. Las HDR se
+ * ecualizan sobre log2 de la luminancia: el rango dinamico original se
+ * conserva y el color se mantiene escalando RGB por el mismo factor.
+ */
+#define EQ16_LEVELS 65536
+#define HDR_BINS 4096
+#define HDR_CHUNK 4096
+#define HDR_MIN_LUMINANCE 1e-9f
+
+int histogram_equalization_16(const unsigned short *image, unsigned short *out_image, int width, int height){
+	size_t size = (size_t)width * height;
+	unsigned int *hist = mem_calloc(EQ16_LEVELS, sizeof(unsigned int));
+	unsigned short *lut = mem_alloc(EQ16_LEVELS * sizeof(unsigned short));
+	if (!hist || !lut){
+		mem_free(hist);
+		mem_free(lut);
+		return -1;
+	}
+
+	for (size_t i = 0; i < size; i++){
+		hist[image[i]]++;
+	}
+
+	unsigned long long cum = 0;
+	for (int i = 0; i < EQ16_LEVELS; i++){
+		cum += hist[i];
+		lut[i] = (double)cum / size * (EQ16_LEVELS - 1);
+	}
+
+	size_t i = 0;
+	for (; i + 4 <= size; i += 4){
+		out_image[i] = lut[image[i]];
+		out_image[i + 1] = lut[image[i + 1]];
+		out_image[i + 2] = lut[image[i + 2]];
+		out_image[i + 3] = lut[image[i + 3]];
+	}
+	for (; i < size; i++){
+		out_image[i] = lut[image[i]];
+	}
+
+	mem_free(hist);
+	mem_free(lut);
+	return 0;
+}
+
+// Aproximaciones polinomicas de log2/exp2 (error < 4e-5 stops), iguales en SSE2 y escalar
+#define LOG2_C5  0.043428907822f
+#define LOG2_C4 -0.404867174419f
+#define LOG2_C3  1.593901363497f
+#define LOG2_C2 -3.492494279876f
+#define LOG2_C1  5.046876044974f
+#define LOG2_C0 -2.786812953867f
+#define EXP2_C5  0.001894379423f
+#define EXP2_C4  0.008940582529f
+#define EXP2_C3  0.055876556869f
+#define EXP2_C2  0.240131691872f
+#define EXP2_C1  0.693156776699f
+#define EXP2_C0  0.999999769634f
+
+static float fast_log2(float x){
+	union { float f; int i; } u = { x };
+	float e = (float)((u.i >> 23) - 127);
+	u.i = (u.i & 0x7fffff) | 0x3f800000;
+	float m = u.f;
+	return e + (((((LOG2_C5 * m + LOG2_C4) * m + LOG2_C3) * m + LOG2_C2) * m + LOG2_C1) * m + LOG2_C0);
+}
+
+static float fast_exp2(float x){
+	if (x < -126.0f) x = -126.0f;
+	if (x > 127.0f) x = 127.0f;
+	int i = (int)x;
+	if ((float)i > x) i--;
+	float f = x - i;
+	union { float f; int i; } u;
+	u.f = ((((EXP2_C5 * f + EXP2_C4) * f + EXP2_C3) * f + EXP2_C2) * f + EXP2_C1) * f + EXP2_C0;
+	u.i += i << 23;
+	return u.f;
+}
+
+#ifdef __SSE2__
+static __m128 fast_log2_ps(__m128 x){
+	__m128i bits = _mm_castps_si128(x);
+	__m128 e = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(127)));
+	__m128 m = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x7fffff)),
+	                                         _mm_set1_epi32(0x3f800000)));
+	__m128 p = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(LOG2_C5), m), _mm_set1_ps(LOG2_C4));
+	p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(LOG2_C3));
+	p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(LOG2_C2));
+	p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(LOG2_C1));
+	p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(LOG2_C0));
+	return _mm_add_ps(e, p);
+}
+
+static __m128 fast_exp2_ps(__m128 x){
+	x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-126.0f)), _mm_set1_ps(127.0f));
+	__m128i i = _mm_cvttps_epi32(x);
+	// cvttps trunca hacia cero; corrige para obtener floor en negativos
+	__m128 fi = _mm_cvtepi32_ps(i);
+	__m128i adjust = _mm_castps_si128(_mm_cmpgt_ps(fi, x));
+	i = _mm_add_epi32(i, adjust);
+	__m128 f = _mm_sub_ps(x, _mm_cvtepi32_ps(i));
+	__m128 p = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(EXP2_C5), f), _mm_set1_ps(EXP2_C4));
+	p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(EXP2_C3));
+	p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(EXP2_C2));
+	p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(EXP2_C1));
+	p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(EXP2_C0));
+	return _mm_castsi128_ps(_mm_add_epi32(_mm_castps_si128(p), _mm_slli_epi32(i, 23)));
+}
+#endif
+
+// log2 de la luminancia (Rec. 709) de count pixeles RGBA float
+static void hdr_log_luminance(const float *rgba, float *out, size_t count){
+	size_t i = 0;
+#ifdef __SSE2__
+	__m128 wr = _mm_set1_ps(0.2126f), wg = _mm_set1_ps(0.7152f), wb = _mm_set1_ps(0.0722f);
+	__m128 floor_lum = _mm_set1_ps(HDR_MIN_LUMINANCE);
+	for (; i + 4 <= count; i += 4){
+		__m128 p0 = _mm_loadu_ps(rgba + 4 * i);
+		__m128 p1 = _mm_loadu_ps(rgba + 4 * i + 4);
+		__m128 p2 = _mm_loadu_ps(rgba + 4 * i + 8);
+		__m128 p3 = _mm_loadu_ps(rgba + 4 * i + 12);
+		_MM_TRANSPOSE4_PS(p0, p1, p2, p3);	// p0=R, p1=G, p2=B de los 4 pixeles
+		__m128 lum = _mm_add_ps(_mm_add_ps(_mm_mul_ps(p0, wr), _mm_mul_ps(p1, wg)), _mm_mul_ps(p2, wb));
+		_mm_storeu_ps(out + i, fast_log2_ps(_mm_max_ps(lum, floor_lum)));
+	}
+#endif
+	for (; i < count; i++){
+		float lum = 0.2126f * rgba[4 * i] + 0.7152f * rgba[4 * i + 1] + 0.0722f * rgba[4 * i + 2];
+		out[i] = fast_log2(lum > HDR_MIN_LUMINANCE ? lum : HDR_MIN_LUMINANCE);
+	}
+}
+
+int hdr_equalization(float *rgba, int width, int height){
+	size_t size = (size_t)width * height;
+	float loglum[HDR_CHUNK];
+	float delta[HDR_CHUNK];
+	float lo = 1e30f, hi = -1e30f;
+
+	// 1. rango de log2(Y)
+	for (size_t start = 0; start < size; start += HDR_CHUNK){
+		size_t n = size - start < HDR_CHUNK ? size - start : HDR_CHUNK;
+		hdr_log_luminance(rgba + 4 * start, loglum, n);
+		for (size_t k = 0; k < n; k++){
+			if (loglum[k] < lo) lo = loglum[k];
+			if (loglum[k] > hi) hi = loglum[k];
+		}
+	}
+	if (!(hi - lo > 1e-6f)) return 0;	// imagen plana: nada que ecualizar
+
+	// 2. histograma logaritmico y CDF acumulada por borde de bin
+	unsigned int *hist = mem_calloc(HDR_BINS, sizeof(unsigned int));
+	float *cdf = mem_alloc((HDR_BINS + 1) * sizeof(float));
+	if (!hist || !cdf){
+		mem_free(hist);
+		mem_free(cdf);
+		return -1;
+	}
+	float bins_per_stop = HDR_BINS / (hi - lo);
+	for (size_t start = 0; start < size; start += HDR_CHUNK){
+		size_t n = size - start < HDR_CHUNK ? size - start : HDR_CHUNK;
+		hdr_log_luminance(rgba + 4 * start, loglum, n);
+		for (size_t k = 0; k < n; k++){
+			int b = (int)((loglum[k] - lo) * bins_per_stop);
+			hist[b < 0 ? 0 : (b >= HDR_BINS ? HDR_BINS - 1 : b)]++;
+		}
+	}
+	unsigned long long cum = 0;
+	cdf[0] = 0;
+	for (int b = 0; b < HDR_BINS; b++){
+		cum += hist[b];
+		cdf[b + 1] = (double)cum / size;
+	}
+	mem_free(hist);
+
+	// 3. nueva luminancia = lo + CDF * rango; RGB se escala por 2^(nuevo - viejo)
+	for (size_t start = 0; start < size; start += HDR_CHUNK){
+		size_t n = size - start < HDR_CHUNK ? size - start : HDR_CHUNK;
+		float *px = rgba + 4 * start;
+		hdr_log_luminance(px, loglum, n);
+		for (size_t k = 0; k < n; k++){
+			float pos = (loglum[k] - lo) * bins_per_stop;
+			int b = (int)pos;
+			if (b < 0) b = 0;
+			if (b >= HDR_BINS) b = HDR_BINS - 1;
+			float t = pos - b;
+			float c = cdf[b] + t * (cdf[b + 1] - cdf[b]);
+			delta[k] = lo + c * (hi - lo) - loglum[k];
+		}
+		size_t k = 0;
+#ifdef __SSE2__
+		__m128 keep_alpha = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+		__m128 alpha_one = _mm_set_ps(1.0f, 0, 0, 0);
+		for (; k + 4 <= n; k += 4){
+			__m128 s = fast_exp2_ps(_mm_loadu_ps(delta + k));
+			for (int j = 0; j < 4; j++){
+				__m128 sj;
+				switch (j){
+				case 0: sj = _mm_shuffle_ps(s, s, _MM_SHUFFLE(0, 0, 0, 0)); break;
+				case 1: sj = _mm_shuffle_ps(s, s, _MM_SHUFFLE(1, 1, 1, 1)); break;
+				case 2: sj = _mm_shuffle_ps(s, s, _MM_SHUFFLE(2, 2, 2, 2)); break;
+				default: sj = _mm_shuffle_ps(s, s, _MM_SHUFFLE(3, 3, 3, 3)); break;
+				}
+				sj = _mm_or_ps(_mm_and_ps(sj, keep_alpha), alpha_one);
+				_mm_storeu_ps(px + 4 * (k + j), _mm_mul_ps(_mm_loadu_ps(px + 4 * (k + j)), sj));
+			}
+		}
+#endif
+		for (; k < n; k++){
+			float s = fast_exp2(delta[k]);
+			px[4 * k] *= s;
+			px[4 * k + 1] *= s;
+			px[4 * k + 2] *= s;
+		}
+	}
+
+	mem_free(cdf);
+	return 0;
+}
+
+static int process_hdr_equalization(const char *input_filepath, const char *output_filepath){
+	int width, height, channels;
+	float *data = stbi_loadf(input_filepath, &width, &height, &channels, 4);
+	if (!data) {
+		fprintf(stderr, "Failed to load HDR image for histogram: %s\n", input_filepath);
+		return -1;
+	}
+
+	mem_stage(MEM_STAGE_EQUALIZE);
+	int result = hdr_equalization(data, width, height);
+	mem_stage(MEM_STAGE_ENCODE);
+	if (result == 0 && !stbi_write_hdr(output_filepath, width, height, 4, data)){
+		result = -1;
+	}
+	stbi_image_free(data);
+	return result;
+}
+
+// Las imagenes de 16 bits se reducen a luminancia en el propio decodificador
+static int process_16bit_equalization(const char *input_filepath, const char *output_filepath){
+	int width, height, channels;
+	unsigned short *data = stbi_load_16(input_filepath, &width, &height, &channels, 1);
+	if (!data) {
+		fprintf(stderr, "Failed to load 16-bit image for histogram: %s\n", input_filepath);
+		return -1;
+	}
+
+	mem_stage(MEM_STAGE_EQUALIZE);
+	unsigned short *out = mem_alloc((size_t)width * height * sizeof(unsigned short));
+	int result = -1;
+	if (out && histogram_equalization_16(data, out, width, height) == 0){
+		mem_stage(MEM_STAGE_ENCODE);
+		result = stbi_write_png_16(output_filepath, width, height, 1, out, width * 2) ? 0 : -1;
+	}
+	mem_free(out);
 	stbi_image_free(data);
-	free(out);
+	return result;
+}
+
+/*
+ * Buffers de trabajo que se conservan entre peticiones, uno por hilo: la
+ * imagen se decodifica directamente en el suyo (stbi_load_into) y la salida
+ * y el gris tampoco se vuelven a pedir. El decodificador de cada hilo
+ * guarda tambien su estado (tablas Huffman, ventana de inflate) de una
+ * imagen a la siguiente. Por eso son persistentes y no de la arena de la
+ * peticion, pero se le prestan mientras los usa: cuentan como vivos en ella
+ * hasta eq_buffers_reclaim. Ahi se libera el que pase de EQ_BUFFER_KEEP,
+ * como hace el decodificador con STBI_DECODER_KEEP: una imagen enorme no
+ * deja cientos de MB en el hilo para siempre.
+ */
+#define EQ_BUFFER_KEEP ((size_t)16 << 20)	// 4 MP en RGBA
+
+struct eq_buffer {
+	unsigned char *data;
+	size_t size;
+};
+
+static _Thread_local struct eq_buffer eq_image_buf, eq_out_buf, eq_gray_buf;
+static _Thread_local stbi_decoder *eq_decoder;
+
+static unsigned char *eq_buffer_reserve(struct eq_buffer *b, size_t size){
+	if (size > b->size){
+		mem_free(b->data);
+		b->data = mem_alloc_persistent(size);
+		b->size = b->data ? size : 0;
+	}
+	mem_lend(b->data);
+	return b->data;
+}
+
+static void eq_buffer_reclaim(struct eq_buffer *b){
+	mem_reclaim(b->data);
+	if (b->size > EQ_BUFFER_KEEP){
+		mem_free(b->data);
+		b->data = NULL;
+		b->size = 0;
+	}
+}
+
+static void eq_buffers_reclaim(void){
+	eq_buffer_reclaim(&eq_image_buf);
+	eq_buffer_reclaim(&eq_out_buf);
+	eq_buffer_reclaim(&eq_gray_buf);
+}
+
+// Ecualiza en gris una imagen de 1 canal, o de 3 pasandola antes a gris, y la escribe
+static int equalize_gray_and_write(const struct eq_options *opts, const char *input_filepath,
+                                   const char *output_filepath, unsigned char *data,
+                                   int width, int height, int channels){
+	size_t size = (size_t)width * height;
+	unsigned char *out = eq_buffer_reserve(&eq_out_buf, size);
+	
+	if (!out) {
+		return -1;
+	}
+
+	int result;
+	if (channels > 1){
+		unsigned char* gray = eq_buffer_reserve(&eq_gray_buf, (size_t) width*height);
+		if (!gray) {
+			return -1;
+		}
+		to_grayscale(data, gray, width, height);
+		result = equalize(opts, gray, out, width, height);
+	}else{
+		result = equalize(opts, data, out, width, height);
+	}
+
+	if (result == 0){
+		result = write_equalized(input_filepath, output_filepath, width, height, 1, out);
+	}
+	return result;
+}
+
+static int equalize_file(const char *input_filepath, const char *output_filepath,
+                         const struct eq_options *opts){
+	struct eq_options defaults;
+	if (!opts){
+		eq_options_default(&defaults);
+		opts = &defaults;
+	}
+	mem_stage(MEM_STAGE_DECODE);
+	eq_last_sampling_error = 0;
+
+	if (opts->high_precision){
+		if (stbi_is_hdr(input_filepath)) return process_hdr_equalization(input_filepath, output_filepath);
+		if (stbi_is_16_bit(input_filepath)) return process_16bit_equalization(input_filepath, output_filepath);
+	}
+
+	int width, height, channels;
+	/*
+	 * PGM/PPM binario de 8 bits (el escaner los manda asi): no hay nada que
+	 * decodificar, los pixeles se leen directamente del archivo mapeado.
+	 * En modo color hace falta RGBA, asi que un PPM sigue el camino normal.
+	 */
+	stbi_pnm_mapping map;
+	unsigned char *mapped = stbi_load_pnm_mapped(input_filepath, &width, &height, &channels, 0, &map);
+	if (mapped && (channels == 1 || !opts->preserve_color)){
+		int result = equalize_gray_and_write(opts, input_filepath, output_filepath, mapped,
+		                                     width, height, channels);
+		stbi_pnm_unmap(&map);
+		return result;
+	}
+	stbi_pnm_unmap(&map);
+
+	// Las dimensiones dan el tamano del buffer donde se decodifica
+	if (!stbi_info(input_filepath, &width, &height, &channels)) {
+        fprintf(stderr, "Failed to load image for histogram: %s\n", input_filepath);
+        return -1;
+    }
+	// En modo color se decodifica directamente a RGBA para la conversion SIMD
+	int color = opts->preserve_color && channels >= 3;
+	size_t size = (size_t)width * height;
+	unsigned char *data = eq_buffer_reserve(&eq_image_buf, size * (color ? 4 : channels));
+	if (!eq_decoder) eq_decoder = stbi_decoder_create();
+	if (!data || !eq_decoder) {
+		return -1;
+	}
+	int loaded = 0;
+	if (!color){
+		// JPEG: el plano Y sale directo del decodificador, sin IDCT, sobremuestreo
+		// ni conversion de color del croma; falla con cualquier otro formato
+		loaded = stbi_decoder_load_jpeg_luma_into(eq_decoder, input_filepath, &width, &height, data, size);
+		channels = 1;
+	}
+	if (!loaded){
+		loaded = stbi_decoder_load_into(eq_decoder, input_filepath, &width, &height, &channels,
+		                                color ? 4 : 0, data, eq_image_buf.size);
+	}
+
+	if (!loaded) {
+        fprintf(stderr, "Failed to load image for histogram: %s\n", input_filepath);
+        return -1;
+    }
+	size = (size_t)width * height;
+
+	if (color){
+		int result = equalize_color(opts, data, width, height);
+		if (result == 0 && channels == 3){
+			// Compacta RGBA -> RGB in-place para la salida de 3 canales
+			for (size_t i = 0; i < size; i++){
+				data[3 * i] = data[4 * i];
+				data[3 * i + 1] = data[4 * i + 1];
+				data[3 * i + 2] = data[4 * i + 2];
+			}
+		}
+		if (result == 0){
+			result = write_equalized(input_filepath, output_filepath, width, height, channels, data);
+		}
+		return result;
+	}
+
+	return equalize_gray_and_write(opts, input_filepath, output_filepath, data, width, height, channels);
+}
+
+int process_histogram_equalization(const char *input_filepath, const char *output_filepath,
+                                   const struct eq_options *opts){
+	int result = equalize_file(input_filepath, output_filepath, opts);
+	eq_buffers_reclaim();
+	return result;
+}
+
+/*
+ * GIF animado: cada fotograma se ecualiza por separado en paralelo y se
+ * guarda como PNG numerado (stb_image_write no codifica GIF). Con
+ * shared_cdf en modo global todos usan la misma LUT, calculada con la suma
+ * de los histogramas de cada fotograma, y el brillo no parpadea entre ellos.
+ */
+struct gif_eq_ctx {
+	const struct gif_animation *anim;
+	const struct eq_options *opts;
+	const char *output_filepath;
+	size_t *hist;		// 256 conteos por fotograma (CDF compartida)
+	size_t *samples;	// pixeles contados en cada fotograma
+	unsigned char lut[256];
+	pthread_mutex_t error_lock;
+	double sampling_error;	// la mayor cota de los fotogramas (muestreo por fotograma)
+};
+
+void gif_frame_filename(const char *output_filepath, int frame, char *out, size_t size){
+	const char *slash = strrchr(output_filepath, '/');
+	const char *dot = strrchr(output_filepath, '.');
+	int base = dot && (!slash || dot > slash) ? (int)(dot - output_filepath) : (int)strlen(output_filepath);
+	snprintf(out, size, "%.*s_%03d.png", base, output_filepath, frame);
+}
+
+// Luminancia (o Y, Cb y Cr en modo color) de un fotograma RGBA
+static void gif_frame_planes(const struct gif_eq_ctx *c, int frame, unsigned char *planes){
+	const unsigned char *rgba = gif_frame(c->anim, frame);
+	size_t size = (size_t)c->anim->width * c->anim->height;
+	if (c->opts->preserve_color){
+		rgba_to_ycbcr(rgba, planes, planes + size, planes + 2 * size, size);
+		return;
+	}
+	for (size_t i = 0; i < size; i++){
+		planes[i] = 0.299 * rgba[4*i] + 0.587 * rgba[4*i + 1] + 0.114 * rgba[4*i + 2];
+	}
+}
+
+// Escribe el fotograma a partir de la luminancia ecualizada y los planos de croma
+static int gif_write_frame(const struct gif_eq_ctx *c, int frame, unsigned char *planes, unsigned char *y_eq){
+	int width = c->anim->width, height = c->anim->height;
+	size_t size = (size_t)width * height;
+	char path[1024];
+	gif_frame_filename(c->output_filepath, frame, path, sizeof(path));
+	mem_stage(MEM_STAGE_ENCODE);
+	if (!c->opts->preserve_color){
+		return stbi_write_png(path, width, height, 1, y_eq, width) ? 0 : -1;
+	}
+	// RGBA a partir del fotograma original para conservar el alfa
+	unsigned char *rgba = planes + 4 * size;
+	memcpy(rgba, gif_frame(c->anim, frame), size * 4);
+	ycbcr_to_rgba(y_eq, planes + size, planes + 2 * size, rgba, size);
+	return stbi_write_png(path, width, height, 4, rgba, width * 4) ? 0 : -1;
+}
+
+// Planos de un fotograma: Y[, Cb, Cr], Y ecualizada[, RGBA]
+static unsigned char *gif_alloc_planes(const struct gif_eq_ctx *c, unsigned char **y_eq){
+	size_t size = (size_t)c->anim->width * c->anim->height;
+	unsigned char *planes = mem_alloc(size * (c->opts->preserve_color ? 8 : 2));
+	if (planes) *y_eq = planes + (c->opts->preserve_color ? 3 : 1) * size;
+	return planes;
+}
+
+static int gif_equalize_frame(void *arg, int frame){
+	struct gif_eq_ctx *c = arg;
+	mem_stage(MEM_STAGE_EQUALIZE);
+	unsigned char *y_eq;
+	unsigned char *planes = gif_alloc_planes(c, &y_eq);
+	if (!planes) return -1;
+
+	gif_frame_planes(c, frame, planes);
+	// La cota de cada fotograma queda en el hilo que lo ecualiza
+	eq_last_sampling_error = 0;
+	int result = equalize(c->opts, planes, y_eq, c->anim->width, c->anim->height);
+	pthread_mutex_lock(&c->error_lock);
+	if (eq_last_sampling_error > c->sampling_error) c->sampling_error = eq_last_sampling_error;
+	pthread_mutex_unlock(&c->error_lock);
+	if (result == 0){
+		result = gif_write_frame(c, frame, planes, y_eq);
+	}
+	mem_free(planes);
+	return result;
+}
+
+static int gif_frame_histogram(void *arg, int frame){
+	struct gif_eq_ctx *c = arg;
+	mem_stage(MEM_STAGE_EQUALIZE);
+	unsigned char *y_eq;
+	unsigned char *planes = gif_alloc_planes(c, &y_eq);
+	if (!planes) return -1;
+
+	gif_frame_planes(c, frame, planes);
+	c->samples[frame] = sampled_histogram(planes, (size_t)c->anim->width * c->anim->height,
+	                                      c->opts->sample_fraction, c->hist + 256 * (size_t)frame);
+	mem_free(planes);
+	return 0;
+}
+
+static int gif_apply_shared_lut(void *arg, int frame){
+	struct gif_eq_ctx *c = arg;
+	mem_stage(MEM_STAGE_EQUALIZE);
+	unsigned char *y_eq;
+	unsigned char *planes = gif_alloc_planes(c, &y_eq);
+	if (!planes) return -1;
+
+	gif_frame_planes(c, frame, planes);
+	apply_lut(c->lut, planes, y_eq, (size_t)c->anim->width * c->anim->height);
+	int result = gif_write_frame(c, frame, planes, y_eq);
+	mem_free(planes);
+	return result;
+}
+
+int process_gif_equalization(const struct gif_animation *anim, const char *output_filepath,
+                             const struct eq_options *opts){
+	struct eq_options defaults;
+	if (!opts){
+		eq_options_default(&defaults);
+		opts = &defaults;
+	}
+	struct gif_eq_ctx c = { anim, opts, output_filepath, NULL, NULL, {0}, PTHREAD_MUTEX_INITIALIZER, 0 };
+	size_t size = (size_t)anim->width * anim->height;
+	mem_stage(MEM_STAGE_EQUALIZE);
+	eq_last_sampling_error = 0;
+
+	if (!opts->shared_cdf || opts->mode != EQ_MODE_GLOBAL){
+		int result = parallel_frames(anim->count, gif_equalize_frame, &c);
+		eq_last_sampling_error = c.sampling_error;
+		return result;
+	}
+
+	c.hist = mem_alloc((size_t)anim->count * 256 * sizeof(size_t));
+	c.samples = mem_alloc((size_t)anim->count * sizeof(size_t));
+	int result = -1;
+	if (c.hist && c.samples && parallel_frames(anim->count, gif_frame_histogram, &c) == 0){
+		size_t counts[256] = {0};
+		size_t samples = 0;
+		for (int f = 0; f < anim->count; f++){
+			for (int i = 0; i < 256; i++){
+				counts[i] += c.hist[256 * (size_t)f + i];
+			}
+			samples += c.samples[f];
+		}
+		equalization_lut(counts, (float)samples, c.lut);
+		eq_last_sampling_error = sampling_error_bound(samples, size * anim->count);
+		result = parallel_frames(anim->count, gif_apply_shared_lut, &c);
+	}
+	mem_free(c.hist);
+	mem_free(c.samples);
 	return result;
 }
@@ -1,8 +1,59 @@
 #ifndef HISTOGRAM_H
 #define HISTOGRAM_H
 
+#include <stddef.h>
+
+// Modos de ecualizacion seleccionables por peticion
+enum eq_mode {
+	EQ_MODE_GLOBAL = 0,	// histograma global (comportamiento original)
+	EQ_MODE_CLAHE,		// ecualizacion adaptativa con limite de contraste
+	EQ_MODE_MATCH		// especificacion contra un histograma de referencia
+};
+
+#define CLAHE_DEFAULT_TILES 8
+#define CLAHE_DEFAULT_CLIP  2.0f
+#define CLAHE_MAX_TILES     64
+#define MAX_REFERENCE_PATH  512
+#define EQ_MIN_SAMPLE_FRACTION 1e-6	// fracciones menores no tienen sentido ni en imagenes enormes
+
+struct eq_options {
+	enum eq_mode mode;
+	int clahe_tiles_x;
+	int clahe_tiles_y;
+	float clahe_clip;	// multiplo del histograma uniforme; <= 0 desactiva el recorte
+	int preserve_color;	// ecualiza solo la luminancia y conserva el color (salida RGB/RGBA)
+	int high_precision;	// 16 bits -> PNG de 16 bits, HDR -> .hdr (siempre ecualizacion global)
+	char reference_path[MAX_REFERENCE_PATH];	// histograma (.hist) o imagen de referencia para EQ_MODE_MATCH
+	double sample_fraction;	// fraccion de pixeles para el histograma global/match (1 = todos)
+	int shared_cdf;		// GIF animado: una sola LUT para todos los fotogramas (solo modo global)
+};
+
+void eq_options_default(struct eq_options *opts);
+
 void to_grayscale(unsigned char *original_data, unsigned char *new_data, int width, int height);
+void rgba_to_ycbcr(const unsigned char *rgba, unsigned char *y, unsigned char *cb, unsigned char *cr, size_t count);
+void ycbcr_to_rgba(const unsigned char *y, const unsigned char *cb, const unsigned char *cr, unsigned char *rgba, size_t count);
+void apply_lut(const unsigned char *lut, const unsigned char *image, unsigned char *out_image, size_t size);
 void histogram_equalization(unsigned char* image, unsigned char* out_image, int width, int height);
-int process_histogram_equalization(const char *input_filepath, const char *output_filepath);
+double histogram_equalization_sampled(const unsigned char *image, unsigned char *out_image, int width, int height,
+                                      double fraction);
+// Devuelve la cota del error de la LUT por el muestreo (0 sin muestreo), o -1 si falla
+double histogram_matching(const unsigned char *image, unsigned char *out_image, int width, int height,
+                          const char *reference_path, double sample_fraction);
+int histogram_equalization_16(const unsigned short *image, unsigned short *out_image, int width, int height);
+int hdr_equalization(float *rgba, int width, int height);
+void clahe_equalization(const unsigned char *image, unsigned char *out_image, int width, int height,
+                        int tiles_x, int tiles_y, float clip_limit);
+int process_histogram_equalization(const char *input_filepath, const char *output_filepath,
+                                   const struct eq_options *opts);
+// Cota (95%) del error de la LUT, en niveles, de la ultima ecualizacion por muestreo
+// de este hilo (process_*_equalization); 0 si no hubo muestreo
+double eq_sampling_error(void);
+
+// GIF animado: escribe cada fotograma ecualizado como <salida sin extension>_NNN.png
+struct gif_animation;
+void gif_frame_filename(const char *output_filepath, int frame, char *out, size_t size);
+int process_gif_equalization(const struct gif_animation *anim, const char *output_filepath,
+                             const struct eq_options *opts);
 
-#endif
\ No newline at end of file
+#endif
@@ -1,6 +1,7 @@
 #!/bin/bash
 
-SRC_FILES="main.c clasificador.c histogram.c stb_wrapper.c"
+# Mismas fuentes que SRCS en el Makefile
+SRC_FILES="main.c clasificador.c histogram.c opciones.c animacion.c memoria.c stb_wrapper.c"
 BIN_PATH="/usr/local/bin/imageserver"
 SERVICE_FILE="/etc/systemd/system/imageserver.service"
 DATA_DIR="/var/lib/imageserver"
@@ -15,7 +16,7 @@ gcc $SRC_FILES -o "$BIN_PATH" -lpthread -lm || { echo "❌ Falló la compilació
 chmod +x "$BIN_PATH"
 
 echo "Creando directorios de almacenamiento en $DATA_DIR..."
-mkdir -p $DATA_DIR/{rojas,verdes,azules,filtrado}
+mkdir -p $DATA_DIR/{rojas,verdes,azules,filtrado,referencias}
 chown -R root:root $DATA_DIR
 chmod -R 755 $DATA_DIR
 
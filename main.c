@@ -9,6 +9,9 @@
 #include <endian.h>
 #include "clasificador.h"
 #include "histogram.h"
+#include "opciones.h"
+#include "animacion.h"
+#include "memoria.h"
 
 #define DEFAULT_PORT 1717
 #define LOG_FILE "/var/log/imageserver.log"
@@ -17,16 +20,43 @@
 #define DIR_VERDES "/var/lib/imageserver/verdes"
 #define DIR_AZULES "/var/lib/imageserver/azules"
 #define DIR_FILTRADO "/var/lib/imageserver/filtrado"
+// High bit of name_len: a length-prefixed options string follows the filename
+#define NAME_LEN_HAS_OPTIONS 0x80000000u
+#define MAX_OPTIONS_LEN 1023
+// Aggregate allocation counters are logged every this many requests
+#define MEM_TOTALS_EVERY 100
 
 
-void log_event(const char *client_ip, const char *filename, const char *status) {
+// mem, if given, is the request's allocation accounting (allocations/bytes/peak per stage)
+void log_event(const char *client_ip, const char *filename, const char *status,
+               const struct mem_request_stats *mem) {
     FILE *f = fopen(LOG_FILE, "a");
     if (!f) return;
     time_t now = time(NULL);
     char *time_str = ctime(&now);
     time_str[strlen(time_str)-1] = '\0'; // Remove newline
-    fprintf(f, "[%s] Cliente: %s, Archivo: %s, Estado: %s\n",
+    fprintf(f, "[%s] Cliente: %s, Archivo: %s, Estado: %s",
             time_str, client_ip, filename, status);
+    if (mem) {
+        char mem_str[512];
+        mem_format_stats(mem, mem_str, sizeof(mem_str));
+        fprintf(f, ", Memoria: %s", mem_str);
+    }
+    fprintf(f, "\n");
+    fclose(f);
+}
+
+// Sums over all requests so far; the peaks are the largest of a single request
+void log_memory_totals(const struct mem_totals *totals) {
+    FILE *f = fopen(LOG_FILE, "a");
+    if (!f) return;
+    time_t now = time(NULL);
+    char *time_str = ctime(&now);
+    time_str[strlen(time_str)-1] = '\0'; // Remove newline
+    char mem_str[512];
+    mem_format_stats(&totals->sum, mem_str, sizeof(mem_str));
+    fprintf(f, "[%s] Memoria acumulada (%llu peticiones): %s\n",
+            time_str, totals->requests, mem_str);
     fclose(f);
 }
 
@@ -71,6 +101,7 @@ int main() {
     ensure_dir_exists(DIR_VERDES);
     ensure_dir_exists(DIR_AZULES);
     ensure_dir_exists(DIR_FILTRADO);
+    ensure_dir_exists(DIR_REFERENCIAS);
 
     server_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd < 0) { perror("socket"); return 1; }
@@ -104,6 +135,8 @@ int main() {
             close(client_fd); continue;
         }
         uint32_t name_len = ntohl(name_len_net);
+        int has_options = (name_len & NAME_LEN_HAS_OPTIONS) != 0;
+        name_len &= ~NAME_LEN_HAS_OPTIONS;
         if (name_len == 0 || name_len > 1024) { close(client_fd); continue; }
 
         // Receive filename
@@ -113,6 +146,24 @@ int main() {
         }
         namebuf[name_len] = '\0';
 
+        // Receive optional per-request processing options
+        struct request_options opts;
+        request_options_default(&opts);
+        if (has_options) {
+            uint32_t opt_len_net;
+            if (recv_all(client_fd, &opt_len_net, sizeof(opt_len_net)) <= 0) {
+                close(client_fd); continue;
+            }
+            uint32_t opt_len = ntohl(opt_len_net);
+            if (opt_len > MAX_OPTIONS_LEN) { close(client_fd); continue; }
+            char optbuf[MAX_OPTIONS_LEN + 1];
+            if (opt_len > 0 && recv_all(client_fd, optbuf, opt_len) <= 0) {
+                close(client_fd); continue;
+            }
+            optbuf[opt_len] = '\0';
+            parse_request_options(optbuf, &opts);
+        }
+
         // Receive filesize
         int64_t filesize_net;
         if (recv_all(client_fd, &filesize_net, sizeof(filesize_net)) <= 0) {
@@ -147,7 +198,7 @@ int main() {
         if (!ok || remaining != 0) {
             unlink(namebuf);
             send(client_fd, "ERROR: Transfer incompleto\n", 27, 0);
-            log_event(client_ip, namebuf, "TRANSFER ERROR");
+            log_event(client_ip, namebuf, "TRANSFER ERROR", NULL);
             close(client_fd);
             continue;
         }
@@ -159,33 +210,68 @@ int main() {
 
         printf("Procesando imagen %s...\n", namebuf);
 
-        // 1. FIRST: Histogram Equalization (process original file before classification moves it)
+        // Everything the processing allocates comes from this worker's arena
+        mem_request_begin();
+
         generate_histogram_filename(namebuf, hist_output, sizeof(hist_output));
-        histogram_result = process_histogram_equalization(namebuf, hist_output);
-        
-        // 2. SECOND: Color Classification (this will move the original file to appropriate directory)
-        classify_result = classify_image(namebuf, namebuf, DIR_ROJAS, DIR_VERDES, DIR_AZULES);
+        struct gif_animation anim;
+        if (gif_load_animation(namebuf, &anim)) {
+            // Animated GIF: decoded once, frames equalized and classified in parallel
+            char first[480];
+            histogram_result = process_gif_equalization(&anim, hist_output, &opts.eq);
+            classify_result = classify_animation(&anim, namebuf, namebuf, DIR_ROJAS, DIR_VERDES, DIR_AZULES);
+            // Frames are written as <name>_000.png, <name>_001.png, ...
+            gif_frame_filename(hist_output, 0, first, sizeof(first));
+            snprintf(hist_output, sizeof(hist_output), "%s (%d fotogramas)", first, anim.count);
+            gif_free_animation(&anim);
+        } else {
+            // 1. FIRST: Histogram Equalization (process original file before classification moves it)
+            histogram_result = process_histogram_equalization(namebuf, hist_output, &opts.eq);
+
+            // 2. SECOND: Color Classification (this will move the original file to appropriate directory)
+            classify_result = classify_image(namebuf, namebuf, DIR_ROJAS, DIR_VERDES, DIR_AZULES, &opts.cls);
+        }
+
+        struct mem_request_stats mem_stats;
+        mem_request_end(&mem_stats);
 
         // Generate response
+        const char *status;
         if (classify_result == 0 && histogram_result == 0) {
             snprintf(response, sizeof(response), 
                     "OK: Imagen clasificada y ecualizada exitosamente\nEcualizada: %s\n", 
                     hist_output);
-            log_event(client_ip, namebuf, "BOTH OK");
+            status = "BOTH OK";
         } else if (classify_result == 0) {
             snprintf(response, sizeof(response), 
                     "PARCIAL: Clasificación OK, Error en ecualización\n");
-            log_event(client_ip, namebuf, "CLASSIFY OK, HISTOGRAM ERROR");
+            status = "CLASSIFY OK, HISTOGRAM ERROR";
         } else if (histogram_result == 0) {
             snprintf(response, sizeof(response), 
                     "PARCIAL: Error clasificación, Ecualización OK: %s\n", hist_output);
-            log_event(client_ip, namebuf, "CLASSIFY ERROR, HISTOGRAM OK");
+            status = "CLASSIFY ERROR, HISTOGRAM OK";
         } else {
             snprintf(response, sizeof(response), 
                     "ERROR: Falló clasificación y ecualización\n");
-            log_event(client_ip, namebuf, "BOTH ERROR");
+            status = "BOTH ERROR";
         }
 
+        // Sampled equalization: the client and the log get the LUT error bound
+        double lut_error = eq_sampling_error();
+        char status_buf[128];
+        if (histogram_result == 0 && lut_error > 0) {
+            size_t len = strlen(response);
+            snprintf(response + len, sizeof(response) - len,
+                     "Muestreo: error de la LUT <= %.2f niveles (95%%)\n", lut_error);
+            snprintf(status_buf, sizeof(status_buf), "%s, LUT ERROR <= %.2f", status, lut_error);
+            status = status_buf;
+        }
+        log_event(client_ip, namebuf, status, &mem_stats);
+
+        struct mem_totals totals;
+        mem_totals(&totals);
+        if (totals.requests % MEM_TOTALS_EVERY == 0) log_memory_totals(&totals);
+
         send(client_fd, response, strlen(response), 0);
         close(client_fd);
         
@@ -0,0 +1,338 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "memoria.h"
+
+#define MEM_ALIGN       16
+#define MEM_LARGE       (1 << 20)   // desde aqui, region mapeada propia
+#define MEM_HUGE_PAGE   (2 << 20)
+#define MEM_CHUNK       (4 << 20)   // trozo de arena, alineado a pagina enorme
+#define MEM_KEEP_CHUNKS 4           // trozos que se conservan entre peticiones
+#define MEM_PAGE        4096
+
+enum mem_kind { MEM_HEAP, MEM_ARENA, MEM_MAPPED };
+#define MEM_KIND_MASK 3
+
+/*
+ * Delante de cada bloque; 16 bytes para que los datos sigan alineados. tag
+ * lleva el tipo en los 2 bits bajos y la cuenta donde el bloque esta vivo
+ * (o NULL) en el resto, para descontarlo al liberarlo desde cualquier hilo.
+ */
+struct mem_header {
+    size_t size;
+    uintptr_t tag;
+};
+
+struct mem_account {
+    _Atomic unsigned long long allocs[MEM_STAGES];
+    _Atomic unsigned long long bytes[MEM_STAGES];
+    _Atomic unsigned long long peak[MEM_STAGES];
+    _Atomic long long live;
+};
+
+struct mem_chunk {
+    struct mem_chunk *next;
+    size_t used;
+};
+
+struct mem_arena {
+    struct mem_chunk *chunks;    // los de esta peticion, el actual primero
+    struct mem_chunk *spare;     // vacios, para la siguiente
+    int nspare;
+    struct mem_header *last;     // ultimo bloque: se puede liberar o crecer en su sitio
+    int active;
+};
+
+static _Thread_local struct mem_arena arena;
+static _Thread_local struct mem_account account;
+static _Thread_local struct mem_context current = { NULL, MEM_STAGE_DECODE };
+
+static struct mem_totals totals;
+static pthread_mutex_t totals_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *const stage_names[MEM_STAGES] = {
+    "decodificacion", "ecualizacion", "codificacion", "clasificacion"
+};
+
+static void raise_peak(_Atomic unsigned long long *peak, unsigned long long value) {
+    unsigned long long old = atomic_load_explicit(peak, memory_order_relaxed);
+    while (value > old &&
+           !atomic_compare_exchange_weak_explicit(peak, &old, value, memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+static void count_live(struct mem_account *a, size_t size) {
+    long long now = atomic_fetch_add_explicit(&a->live, (long long)size, memory_order_relaxed) + (long long)size;
+    if (now > 0) raise_peak(&a->peak[current.stage], (unsigned long long)now);
+}
+
+// Anota una reserva en la cuenta del hilo; devuelve la cuenta si el bloque cuenta como vivo
+static struct mem_account *count_alloc(size_t size, int live) {
+    struct mem_account *a = current.account;
+    if (!a) return NULL;
+    int s = current.stage;
+    atomic_fetch_add_explicit(&a->allocs[s], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&a->bytes[s], size, memory_order_relaxed);
+    if (!live) return NULL;
+    count_live(a, size);
+    return a;
+}
+
+static void tag_block(struct mem_header *h, size_t size, enum mem_kind kind, int live) {
+    h->size = size;
+    h->tag = (uintptr_t)count_alloc(size, live) | kind;
+}
+
+static void uncount(const struct mem_header *h) {
+    struct mem_account *a = (struct mem_account *)(h->tag & ~(uintptr_t)MEM_KIND_MASK);
+    if (a) atomic_fetch_sub_explicit(&a->live, (long long)h->size, memory_order_relaxed);
+}
+
+static size_t round_up(size_t n, size_t align) {
+    return (n + align - 1) & ~(align - 1);
+}
+
+static void advise_huge(void *p, size_t len) {
+#ifdef MADV_HUGEPAGE
+    if (len >= MEM_HUGE_PAGE) madvise(p, len, MADV_HUGEPAGE);
+#else
+    (void)p;
+    (void)len;
+#endif
+}
+
+static size_t mapped_length(size_t size) {
+    return round_up(sizeof(struct mem_header) + size, MEM_PAGE);
+}
+
+static void *map_block(size_t size, int live) {
+    if (size > SIZE_MAX - 2 * MEM_PAGE) return NULL;
+    size_t len = mapped_length(size);
+    struct mem_header *h = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (h == MAP_FAILED) return NULL;
+    advise_huge(h, len);
+    tag_block(h, size, MEM_MAPPED, live);
+    return h + 1;
+}
+
+static void *heap_block(size_t size, int live) {
+    if (size > SIZE_MAX - sizeof(struct mem_header)) return NULL;
+    struct mem_header *h = malloc(sizeof(*h) + size);
+    if (!h) return NULL;
+    tag_block(h, size, MEM_HEAP, live);
+    return h + 1;
+}
+
+// Trozo de MEM_CHUNK alineado a MEM_HUGE_PAGE: se recorta lo que sobra del mapeo
+static struct mem_chunk *map_chunk(void) {
+    size_t len = MEM_CHUNK + MEM_HUGE_PAGE;
+    unsigned char *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return NULL;
+    unsigned char *start = (unsigned char *)round_up((uintptr_t)p, MEM_HUGE_PAGE);
+    if (start > p) munmap(p, start - p);
+    if (p + len > start + MEM_CHUNK) munmap(start + MEM_CHUNK, p + len - (start + MEM_CHUNK));
+    advise_huge(start, MEM_CHUNK);
+    return (struct mem_chunk *)start;
+}
+
+static void *arena_block(size_t size) {
+    size_t need = sizeof(struct mem_header) + round_up(size, MEM_ALIGN);
+    struct mem_chunk *c = arena.chunks;
+    if (!c || c->used + need > MEM_CHUNK) {
+        if (arena.spare) {
+            c = arena.spare;
+            arena.spare = c->next;
+            arena.nspare--;
+        } else if (!(c = map_chunk())) {
+            return heap_block(size, 1);
+        }
+        c->used = round_up(sizeof(*c), MEM_ALIGN);
+        c->next = arena.chunks;
+        arena.chunks = c;
+    }
+    struct mem_header *h = (struct mem_header *)((unsigned char *)c + c->used);
+    c->used += need;
+    tag_block(h, size, MEM_ARENA, 1);
+    arena.last = h;
+    return h + 1;
+}
+
+void *mem_alloc(size_t size) {
+    if (size >= MEM_LARGE) return map_block(size, 1);
+    if (arena.active) return arena_block(size);
+    return heap_block(size, 1);
+}
+
+void *mem_alloc_persistent(size_t size) {
+    if (size >= MEM_LARGE) return map_block(size, 0);
+    return heap_block(size, 0);
+}
+
+// Un bloque persistente pasa a contar como vivo en la peticion del hilo
+void mem_lend(void *ptr) {
+    if (!ptr || !current.account) return;
+    struct mem_header *h = (struct mem_header *)ptr - 1;
+    if (h->tag & ~(uintptr_t)MEM_KIND_MASK) return;
+    count_live(current.account, h->size);
+    h->tag |= (uintptr_t)current.account;
+}
+
+// Y deja de contar, aunque la peticion siga
+void mem_reclaim(void *ptr) {
+    if (!ptr) return;
+    struct mem_header *h = (struct mem_header *)ptr - 1;
+    uncount(h);
+    h->tag &= MEM_KIND_MASK;
+}
+
+void *mem_calloc(size_t count, size_t size) {
+    if (size && count > SIZE_MAX / size) return NULL;
+    void *p = mem_alloc(count * size);
+    if (p) memset(p, 0, count * size);
+    return p;
+}
+
+void mem_free(void *ptr) {
+    if (!ptr) return;
+    struct mem_header *h = (struct mem_header *)ptr - 1;
+    int kind = h->tag & MEM_KIND_MASK;
+    uncount(h);
+    if (kind == MEM_HEAP) {
+        free(h);
+    } else if (kind == MEM_MAPPED) {
+        munmap(h, mapped_length(h->size));
+    } else if (h == arena.last) {
+        // El ultimo de la arena de este hilo se devuelve; el resto espera al final de la peticion
+        arena.chunks->used = (unsigned char *)h - (unsigned char *)arena.chunks;
+        arena.last = NULL;
+    }
+}
+
+void *mem_realloc(void *ptr, size_t size) {
+    if (!ptr) return mem_alloc(size);
+    struct mem_header *h = (struct mem_header *)ptr - 1;
+    size_t old = h->size;
+    int kind = h->tag & MEM_KIND_MASK;
+    // Lo que no contaba como vivo (lo persistente) sigue sin contar
+    int live = (h->tag & ~(uintptr_t)MEM_KIND_MASK) != 0;
+
+    if (kind == MEM_HEAP && size < MEM_LARGE) {
+        struct mem_header *n = realloc(h, sizeof(*h) + size);
+        if (!n) return NULL;
+        uncount(n);
+        tag_block(n, size, MEM_HEAP, live);
+        return n + 1;
+    }
+#ifdef MREMAP_MAYMOVE
+    if (kind == MEM_MAPPED) {
+        struct mem_header *n = mremap(h, mapped_length(old), mapped_length(size), MREMAP_MAYMOVE);
+        if (n == MAP_FAILED) return NULL;
+        if (n != h) advise_huge(n, mapped_length(size));
+        uncount(n);
+        tag_block(n, size, MEM_MAPPED, live);
+        return n + 1;
+    }
+#endif
+    if (kind == MEM_ARENA && h == arena.last && size < MEM_LARGE) {
+        size_t start = (unsigned char *)h - (unsigned char *)arena.chunks;
+        size_t need = sizeof(*h) + round_up(size, MEM_ALIGN);
+        if (start + need <= MEM_CHUNK) {
+            arena.chunks->used = start + need;
+            uncount(h);
+            tag_block(h, size, MEM_ARENA, 1);
+            return ptr;
+        }
+    }
+
+    void *n = live ? mem_alloc(size) : mem_alloc_persistent(size);
+    if (!n) return NULL;
+    memcpy(n, ptr, old < size ? old : size);
+    mem_free(ptr);
+    return n;
+}
+
+void mem_request_begin(void) {
+    memset(&account, 0, sizeof(account));
+    current.account = &account;
+    current.stage = MEM_STAGE_DECODE;
+    arena.active = 1;
+}
+
+// Todo lo de la arena queda libre; se conservan unos pocos trozos ya paginados
+void mem_request_end(struct mem_request_stats *stats) {
+    struct mem_request_stats r;
+    memset(&r, 0, sizeof(r));
+    for (int s = 0; s < MEM_STAGES; s++) {
+        r.stage[s].allocs = atomic_load_explicit(&account.allocs[s], memory_order_relaxed);
+        r.stage[s].bytes = atomic_load_explicit(&account.bytes[s], memory_order_relaxed);
+        r.stage[s].peak = atomic_load_explicit(&account.peak[s], memory_order_relaxed);
+        r.allocs += r.stage[s].allocs;
+        r.bytes += r.stage[s].bytes;
+        if (r.stage[s].peak > r.peak) r.peak = r.stage[s].peak;
+    }
+    if (stats) *stats = r;
+
+    pthread_mutex_lock(&totals_lock);
+    totals.requests++;
+    for (int s = 0; s < MEM_STAGES; s++) {
+        totals.sum.stage[s].allocs += r.stage[s].allocs;
+        totals.sum.stage[s].bytes += r.stage[s].bytes;
+        if (r.stage[s].peak > totals.sum.stage[s].peak) totals.sum.stage[s].peak = r.stage[s].peak;
+    }
+    totals.sum.allocs += r.allocs;
+    totals.sum.bytes += r.bytes;
+    if (r.peak > totals.sum.peak) totals.sum.peak = r.peak;
+    pthread_mutex_unlock(&totals_lock);
+    current.account = NULL;
+
+    struct mem_chunk *c = arena.chunks;
+    while (c) {
+        struct mem_chunk *next = c->next;
+        if (arena.nspare < MEM_KEEP_CHUNKS) {
+            c->next = arena.spare;
+            arena.spare = c;
+            arena.nspare++;
+        } else {
+            munmap(c, MEM_CHUNK);
+        }
+        c = next;
+    }
+    arena.chunks = NULL;
+    arena.last = NULL;
+    arena.active = 0;
+}
+
+void mem_stage(enum mem_stage stage) {
+    current.stage = stage;
+}
+
+struct mem_context mem_context_current(void) {
+    return current;
+}
+
+void mem_context_attach(struct mem_context ctx) {
+    current = ctx;
+}
+
+void mem_totals(struct mem_totals *out) {
+    pthread_mutex_lock(&totals_lock);
+    *out = totals;
+    pthread_mutex_unlock(&totals_lock);
+}
+
+void mem_format_stats(const struct mem_request_stats *stats, char *out, size_t size) {
+    size_t len = 0;
+    out[0] = '\0';
+    for (int s = 0; s < MEM_STAGES && len < size; s++) {
+        len += snprintf(out + len, size - len, "%s=%llu/%llu/%llu ", stage_names[s],
+                        stats->stage[s].allocs, stats->stage[s].bytes, stats->stage[s].peak);
+    }
+    if (len < size) {
+        snprintf(out + len, size - len, "total=%llu/%llu/%llu", stats->allocs, stats->bytes, stats->peak);
+    }
+}
@@ -0,0 +1,84 @@
+#ifndef MEMORIA_H
+#define MEMORIA_H
+
+#include <stddef.h>
+
+/*
+ * Memoria de cada peticion. Entre mem_request_begin y mem_request_end los
+ * bloques pequenos que pide el hilo salen de su propia arena (sin bloqueos
+ * entre hilos) y se recuperan todos juntos al terminar; los grandes son
+ * regiones mapeadas aparte, con paginas enormes, que se devuelven al
+ * sistema en cuanto se liberan. Fuera de una peticion, o en hilos que no la
+ * abrieron (los de JPEG o de fotogramas), se usa el heap. mem_free y
+ * mem_realloc aceptan cualquier bloque de mem_alloc, venga de donde venga.
+ */
+void *mem_alloc(size_t size);
+void *mem_calloc(size_t count, size_t size);
+void *mem_realloc(void *ptr, size_t size);
+void mem_free(void *ptr);
+
+/*
+ * Para lo que debe sobrevivir a la peticion (buffers que guarda un
+ * decodificador o que se reutilizan de una peticion a la siguiente). Cuenta
+ * como reserva de la etapa en curso; entre mem_lend y mem_reclaim sus bytes
+ * cuentan ademas como vivos en la peticion que lo esta usando.
+ */
+void *mem_alloc_persistent(size_t size);
+void mem_lend(void *ptr);
+void mem_reclaim(void *ptr);
+
+/*
+ * Contabilidad de cada peticion, por etapa: numero de reservas, bytes
+ * pedidos (un realloc cuenta como reserva del tamano nuevo) y pico de bytes
+ * vivos de la peticion mientras el hilo estaba en esa etapa. Cuesta unas
+ * pocas operaciones atomicas por reserva. Los hilos que reparten trabajo de
+ * la peticion heredan su contexto con mem_context_attach; lo que reservan
+ * los hilos JPEG de stb_image no se cuenta. Lo persistente cuenta como
+ * reserva, y como vivo solo mientras esta prestado a la peticion.
+ */
+enum mem_stage {
+    MEM_STAGE_DECODE = 0,
+    MEM_STAGE_EQUALIZE,     // gris y ecualizacion
+    MEM_STAGE_ENCODE,
+    MEM_STAGE_CLASSIFY,
+    MEM_STAGES
+};
+
+struct mem_stage_stats {
+    unsigned long long allocs;
+    unsigned long long bytes;
+    unsigned long long peak;
+};
+
+struct mem_request_stats {
+    struct mem_stage_stats stage[MEM_STAGES];
+    unsigned long long allocs;
+    unsigned long long bytes;
+    unsigned long long peak;
+};
+
+// Acumulado de todas las peticiones terminadas; peak es el maximo de una sola
+struct mem_totals {
+    unsigned long long requests;
+    struct mem_request_stats sum;
+};
+
+struct mem_account;
+struct mem_context {
+    struct mem_account *account;
+    enum mem_stage stage;
+};
+
+void mem_request_begin(void);
+// Recupera la arena; si stats no es NULL recibe la cuenta de la peticion
+void mem_request_end(struct mem_request_stats *stats);
+
+void mem_stage(enum mem_stage stage);
+struct mem_context mem_context_current(void);
+void mem_context_attach(struct mem_context ctx);
+
+void mem_totals(struct mem_totals *totals);
+// "decodificacion=N/B/P ... total=N/B/P" (reservas/bytes/pico)
+void mem_format_stats(const struct mem_request_stats *stats, char *out, size_t size);
+
+#endif
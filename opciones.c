@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "opciones.h"
+
+#define MAX_OPTIONS_TEXT 1024
+
+void request_options_default(struct request_options *opts) {
+    eq_options_default(&opts->eq);
+    classify_options_default(&opts->cls);
+}
+
+static int parse_tiles(const char *value, struct eq_options *eq) {
+    char *end;
+    long tx = strtol(value, &end, 10);
+    long ty = tx;
+    if (*end == 'x' || *end == 'X') ty = strtol(end + 1, &end, 10);
+    if (*end != '\0' || tx < 1 || ty < 1 || tx > CLAHE_MAX_TILES || ty > CLAHE_MAX_TILES)
+        return -1;
+    eq->clahe_tiles_x = (int)tx;
+    eq->clahe_tiles_y = (int)ty;
+    return 0;
+}
+
+static int parse_bool(const char *value, int *out) {
+    if (strcasecmp(value, "si") == 0 || strcasecmp(value, "1") == 0) *out = 1;
+    else if (strcasecmp(value, "no") == 0 || strcasecmp(value, "0") == 0) *out = 0;
+    else return -1;
+    return 0;
+}
+
+static int parse_option(const char *key, const char *value, struct request_options *opts) {
+    if (strcasecmp(key, "modo") == 0) {
+        if (strcasecmp(value, "global") == 0) opts->eq.mode = EQ_MODE_GLOBAL;
+        else if (strcasecmp(value, "clahe") == 0) opts->eq.mode = EQ_MODE_CLAHE;
+        else if (strcasecmp(value, "referencia") == 0) opts->eq.mode = EQ_MODE_MATCH;
+        else return -1;
+        return 0;
+    }
+    if (strcasecmp(key, "tiles") == 0) {
+        return parse_tiles(value, &opts->eq);
+    }
+    if (strcasecmp(key, "clip") == 0) {
+        char *end;
+        float clip = strtof(value, &end);
+        if (*end != '\0' || clip < 0 || clip > 256) return -1;
+        opts->eq.clahe_clip = clip;
+        return 0;
+    }
+    if (strcasecmp(key, "color") == 0) {
+        return parse_bool(value, &opts->eq.preserve_color);
+    }
+    if (strcasecmp(key, "referencia") == 0) {
+        // Solo nombres dentro de DIR_REFERENCIAS, sin rutas
+        if (value[0] == '\0' || value[0] == '.' || strchr(value, '/')) return -1;
+        snprintf(opts->eq.reference_path, sizeof(opts->eq.reference_path), "%s/%s",
+                 DIR_REFERENCIAS, value);
+        opts->eq.mode = EQ_MODE_MATCH;
+        return 0;
+    }
+    if (strcasecmp(key, "muestreo") == 0) {
+        char *end;
+        double fraction = strtod(value, &end);
+        if (*end != '\0' || !(fraction >= EQ_MIN_SAMPLE_FRACTION && fraction <= 1)) return -1;
+        opts->eq.sample_fraction = fraction;
+        return 0;
+    }
+    if (strcasecmp(key, "clasificacion") == 0) {
+        if (strcasecmp(value, "completa") == 0) opts->cls.mode = CLASSIFY_FULL;
+        else if (strcasecmp(value, "muestreo") == 0) opts->cls.mode = CLASSIFY_SAMPLED;
+        else return -1;
+        return 0;
+    }
+    if (strcasecmp(key, "confianza") == 0) {
+        char *end;
+        double confidence = strtod(value, &end);
+        if (*end != '\0' || !(confidence > 0 && confidence < 1)) return -1;
+        opts->cls.confidence = confidence;
+        return 0;
+    }
+    if (strcasecmp(key, "cdf") == 0) {
+        if (strcasecmp(value, "fotograma") == 0) opts->eq.shared_cdf = 0;
+        else if (strcasecmp(value, "compartida") == 0) opts->eq.shared_cdf = 1;
+        else return -1;
+        return 0;
+    }
+    if (strcasecmp(key, "precision") == 0) {
+        if (strcasecmp(value, "normal") == 0) opts->eq.high_precision = 0;
+        else if (strcasecmp(value, "alta") == 0) opts->eq.high_precision = 1;
+        else return -1;
+        return 0;
+    }
+    return -1;
+}
+
+// Devuelve el numero de opciones invalidas (que se ignoran)
+int parse_request_options(const char *text, struct request_options *opts) {
+    char buf[MAX_OPTIONS_TEXT];
+    int errors = 0;
+
+    snprintf(buf, sizeof(buf), "%s", text);
+    for (char *save = NULL, *tok = strtok_r(buf, " \t\r\n;", &save); tok;
+         tok = strtok_r(NULL, " \t\r\n;", &save)) {
+        char *eq = strchr(tok, '=');
+        if (!eq) {
+            fprintf(stderr, "Opción sin valor ignorada: %s\n", tok);
+            errors++;
+            continue;
+        }
+        *eq = '\0';
+        if (parse_option(tok, eq + 1, opts) != 0) {
+            fprintf(stderr, "Opción inválida ignorada: %s=%s\n", tok, eq + 1);
+            errors++;
+        }
+    }
+    return errors;
+}
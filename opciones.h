@@ -0,0 +1,22 @@
+#ifndef OPCIONES_H
+#define OPCIONES_H
+
+#include "histogram.h"
+#include "clasificador.h"
+
+// Histogramas/imagenes de referencia para modo=referencia
+#define DIR_REFERENCIAS "/var/lib/imageserver/referencias"
+
+// Opciones de procesamiento que el cliente puede enviar con cada imagen,
+// como texto "clave=valor" separado por espacios (p.ej. "modo=clahe tiles=8x8 clip=2.5 color=si")
+// referencia=NOMBRE busca NOMBRE dentro de DIR_REFERENCIAS
+// cdf=fotograma|compartida: en GIF animados, una LUT por fotograma o una para todos
+struct request_options {
+    struct eq_options eq;
+    struct classify_options cls;
+};
+
+void request_options_default(struct request_options *opts);
+int parse_request_options(const char *text, struct request_options *opts);
+
+#endif
@@ -255,17 +255,87 @@ RECENT REVISION HISTORY:
 //
 // ===========================================================================
 //
+// Row streaming
+//
+// stbi_load_rows decodes an image without handing back a buffer: its rows
+// go to a callback, top to bottom, in batches of about STBI_ROWS_BATCH_BYTES
+// (64KB by default) of output pixels each:
+//
+//    int my_rows(void *user, int y, int rows, const stbi_uc *data, int x, int comp)
+//    {
+//       // data holds image rows y..y+rows-1, x*comp bytes each, valid until
+//       // the callback returns
+//       return 1; // 0 stops the load, which then fails
+//    }
+//    ok = stbi_load_rows(filename, &x, &y, &n, desired_channels, my_rows, user);
+//
+// Baseline JPEGs (when the first scan codes every component) and
+// non-interlaced PNGs are decoded a strip at a time, so only a few rows of
+// the image are ever in memory. Other images are decoded whole first. The
+// pixels are the ones stbi_load returns for the same arguments, except that
+// stbi_set_flip_vertically_on_load is ignored. The return value is 1 on
+// success and 0 on failure; x, y and channels_in_file are set on success.
+//
+// stbi_load_into goes the same way, but writes the rows into a buffer the
+// caller provides, so that one buffer can serve many loads:
+//
+//    stbi_info(filename, &x, &y, &n);
+//    size = (size_t) x * y * (desired_channels ? desired_channels : n);
+//    ok = stbi_load_into(filename, &x, &y, &n, desired_channels, buffer, size);
+//
+// The streamed JPEG rows and the conversion to desired_channels are written
+// straight into it; other images are still decoded whole first. A buffer
+// too small for the image makes the load fail. The vertical flip setting is
+// honored here, as it is by stbi_load.
+//
+// ===========================================================================
+//
+// Decoder contexts
+//
+// Every load sets up its decoder from scratch: a JPEG load builds its
+// Huffman lookup tables and allocates its component planes, a PNG load its
+// inflate window and row buffers. For big images that is noise; for a
+// stream of small ones (thumbnails, avatars) it is most of the work. A
+// decoder context keeps that state from one load to the next:
+//
+//    stbi_decoder *dec = stbi_decoder_create();
+//    for (...) {
+//       stbi_uc *data = stbi_decoder_load(dec, filename, &x, &y, &n, desired_channels);
+//       // ...
+//       stbi_image_free(data);
+//    }
+//    stbi_decoder_free(dec);
+//
+// The results are exactly those of stbi_load and stbi_load_into. A JPEG
+// Huffman table that is defined the same way as in the last image (as the
+// standard tables of most encoders are) is not built again, nor are the
+// fixed inflate tables of PNG, and work buffers of up to STBI_DECODER_KEEP
+// bytes (1MB by default) are held on to for the next load; larger ones are
+// freed as before. A context may only be used by one thread at a time, so
+// give each thread its own; stbi_decoder_free releases what it holds. The
+// context and the buffers it may keep are allocated with STBI_MALLOC_KEPT
+// (STBI_MALLOC by default), so a custom allocator can tell them apart, and
+// STBI_KEPT_LEND / STBI_KEPT_RECLAIM (no-ops by default) bracket the time
+// a kept buffer is in use by a load.
+//
+// ===========================================================================
+//
 // SIMD support
 //
 // The JPEG decoder will try to automatically use SIMD kernels on x86 when
 // supported by the compiler. For ARM Neon support, you must explicitly
-// request it.
+// request it. On x86 the conversion to the req_comp channels you ask for
+// (at 8 bits, and at 16 bits other than to gray) has SSE2 kernels too.
 //
 // (The old do-it-yourself SIMD API is no longer supported in the current
 // code.)
 //
 // On x86, SSE2 will automatically be used when available based on a run-time
-// test; if not, the generic C versions are used as a fall-back. On ARM targets,
+// test; if not, the generic C versions are used as a fall-back. On x64 with
+// GCC or Clang, AVX2 kernels are also compiled (via function target
+// attributes, so no -mavx2 is needed) and picked at run time when the CPU
+// has AVX2; they give bit-identical results to the SSE2 ones. Define
+// STBI_NO_AVX2 to leave them out. On ARM targets,
 // the typical path is to have separate builds for NEON and non-NEON devices
 // (at least this is true for iOS and Android). Therefore, the NEON support is
 // toggled by a build flag: define STBI_NEON to get NEON loops.
@@ -366,6 +436,13 @@ RECENT REVISION HISTORY:
 //    huge block of memory and spend disproportionate time decoding it. By
 //    default this is set to (1 << 24), which is 16777216, but that's still
 //    very big.
+//
+//  - If you define STBI_JPEG_THREADS (needs POSIX threads), baseline JPEGs
+//    that carry restart markers are decoded on several threads, each taking
+//    a run of restart intervals, once the image has at least
+//    STBI_JPEG_THREADS_MIN_PIXELS pixels (default 1 << 20). The thread count
+//    is set with stbi_set_jpeg_threads(); by default it is one per online
+//    CPU. Output is identical to the single-threaded decode.
 
 #ifndef STBI_NO_STDIO
 #include <stdio.h>
@@ -433,6 +510,103 @@ STBIDEF stbi_uc *stbi_load_from_file  (FILE *f, int *x, int *y, int *channels_in
 STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int **delays, int *x, int *y, int *z, int *comp, int req_comp);
 #endif
 
+// decode to a callback a batch of rows at a time instead of to a buffer (see
+// "Row streaming" above); returns 1 on success, 0 on failure
+typedef int stbi_rows_callback(void *user, int y, int rows, const stbi_uc *data, int x, int comp);
+
+STBIDEF int stbi_load_rows_from_memory   (stbi_uc           const *buffer, int len   , int *x, int *y, int *channels_in_file, int desired_channels, stbi_rows_callback *cb, void *cb_user);
+STBIDEF int stbi_load_rows_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *channels_in_file, int desired_channels, stbi_rows_callback *cb, void *cb_user);
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_load_rows               (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, stbi_rows_callback *cb, void *cb_user);
+#endif
+
+// decode into the caller's buffer of out_size bytes instead of a new one (see
+// "Row streaming" above); returns 1 on success, 0 on failure
+STBIDEF int stbi_load_into_from_memory   (stbi_uc           const *buffer, int len   , int *x, int *y, int *channels_in_file, int desired_channels, stbi_uc *out, size_t out_size);
+STBIDEF int stbi_load_into_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *channels_in_file, int desired_channels, stbi_uc *out, size_t out_size);
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_load_into               (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, stbi_uc *out, size_t out_size);
+#endif
+
+// a decoder context keeps decoder state between loads (see "Decoder
+// contexts" above); the loads are stbi_load and stbi_load_into through it
+typedef struct stbi_decoder stbi_decoder;
+
+STBIDEF stbi_decoder *stbi_decoder_create(void);
+STBIDEF void          stbi_decoder_free  (stbi_decoder *dec);
+STBIDEF stbi_uc *stbi_decoder_load_from_memory     (stbi_decoder *dec, stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF int      stbi_decoder_load_into_from_memory(stbi_decoder *dec, stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels, stbi_uc *out, size_t out_size);
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_decoder_load                 (stbi_decoder *dec, char const *filename, int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF int      stbi_decoder_load_into            (stbi_decoder *dec, char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, stbi_uc *out, size_t out_size);
+#endif
+
+#ifndef STBI_NO_JPEG
+// JPEG only: decode just the DC coefficient of each 8x8 block, giving an image
+// 1/8 the size in each dimension (rounded up) with no IDCT work. each pixel is
+// the mean of its source block. fails on anything that is not a JPEG.
+STBIDEF stbi_uc *stbi_load_jpeg_dc_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels);
+// JPEG only: decode at 1/scale size (rounded up), scale being 1, 2, 4 or 8,
+// using a reduced 4x4, 2x2 or 1x1 IDCT per block instead of downscaling the
+// full-size image afterwards. each pixel is the mean of the scale x scale
+// pixels it covers. scale 8 is the same as stbi_load_jpeg_dc.
+STBIDEF stbi_uc *stbi_load_jpeg_scaled_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels, int scale);
+// JPEG only: one grey channel. for YCbCr files this is the Y plane as decoded;
+// the chroma is entropy-decoded (or skipped if in its own scans) but never
+// transformed, upsampled or color converted. any JPEG load asking for 1 or 2
+// channels takes the same shortcut; this just fails on other formats.
+STBIDEF stbi_uc *stbi_load_jpeg_luma_from_memory(stbi_uc const *buffer, int len, int *x, int *y);
+// JPEG only: stbi_load_jpeg_luma into the caller's buffer of out_size bytes,
+// as stbi_load_into
+STBIDEF int      stbi_load_jpeg_luma_into_from_memory(stbi_uc const *buffer, int len, int *x, int *y, stbi_uc *out, size_t out_size);
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_jpeg_dc            (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF stbi_uc *stbi_load_jpeg_scaled        (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, int scale);
+STBIDEF stbi_uc *stbi_load_jpeg_luma          (char const *filename, int *x, int *y);
+STBIDEF int      stbi_load_jpeg_luma_into     (char const *filename, int *x, int *y, stbi_uc *out, size_t out_size);
+#endif
+// JPEG only: stbi_load_jpeg_luma_into through a decoder context
+STBIDEF int      stbi_decoder_load_jpeg_luma_into_from_memory(stbi_decoder *dec, stbi_uc const *buffer, int len, int *x, int *y, stbi_uc *out, size_t out_size);
+#ifndef STBI_NO_STDIO
+STBIDEF int      stbi_decoder_load_jpeg_luma_into            (stbi_decoder *dec, char const *filename, int *x, int *y, stbi_uc *out, size_t out_size);
+#endif
+#endif
+
+#ifndef STBI_NO_PNG
+// PNG only: decode just the first `passes` (1..7) Adam7 passes of an
+// interlaced PNG, and stop inflating after them. the result is the pixel
+// grid those passes fill in: every 8th pixel each way after pass 1 (1/8 the
+// size, rounded up), then 1/4 x 1/8, 1/4 x 1/4, 1/2 x 1/4, 1/2 x 1/2 and
+// 1 x 1/2, and the whole image after pass 7. fails on anything that is not
+// a PNG, and on PNGs that are not interlaced unless passes is 7. 16-bit
+// PNGs come back as 8 bits per channel. the pixels are a regular subgrid,
+// not block means: good for a preview, but nothing computed on them need
+// hold for the whole image.
+STBIDEF stbi_uc *stbi_load_png_passes_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels, int passes);
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_png_passes          (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, int passes);
+#endif
+#endif
+
+#if !defined(STBI_NO_PNM) && !defined(STBI_NO_STDIO)
+// PNM only: a binary PGM or PPM of 8 bits per channel holds its pixels just
+// as stbi_load returns them, so there is nothing to decode or copy. this
+// maps the file into memory and returns a pointer to the pixels in the
+// mapping, when desired_channels is 0 or the file's channel count and the
+// vertical flip is off. otherwise, or on anything but such a PNM, or where
+// files can't be mapped (it uses POSIX mmap), it fails and the file is to
+// be loaded as usual. the pixels may be written to; the changes stay
+// private. release them with stbi_pnm_unmap(map), not stbi_image_free.
+typedef struct
+{
+   void *base;
+   size_t len;
+} stbi_pnm_mapping;
+
+STBIDEF stbi_uc *stbi_load_pnm_mapped(char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, stbi_pnm_mapping *map);
+STBIDEF void     stbi_pnm_unmap      (stbi_pnm_mapping *map);
+#endif
+
 #ifdef STBI_WINDOWS_UTF8
 STBIDEF int stbi_convert_wchar_to_utf8(char *buffer, size_t bufferlen, const wchar_t* input);
 #endif
@@ -517,6 +691,10 @@ STBIDEF void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert);
 // flip the image vertically, so the first pixel in the output array is the bottom left
 STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip);
 
+// threads used for a large baseline JPEG with restart markers when built with
+// STBI_JPEG_THREADS: 0 (the default) is one per online CPU, 1 never starts any
+STBIDEF void stbi_set_jpeg_threads(int threads);
+
 // as above, but only applies to images loaded on the thread that calls the function
 // this function is only available if your compiler supports thread-local variables;
 // calling it will fail to link if your compiler doesn't
@@ -598,6 +776,19 @@ STBIDEF int   stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const ch
 #include <stdio.h>
 #endif
 
+#ifdef STBI_JPEG_THREADS
+#include <pthread.h>
+#include <unistd.h> // sysconf
+#endif
+
+#if !defined(STBI_NO_PNM) && !defined(STBI_NO_STDIO) && (defined(__unix__) || defined(__APPLE__))
+#define STBI__PNM_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #ifndef STBI_ASSERT
 #include <assert.h>
 #define STBI_ASSERT(x) assert(x)
@@ -643,12 +834,14 @@ typedef unsigned short stbi__uint16;
 typedef   signed short stbi__int16;
 typedef unsigned int   stbi__uint32;
 typedef   signed int   stbi__int32;
+typedef unsigned __int64 stbi__uint64;
 #else
 #include <stdint.h>
 typedef uint16_t stbi__uint16;
 typedef int16_t  stbi__int16;
 typedef uint32_t stbi__uint32;
 typedef int32_t  stbi__int32;
+typedef uint64_t stbi__uint64;
 #endif
 
 // should produce compiler error if size is wrong
@@ -688,6 +881,23 @@ typedef unsigned char validate_uint32[sizeof(stbi__uint32)==4 ? 1 : -1];
 #define STBI_REALLOC_SIZED(p,oldsz,newsz) STBI_REALLOC(p,newsz)
 #endif
 
+// memory a decoder context may hold on to after the load returns. it is
+// still freed with STBI_FREE; an allocator that reclaims everything at once
+// (an arena) must hand these out from somewhere that outlives it
+#ifndef STBI_MALLOC_KEPT
+#define STBI_MALLOC_KEPT(sz)      STBI_MALLOC(sz)
+#endif
+
+// a kept buffer is in use by a load from when it is handed out (LEND) until
+// it goes back to its context (RECLAIM); an allocator that counts the
+// memory a load has live can count these bytes for that span
+#ifndef STBI_KEPT_LEND
+#define STBI_KEPT_LEND(p)         ((void) (p))
+#endif
+#ifndef STBI_KEPT_RECLAIM
+#define STBI_KEPT_RECLAIM(p)      ((void) (p))
+#endif
+
 // x86/x64 detection
 #if defined(__x86_64__) || defined(_M_X64)
 #define STBI__X64_TARGET
@@ -750,7 +960,7 @@ static int stbi__cpuid3(void)
 
 #define STBI_SIMD_ALIGN(type, name) __declspec(align(16)) type name
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
+#if (!defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG) || !defined(STBI_NO_BMP) || !defined(STBI_NO_PSD) || !defined(STBI_NO_TGA) || !defined(STBI_NO_GIF) || !defined(STBI_NO_PIC) || !defined(STBI_NO_PNM)) && defined(STBI_SSE2)
 static int stbi__sse2_available(void)
 {
    int info3 = stbi__cpuid3();
@@ -761,7 +971,7 @@ static int stbi__sse2_available(void)
 #else // assume GCC-style if not VC++
 #define STBI_SIMD_ALIGN(type, name) type name __attribute__((aligned(16)))
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
+#if (!defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG) || !defined(STBI_NO_BMP) || !defined(STBI_NO_PSD) || !defined(STBI_NO_TGA) || !defined(STBI_NO_GIF) || !defined(STBI_NO_PIC) || !defined(STBI_NO_PNM)) && defined(STBI_SSE2)
 static int stbi__sse2_available(void)
 {
    // If we're even attempting to compile this on GCC/Clang, that means
@@ -774,6 +984,22 @@ static int stbi__sse2_available(void)
 #endif
 #endif
 
+// AVX2: only where the compiler can target it per function, so the rest of
+// the file still builds for plain SSE2 and the CPU is checked at run time
+#if defined(STBI_SSE2) && defined(STBI__X64_TARGET) && !defined(STBI_NO_AVX2) && \
+    (defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#define STBI_AVX2
+#include <immintrin.h>
+#define STBI__AVX2_TARGET __attribute__((target("avx2")))
+
+#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG)
+static int stbi__avx2_available(void)
+{
+   return __builtin_cpu_supports("avx2");
+}
+#endif
+#endif
+
 // ARM NEON
 #if defined(STBI_NO_SIMD) && defined(STBI_NEON)
 #undef STBI_NEON
@@ -796,6 +1022,14 @@ static int stbi__sse2_available(void)
 #define STBI_MAX_DIMENSIONS (1 << 24)
 #endif
 
+#ifndef STBI_JPEG_THREADS_MIN_PIXELS
+#define STBI_JPEG_THREADS_MIN_PIXELS (1 << 20)
+#endif
+
+#ifndef STBI_DECODER_KEEP
+#define STBI_DECODER_KEEP (1 << 20)
+#endif
+
 ///////////////////////////////////////////////
 //
 //  stbi__context struct and start_xxx functions
@@ -817,6 +1051,8 @@ typedef struct
 
    stbi_uc *img_buffer, *img_buffer_end;
    stbi_uc *img_buffer_original, *img_buffer_original_end;
+
+   stbi_decoder *dec;   // the decoder context loading through, if any
 } stbi__context;
 
 
@@ -828,6 +1064,7 @@ static void stbi__start_mem(stbi__context *s, stbi_uc const *buffer, int len)
    s->io.read = NULL;
    s->read_from_callbacks = 0;
    s->callback_already_read = 0;
+   s->dec = NULL;
    s->img_buffer = s->img_buffer_original = (stbi_uc *) buffer;
    s->img_buffer_end = s->img_buffer_original_end = (stbi_uc *) buffer+len;
 }
@@ -840,6 +1077,7 @@ static void stbi__start_callbacks(stbi__context *s, stbi_io_callbacks *c, void *
    s->buflen = sizeof(s->buffer_start);
    s->read_from_callbacks = 1;
    s->callback_already_read = 0;
+   s->dec = NULL;
    s->img_buffer = s->img_buffer_original = s->buffer_start;
    stbi__refill_buffer(s);
    s->img_buffer_original_end = s->img_buffer_end;
@@ -905,17 +1143,34 @@ typedef struct
    int channel_order;
 } stbi__result_info;
 
+// the consumer of a stbi_load_rows decode, or the caller's buffer that a
+// stbi_load_into decode fills in
+typedef struct
+{
+   stbi_rows_callback *cb;
+   void *user;
+   stbi_uc *dest;    // stbi_load_into: rows are written here, cb is NULL
+   size_t dest_len;
+   int req_comp;
+   int y;            // first row of the next batch
+   stbi_uc *buf;     // batch buffer, for decoders and for format conversion
+   size_t buf_len;
+   int alloc;        // stbi_load: dest is allocated by stbi__rows_alloc
+} stbi__rows;
+
 #ifndef STBI_NO_JPEG
 static int      stbi__jpeg_test(stbi__context *s);
 static void    *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri);
 static int      stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp);
+static int      stbi__jpeg_load_rows(stbi__context *s, int *x, int *y, int *comp, stbi__rows *rows);
 #endif
 
 #ifndef STBI_NO_PNG
 static int      stbi__png_test(stbi__context *s);
-static void    *stbi__png_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri);
+static void    *stbi__png_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc);
 static int      stbi__png_info(stbi__context *s, int *x, int *y, int *comp);
 static int      stbi__png_is16(stbi__context *s);
+static int      stbi__png_load_rows(stbi__context *s, int *x, int *y, int *comp, stbi__rows *rows);
 #endif
 
 #ifndef STBI_NO_BMP
@@ -1019,7 +1274,7 @@ static int stbi__mul2sizes_valid(int a, int b)
    return a <= INT_MAX/b;
 }
 
-#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG) || !defined(STBI_NO_TGA) || !defined(STBI_NO_HDR)
+#if (!defined(STBI_NO_JPEG) && defined(STBI_JPEG_THREADS)) || !defined(STBI_NO_PNG) || !defined(STBI_NO_TGA) || !defined(STBI_NO_HDR)
 // returns 1 if "a*b + add" has no negative terms/factors and doesn't overflow
 static int stbi__mad2sizes_valid(int a, int b, int add)
 {
@@ -1043,7 +1298,7 @@ static int stbi__mad4sizes_valid(int a, int b, int c, int d, int add)
 }
 #endif
 
-#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG) || !defined(STBI_NO_TGA) || !defined(STBI_NO_HDR)
+#if (!defined(STBI_NO_JPEG) && defined(STBI_JPEG_THREADS)) || !defined(STBI_NO_PNG) || !defined(STBI_NO_TGA) || !defined(STBI_NO_HDR)
 // mallocs with size overflow checking
 static void *stbi__malloc_mad2(int a, int b, int add)
 {
@@ -1066,6 +1321,87 @@ static void *stbi__malloc_mad4(int a, int b, int c, int d, int add)
 }
 #endif
 
+// the work buffers a decoder context holds on to between loads, one of each
+enum
+{
+   STBI__KEEP_jpeg,                                 // the stbi__jpeg itself
+   STBI__KEEP_jpeg_plane,                           // four each of these,
+   STBI__KEEP_jpeg_coeff = STBI__KEEP_jpeg_plane+4, // one per component
+   STBI__KEEP_jpeg_line  = STBI__KEEP_jpeg_coeff+4,
+   STBI__KEEP_zbuf       = STBI__KEEP_jpeg_line+4,
+   STBI__KEEP_png_window,
+   STBI__KEEP_png_filter,
+   STBI__KEEP_png_idata,
+   STBI__KEEP_count
+};
+
+struct stbi_decoder
+{
+   void  *kept[STBI__KEEP_count];     // held for the next load
+   size_t kept_len[STBI__KEEP_count]; // size of the kept or lent buffer
+   void  *lent[STBI__KEEP_count];     // handed out to the current load
+};
+
+#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG)
+// the buffer a decoder context kept in slot, if it has one of at least len
+// bytes; NULL otherwise. either way stbi__keep_free puts it back
+static void *stbi__keep_reuse(stbi__context *s, int slot, size_t len)
+{
+   stbi_decoder *dec = s->dec;
+   void *p;
+   if (!dec || !dec->kept[slot]) return NULL;
+   p = dec->kept[slot];
+   dec->kept[slot] = NULL;
+   if (dec->kept_len[slot] < len) {
+      STBI_FREE(p);
+      return NULL;
+   }
+   dec->lent[slot] = p;
+   STBI_KEPT_LEND(p);
+   return p;
+}
+
+// a buffer of at least a*b*c+add bytes for slot, or NULL; see stbi__keep_free
+static void *stbi__keep_malloc(stbi__context *s, int slot, int a, int b, int c, int add)
+{
+   void *p;
+   size_t len;
+   if (!stbi__mad3sizes_valid(a, b, c, add)) return NULL;
+   len = (size_t) (a*b*c + add);
+   p = stbi__keep_reuse(s, slot, len);
+   if (!p) {
+      // only buffers small enough to be kept outlive the load
+      if (s->dec && len <= STBI_DECODER_KEEP) {
+         p = STBI_MALLOC_KEPT(len);
+         STBI_KEPT_LEND(p);
+      } else {
+         p = stbi__malloc(len);
+      }
+      if (p && s->dec) {
+         s->dec->lent[slot] = p;
+         s->dec->kept_len[slot] = len;
+      }
+   }
+   return p;
+}
+
+// frees a buffer from stbi__keep_malloc, or gives it back to the decoder
+// context. a buffer that has been realloc'd since is no longer the one lent
+// out, and is freed
+static void stbi__keep_free(stbi__context *s, int slot, void *p)
+{
+   stbi_decoder *dec = s->dec;
+   if (dec && p && p == dec->lent[slot] && !dec->kept[slot] && dec->kept_len[slot] <= STBI_DECODER_KEEP) {
+      dec->kept[slot] = p;
+      dec->lent[slot] = NULL;
+      STBI_KEPT_RECLAIM(p);
+   } else {
+      if (dec && p == dec->lent[slot]) dec->lent[slot] = NULL;
+      STBI_FREE(p);
+   }
+}
+#endif
+
 // returns 1 if the sum of two signed ints is valid (between -2^31 and 2^31-1 inclusive), 0 on overflow.
 static int stbi__addints_valid(int a, int b)
 {
@@ -1118,6 +1454,13 @@ STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip)
    stbi__vertically_flip_on_load_global = flag_true_if_should_flip;
 }
 
+static int stbi__jpeg_threads_global = 0;
+
+STBIDEF void stbi_set_jpeg_threads(int threads)
+{
+   stbi__jpeg_threads_global = threads;
+}
+
 #ifndef STBI_THREAD_LOCAL
 #define stbi__vertically_flip_on_load  stbi__vertically_flip_on_load_global
 #else
@@ -1144,7 +1487,7 @@ static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int re
    // test the formats with a very explicit header first (at least a FOURCC
    // or distinctive magic number first)
    #ifndef STBI_NO_PNG
-   if (stbi__png_test(s))  return stbi__png_load(s,x,y,comp,req_comp, ri);
+   if (stbi__png_test(s))  return stbi__png_load(s,x,y,comp,req_comp, ri, bpc);
    #endif
    #ifndef STBI_NO_BMP
    if (stbi__bmp_test(s))  return stbi__bmp_load(s,x,y,comp,req_comp, ri);
@@ -1752,26 +2095,188 @@ static stbi_uc stbi__compute_y(int r, int g, int b)
 #if defined(STBI_NO_PNG) && defined(STBI_NO_BMP) && defined(STBI_NO_PSD) && defined(STBI_NO_TGA) && defined(STBI_NO_GIF) && defined(STBI_NO_PIC) && defined(STBI_NO_PNM)
 // nothing
 #else
-static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int req_comp, unsigned int x, unsigned int y)
+#ifdef STBI_SSE2
+// SSE2 kernels for stbi__convert_format_into. each converts the leading
+// pixels of a row a block at a time and returns how many it did; the
+// scalar loops do the rest. 3-channel pixels go through vectors of four
+// 4-byte pixels: stbi__rgb_spread and stbi__rgb_pack move between the two
+// layouts (the 16-bit kernels use them on 8-byte pixels, two per vector).
+// loads always come before stores, so a conversion to fewer channels may
+// run in place
+
+// 12 bytes of 3-channel pixels at the bottom of v, spread out to 8 bytes in
+// each half; the rest of v is cleared
+static __m128i stbi__rgb_spread6(__m128i v)
 {
-   int i,j;
-   unsigned char *good;
+   __m128i six = _mm_set_epi32(0, 0, 0xffff, -1);
+   return _mm_or_si128(_mm_and_si128(v, six), _mm_slli_si128(_mm_and_si128(_mm_srli_si128(v, 6), six), 8));
+}
 
-   if (req_comp == img_n) return data;
-   STBI_ASSERT(req_comp >= 1 && req_comp <= 4);
+// the reverse of stbi__rgb_spread6
+static __m128i stbi__rgb_pack6(__m128i v)
+{
+   __m128i six = _mm_set_epi32(0, 0, 0xffff, -1);
+   return _mm_or_si128(_mm_and_si128(v, six), _mm_srli_si128(_mm_and_si128(v, _mm_slli_si128(six, 8)), 2));
+}
 
-   good = (unsigned char *) stbi__malloc_mad3(req_comp, x, y, 0);
-   if (good == NULL) {
-      STBI_FREE(data);
-      return stbi__errpuc("outofmem", "Out of memory");
+// 8 RGB pixels at src as two vectors of 4 RGBx pixels, x being 0
+static void stbi__rgb_spread(const stbi_uc *src, __m128i *lo, __m128i *hi)
+{
+   __m128i a = _mm_loadu_si128((const __m128i *) src);
+   __m128i b = _mm_loadl_epi64((const __m128i *) (src+16));
+   __m128i lo3 = _mm_set_epi32(0, 0xffffff, 0, 0xffffff);
+   __m128i hi3 = _mm_slli_epi64(lo3, 32);
+   b = stbi__rgb_spread6(_mm_or_si128(_mm_srli_si128(a, 12), _mm_slli_si128(b, 4)));
+   a = stbi__rgb_spread6(a);
+   // in each half, the second pixel moves up a byte
+   *lo = _mm_or_si128(_mm_and_si128(a, lo3), _mm_and_si128(_mm_slli_epi64(a, 8), hi3));
+   *hi = _mm_or_si128(_mm_and_si128(b, lo3), _mm_and_si128(_mm_slli_epi64(b, 8), hi3));
+}
+
+// two vectors of 4 RGBx pixels stored as 8 RGB pixels
+static void stbi__rgb_pack(stbi_uc *dest, __m128i lo, __m128i hi)
+{
+   __m128i lo3 = _mm_set_epi32(0, 0xffffff, 0, 0xffffff);
+   __m128i hi3 = _mm_slli_epi64(lo3, 24);
+   lo = stbi__rgb_pack6(_mm_or_si128(_mm_and_si128(lo, lo3), _mm_and_si128(_mm_srli_epi64(lo, 8), hi3)));
+   hi = stbi__rgb_pack6(_mm_or_si128(_mm_and_si128(hi, lo3), _mm_and_si128(_mm_srli_epi64(hi, 8), hi3)));
+   _mm_storeu_si128((__m128i *) dest, _mm_or_si128(lo, _mm_slli_si128(hi, 12)));
+   _mm_storel_epi64((__m128i *) (dest+16), _mm_srli_si128(hi, 4));
+}
+
+// stbi__compute_y of 8 RGBx pixels, in 16-bit lanes. the weights add up to
+// 256, so the sum fits 16 bits unsigned
+static __m128i stbi__rgbx_y(__m128i lo, __m128i hi)
+{
+   __m128i m = _mm_set1_epi32(0xff);
+   __m128i r = _mm_packs_epi32(_mm_and_si128(lo, m), _mm_and_si128(hi, m));
+   __m128i g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(lo, 8), m), _mm_and_si128(_mm_srli_epi32(hi, 8), m));
+   __m128i b = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(lo, 16), m), _mm_and_si128(_mm_srli_epi32(hi, 16), m));
+   __m128i y = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(77)), _mm_mullo_epi16(g, _mm_set1_epi16(150)));
+   return _mm_srli_epi16(_mm_add_epi16(y, _mm_mullo_epi16(b, _mm_set1_epi16(29))), 8);
+}
+
+static int stbi__convert_row_sse2(stbi_uc *dest, const stbi_uc *src, int img_n, int req_comp, int x)
+{
+   __m128i ff = _mm_set1_epi8((char) 255), lo, hi;
+   int i = 0;
+   switch (img_n*8 + req_comp) {
+      case 1*8+2:
+         for (; i+16 <= x; i += 16) {
+            __m128i g = _mm_loadu_si128((const __m128i *) (src+i));
+            _mm_storeu_si128((__m128i *) (dest+2*i   ), _mm_unpacklo_epi8(g, ff));
+            _mm_storeu_si128((__m128i *) (dest+2*i+16), _mm_unpackhi_epi8(g, ff));
+         }
+         break;
+      case 1*8+3:
+      case 1*8+4:
+         for (; i+16 <= x; i += 16) {
+            __m128i g = _mm_loadu_si128((const __m128i *) (src+i));
+            __m128i gg0 = _mm_unpacklo_epi8(g, g), gg1 = _mm_unpackhi_epi8(g, g);
+            __m128i ga0 = _mm_unpacklo_epi8(g, ff), ga1 = _mm_unpackhi_epi8(g, ff);
+            __m128i p0 = _mm_unpacklo_epi16(gg0, ga0), p1 = _mm_unpackhi_epi16(gg0, ga0);
+            __m128i p2 = _mm_unpacklo_epi16(gg1, ga1), p3 = _mm_unpackhi_epi16(gg1, ga1);
+            if (req_comp == 3) {
+               stbi__rgb_pack(dest+3*i, p0, p1);
+               stbi__rgb_pack(dest+3*i+24, p2, p3);
+            } else {
+               _mm_storeu_si128((__m128i *) (dest+4*i   ), p0);
+               _mm_storeu_si128((__m128i *) (dest+4*i+16), p1);
+               _mm_storeu_si128((__m128i *) (dest+4*i+32), p2);
+               _mm_storeu_si128((__m128i *) (dest+4*i+48), p3);
+            }
+         }
+         break;
+      case 2*8+1:
+         for (; i+16 <= x; i += 16) {
+            __m128i m = _mm_set1_epi16(0xff);
+            __m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i *) (src+2*i   )), m);
+            __m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i *) (src+2*i+16)), m);
+            _mm_storeu_si128((__m128i *) (dest+i), _mm_packus_epi16(a, b));
+         }
+         break;
+      case 2*8+3:
+      case 2*8+4:
+         for (; i+8 <= x; i += 8) {
+            __m128i ga = _mm_loadu_si128((const __m128i *) (src+2*i));
+            __m128i g = _mm_and_si128(ga, _mm_set1_epi16(0xff));
+            __m128i gg = _mm_or_si128(g, _mm_slli_epi16(g, 8));
+            lo = _mm_unpacklo_epi16(gg, ga);
+            hi = _mm_unpackhi_epi16(gg, ga);
+            if (req_comp == 3) {
+               stbi__rgb_pack(dest+3*i, lo, hi);
+            } else {
+               _mm_storeu_si128((__m128i *) (dest+4*i   ), lo);
+               _mm_storeu_si128((__m128i *) (dest+4*i+16), hi);
+            }
+         }
+         break;
+      case 3*8+1:
+      case 3*8+2:
+      case 3*8+4:
+      case 4*8+1:
+      case 4*8+2:
+      case 4*8+3:
+         for (; i+8 <= x; i += 8) {
+            __m128i y;
+            if (img_n == 3) {
+               stbi__rgb_spread(src+3*i, &lo, &hi);
+               lo = _mm_or_si128(lo, _mm_slli_epi32(ff, 24));
+               hi = _mm_or_si128(hi, _mm_slli_epi32(ff, 24));
+            } else {
+               lo = _mm_loadu_si128((const __m128i *) (src+4*i   ));
+               hi = _mm_loadu_si128((const __m128i *) (src+4*i+16));
+            }
+            switch (req_comp) {
+               case 1:
+                  y = stbi__rgbx_y(lo, hi);
+                  _mm_storel_epi64((__m128i *) (dest+i), _mm_packus_epi16(y, y));
+                  break;
+               case 2:
+                  y = stbi__rgbx_y(lo, hi);
+                  y = _mm_packus_epi16(y, y);
+                  lo = _mm_packs_epi32(_mm_srli_epi32(lo, 24), _mm_srli_epi32(hi, 24));
+                  _mm_storeu_si128((__m128i *) (dest+2*i), _mm_unpacklo_epi8(y, _mm_packus_epi16(lo, lo)));
+                  break;
+               case 3:
+                  stbi__rgb_pack(dest+3*i, lo, hi);
+                  break;
+               default:
+                  _mm_storeu_si128((__m128i *) (dest+4*i   ), lo);
+                  _mm_storeu_si128((__m128i *) (dest+4*i+16), hi);
+                  break;
+            }
+         }
+         break;
    }
+   return i;
+}
+#endif
+
+// converts x*y pixels from data into good, which has room for them. a
+// conversion to fewer channels may be done in place (good == data)
+static int stbi__convert_format_into(unsigned char *good, unsigned char *data, int img_n, int req_comp, unsigned int x, unsigned int y)
+{
+   int i,j;
+#ifdef STBI_SSE2
+   int simd = stbi__sse2_available();
+#endif
 
    for (j=0; j < (int) y; ++j) {
       unsigned char *src  = data + j * x * img_n   ;
       unsigned char *dest = good + j * x * req_comp;
+      int done = 0;
+
+#ifdef STBI_SSE2
+      if (simd) {
+         done = stbi__convert_row_sse2(dest, src, img_n, req_comp, (int) x);
+         src  += done * img_n;
+         dest += done * req_comp;
+      }
+#endif
 
       #define STBI__COMBO(a,b)  ((a)*8+(b))
-      #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+      #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1-done; i >= 0; --i, src += a, dest += b)
       // convert source image with img_n components to one with req_comp components;
       // avoid switch per pixel, so use switch per scanline and massive macros
       switch (STBI__COMBO(img_n, req_comp)) {
@@ -1787,17 +2292,46 @@ static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int r
          STBI__CASE(4,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
          STBI__CASE(4,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = src[3]; } break;
          STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                    } break;
-         default: STBI_ASSERT(0); STBI_FREE(data); STBI_FREE(good); return stbi__errpuc("unsupported", "Unsupported format conversion");
+         default: STBI_ASSERT(0); return stbi__err("unsupported", "Unsupported format conversion");
       }
       #undef STBI__CASE
    }
+   return 1;
+}
+
+static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int req_comp, unsigned int x, unsigned int y)
+{
+   unsigned char *good;
+
+   if (req_comp == img_n) return data;
+   STBI_ASSERT(req_comp >= 1 && req_comp <= 4);
+
+   if (req_comp < img_n) {
+      // fewer channels: convert in place and give back the tail
+      if (!stbi__convert_format_into(data, data, img_n, req_comp, x, y)) {
+         STBI_FREE(data);
+         return NULL;
+      }
+      good = (unsigned char *) STBI_REALLOC_SIZED(data, (size_t) img_n * x * y, (size_t) req_comp * x * y);
+      return good ? good : data;
+   }
+
+   good = (unsigned char *) stbi__malloc_mad3(req_comp, x, y, 0);
+   if (good == NULL) {
+      STBI_FREE(data);
+      return stbi__errpuc("outofmem", "Out of memory");
+   }
 
+   if (!stbi__convert_format_into(good, data, img_n, req_comp, x, y)) {
+      STBI_FREE(good);
+      good = NULL;
+   }
    STBI_FREE(data);
    return good;
 }
 #endif
 
-#if defined(STBI_NO_PNG) && defined(STBI_NO_PSD)
+#if defined(STBI_NO_PNG) && defined(STBI_NO_PSD) && defined(STBI_NO_PNM)
 // nothing
 #else
 static stbi__uint16 stbi__compute_y_16(int r, int g, int b)
@@ -1806,29 +2340,124 @@ static stbi__uint16 stbi__compute_y_16(int r, int g, int b)
 }
 #endif
 
-#if defined(STBI_NO_PNG) && defined(STBI_NO_PSD)
+#if defined(STBI_NO_PNG) && defined(STBI_NO_PSD) && defined(STBI_NO_PNM)
 // nothing
 #else
-static stbi__uint16 *stbi__convert_format16(stbi__uint16 *data, int img_n, int req_comp, unsigned int x, unsigned int y)
+#ifdef STBI_SSE2
+// 4 pixels of 16-bit RGBx, two to a vector, stored as RGB
+static void stbi__rgb_pack16(stbi__uint16 *dest, __m128i lo, __m128i hi)
 {
-   int i,j;
-   stbi__uint16 *good;
-
-   if (req_comp == img_n) return data;
-   STBI_ASSERT(req_comp >= 1 && req_comp <= 4);
+   lo = stbi__rgb_pack6(lo);
+   hi = stbi__rgb_pack6(hi);
+   _mm_storeu_si128((__m128i *) dest, _mm_or_si128(lo, _mm_slli_si128(hi, 12)));
+   _mm_storel_epi64((__m128i *) (dest+8), _mm_srli_si128(hi, 4));
+}
 
-   good = (stbi__uint16 *) stbi__malloc(req_comp * x * y * 2);
-   if (good == NULL) {
-      STBI_FREE(data);
-      return (stbi__uint16 *) stbi__errpuc("outofmem", "Out of memory");
+// the 16-bit counterpart of stbi__convert_row_sse2; conversions to luma
+// are left to the scalar code
+static int stbi__convert_row16_sse2(stbi__uint16 *dest, const stbi__uint16 *src, int img_n, int req_comp, int x)
+{
+   __m128i ff = _mm_set1_epi16(-1);
+   int i = 0;
+   switch (img_n*8 + req_comp) {
+      case 1*8+2:
+         for (; i+8 <= x; i += 8) {
+            __m128i g = _mm_loadu_si128((const __m128i *) (src+i));
+            _mm_storeu_si128((__m128i *) (dest+2*i  ), _mm_unpacklo_epi16(g, ff));
+            _mm_storeu_si128((__m128i *) (dest+2*i+8), _mm_unpackhi_epi16(g, ff));
+         }
+         break;
+      case 1*8+3:
+      case 1*8+4:
+         for (; i+8 <= x; i += 8) {
+            __m128i g = _mm_loadu_si128((const __m128i *) (src+i));
+            __m128i gg0 = _mm_unpacklo_epi16(g, g), gg1 = _mm_unpackhi_epi16(g, g);
+            __m128i ga0 = _mm_unpacklo_epi16(g, ff), ga1 = _mm_unpackhi_epi16(g, ff);
+            __m128i p0 = _mm_unpacklo_epi32(gg0, ga0), p1 = _mm_unpackhi_epi32(gg0, ga0);
+            __m128i p2 = _mm_unpacklo_epi32(gg1, ga1), p3 = _mm_unpackhi_epi32(gg1, ga1);
+            if (req_comp == 3) {
+               stbi__rgb_pack16(dest+3*i, p0, p1);
+               stbi__rgb_pack16(dest+3*i+12, p2, p3);
+            } else {
+               _mm_storeu_si128((__m128i *) (dest+4*i   ), p0);
+               _mm_storeu_si128((__m128i *) (dest+4*i+ 8), p1);
+               _mm_storeu_si128((__m128i *) (dest+4*i+16), p2);
+               _mm_storeu_si128((__m128i *) (dest+4*i+24), p3);
+            }
+         }
+         break;
+      case 2*8+1:
+         for (; i+8 <= x; i += 8) {
+            __m128i a = _mm_loadu_si128((const __m128i *) (src+2*i  ));
+            __m128i b = _mm_loadu_si128((const __m128i *) (src+2*i+8));
+            // sign-extending the gray keeps packs from saturating it
+            a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+            b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+            _mm_storeu_si128((__m128i *) (dest+i), _mm_packs_epi32(a, b));
+         }
+         break;
+      case 2*8+3:
+      case 2*8+4:
+         for (; i+4 <= x; i += 4) {
+            __m128i ga = _mm_loadu_si128((const __m128i *) (src+2*i));
+            __m128i lo = _mm_unpacklo_epi32(ga, ga), hi = _mm_unpackhi_epi32(ga, ga);
+            lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, _MM_SHUFFLE(1,0,0,0)), _MM_SHUFFLE(1,0,0,0));
+            hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, _MM_SHUFFLE(1,0,0,0)), _MM_SHUFFLE(1,0,0,0));
+            if (req_comp == 3) {
+               stbi__rgb_pack16(dest+3*i, lo, hi);
+            } else {
+               _mm_storeu_si128((__m128i *) (dest+4*i  ), lo);
+               _mm_storeu_si128((__m128i *) (dest+4*i+8), hi);
+            }
+         }
+         break;
+      case 3*8+4:
+         for (; i+4 <= x; i += 4) {
+            __m128i a = _mm_loadu_si128((const __m128i *) (src+3*i));
+            __m128i b = _mm_loadl_epi64((const __m128i *) (src+3*i+8));
+            __m128i alpha = _mm_slli_epi64(ff, 48);
+            b = stbi__rgb_spread6(_mm_or_si128(_mm_srli_si128(a, 12), _mm_slli_si128(b, 4)));
+            a = stbi__rgb_spread6(a);
+            _mm_storeu_si128((__m128i *) (dest+4*i  ), _mm_or_si128(a, alpha));
+            _mm_storeu_si128((__m128i *) (dest+4*i+8), _mm_or_si128(b, alpha));
+         }
+         break;
+      case 4*8+3:
+         for (; i+4 <= x; i += 4) {
+            __m128i lo = _mm_loadu_si128((const __m128i *) (src+4*i  ));
+            __m128i hi = _mm_loadu_si128((const __m128i *) (src+4*i+8));
+            stbi__rgb_pack16(dest+3*i, lo, hi);
+         }
+         break;
    }
+   return i;
+}
+#endif
+
+// converts x*y pixels from data into good, which has room for them. a
+// conversion to fewer channels may be done in place (good == data)
+static int stbi__convert_format16_into(stbi__uint16 *good, stbi__uint16 *data, int img_n, int req_comp, unsigned int x, unsigned int y)
+{
+   int i,j;
+#ifdef STBI_SSE2
+   int simd = stbi__sse2_available();
+#endif
 
    for (j=0; j < (int) y; ++j) {
       stbi__uint16 *src  = data + j * x * img_n   ;
       stbi__uint16 *dest = good + j * x * req_comp;
+      int done = 0;
+
+#ifdef STBI_SSE2
+      if (simd) {
+         done = stbi__convert_row16_sse2(dest, src, img_n, req_comp, (int) x);
+         src  += done * img_n;
+         dest += done * req_comp;
+      }
+#endif
 
       #define STBI__COMBO(a,b)  ((a)*8+(b))
-      #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+      #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1-done; i >= 0; --i, src += a, dest += b)
       // convert source image with img_n components to one with req_comp components;
       // avoid switch per pixel, so use switch per scanline and massive macros
       switch (STBI__COMBO(img_n, req_comp)) {
@@ -1844,44 +2473,384 @@ static stbi__uint16 *stbi__convert_format16(stbi__uint16 *data, int img_n, int r
          STBI__CASE(4,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
          STBI__CASE(4,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = src[3]; } break;
          STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                       } break;
-         default: STBI_ASSERT(0); STBI_FREE(data); STBI_FREE(good); return (stbi__uint16*) stbi__errpuc("unsupported", "Unsupported format conversion");
+         default: STBI_ASSERT(0); return stbi__err("unsupported", "Unsupported format conversion");
       }
       #undef STBI__CASE
    }
-
-   STBI_FREE(data);
-   return good;
+   return 1;
 }
-#endif
 
-#ifndef STBI_NO_LINEAR
-static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp)
+static stbi__uint16 *stbi__convert_format16(stbi__uint16 *data, int img_n, int req_comp, unsigned int x, unsigned int y)
 {
-   int i,k,n;
-   float *output;
-   if (!data) return NULL;
-   output = (float *) stbi__malloc_mad4(x, y, comp, sizeof(float), 0);
-   if (output == NULL) { STBI_FREE(data); return stbi__errpf("outofmem", "Out of memory"); }
-   // compute number of non-alpha components
-   if (comp & 1) n = comp; else n = comp-1;
-   for (i=0; i < x*y; ++i) {
-      for (k=0; k < n; ++k) {
-         output[i*comp + k] = (float) (pow(data[i*comp+k]/255.0f, stbi__l2h_gamma) * stbi__l2h_scale);
+   stbi__uint16 *good;
+
+   if (req_comp == img_n) return data;
+   STBI_ASSERT(req_comp >= 1 && req_comp <= 4);
+
+   if (req_comp < img_n) {
+      if (!stbi__convert_format16_into(data, data, img_n, req_comp, x, y)) {
+         STBI_FREE(data);
+         return NULL;
       }
+      good = (stbi__uint16 *) STBI_REALLOC_SIZED(data, (size_t) img_n * x * y * 2, (size_t) req_comp * x * y * 2);
+      return good ? good : data;
    }
-   if (n < comp) {
-      for (i=0; i < x*y; ++i) {
-         output[i*comp + n] = data[i*comp + n]/255.0f;
-      }
+
+   good = (stbi__uint16 *) stbi__malloc(req_comp * x * y * 2);
+   if (good == NULL) {
+      STBI_FREE(data);
+      return (stbi__uint16 *) stbi__errpuc("outofmem", "Out of memory");
+   }
+
+   if (!stbi__convert_format16_into(good, data, img_n, req_comp, x, y)) {
+      STBI_FREE(good);
+      good = NULL;
    }
    STBI_FREE(data);
-   return output;
+   return good;
 }
 #endif
 
-#ifndef STBI_NO_HDR
-#define stbi__float2int(x)   ((int) (x))
-static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
+//////////////////////////////////////////////////////////////////////////////
+//
+//  row streaming (stbi_load_rows)
+//
+//  decoders that can produce rows in order hand them to stbi__rows_emit a
+//  batch at a time; everything else is decoded whole and then cut into
+//  batches by stbi__rows_emit_image
+
+// a batch is as many rows as fit in this many bytes, so it is still in
+// cache when the callback reads it; at least one row
+#ifndef STBI_ROWS_BATCH_BYTES
+#define STBI_ROWS_BATCH_BYTES  (1 << 16)
+#endif
+
+static int stbi__rows_batch(stbi__uint32 x, int bytes_per_pixel)
+{
+   size_t row = (size_t) x * bytes_per_pixel;
+   return row >= STBI_ROWS_BATCH_BYTES ? 1 : (int) (STBI_ROWS_BATCH_BYTES / row);
+}
+
+static stbi_uc *stbi__rows_reserve(stbi__rows *r, size_t len)
+{
+   if (len > r->buf_len) {
+      STBI_FREE(r->buf);
+      r->buf_len = 0;
+      r->buf = (stbi_uc *) stbi__malloc(len);
+      if (r->buf == NULL) return stbi__errpuc("outofmem", "Out of memory");
+      r->buf_len = len;
+   }
+   return r->buf;
+}
+
+// where the next rows of the image go in the caller's buffer of a
+// stbi_load_into decode; fails if they don't fit
+static stbi_uc *stbi__rows_dest(stbi__rows *r, stbi__uint32 x, int rows, int n)
+{
+   size_t row_bytes = (size_t) x * n;
+   if ((size_t) (r->y + rows) * row_bytes > r->dest_len)
+      return stbi__errpuc("buffer too small", "Output buffer too small for image");
+   return r->dest + r->y * row_bytes;
+}
+
+#ifndef STBI_NO_PNG
+// for a stbi_load that goes through the rows: once the decoder knows the
+// size of the image, makes dest the result to convert the rows into
+static int stbi__rows_alloc(stbi__rows *r, stbi__uint32 x, stbi__uint32 y)
+{
+   if (!r->alloc || r->dest) return 1;
+   STBI_ASSERT(r->req_comp);
+   r->dest = (stbi_uc *) stbi__malloc_mad3(x, y, r->req_comp, 0);
+   if (r->dest == NULL) return stbi__err("outofmem", "Out of memory");
+   r->dest_len = (size_t) x * y * r->req_comp;
+   return 1;
+}
+#endif
+
+// hands the next rows of the image to the callback, or writes them to the
+// caller's buffer. data holds them with img_n channels of 8 or 16 bits; they
+// go out with req_comp channels of 8, converted as stbi_load would. data may
+// be r->buf only if it needs no conversion, and may already be where
+// stbi__rows_dest says the rows go
+static int stbi__rows_emit(stbi__rows *r, void *data, stbi__uint32 x, int rows, int img_n, int is16)
+{
+   int out_n = r->req_comp ? r->req_comp : img_n;
+   size_t i, count = (size_t) x * rows * out_n;
+   stbi_uc *out = NULL;
+
+   if (r->dest) {
+      out = stbi__rows_dest(r, x, rows, out_n);
+      if (out == NULL) return 0;
+   }
+   if (img_n != out_n) {
+      // 8-bit rows convert straight into the caller's buffer
+      void *conv = out && !is16 ? out : stbi__rows_reserve(r, count * (is16 ? 2 : 1));
+      if (conv == NULL) return 0;
+      // only PNG, and the formats stbi__load_rows decodes whole, hand over
+      // rows that are not in the requested format yet
+      #if defined(STBI_NO_PNG) && defined(STBI_NO_BMP) && defined(STBI_NO_PSD) && defined(STBI_NO_TGA) && defined(STBI_NO_GIF) && defined(STBI_NO_PIC) && defined(STBI_NO_PNM)
+      STBI_ASSERT(0);
+      #else
+      if (is16) {
+         #if defined(STBI_NO_PNG) && defined(STBI_NO_PSD) && defined(STBI_NO_PNM)
+         STBI_ASSERT(0);
+         #else
+         stbi__convert_format16_into((stbi__uint16 *) conv, (stbi__uint16 *) data, img_n, out_n, x, rows);
+         #endif
+      } else
+         stbi__convert_format_into((stbi_uc *) conv, (stbi_uc *) data, img_n, out_n, x, rows);
+      #endif
+      data = conv;
+   }
+   if (is16) {
+      // top half of each sample, as stbi__convert_16_to_8; in place is
+      // fine since each byte is written behind the samples still to read.
+      // if data is r->buf it is big enough already, so is not reallocated
+      stbi__uint16 *src = (stbi__uint16 *) data;
+      if (out == NULL) out = stbi__rows_reserve(r, count);
+      if (out == NULL) return 0;
+      for (i=0; i < count; ++i)
+         out[i] = (stbi_uc) (src[i] >> 8);
+   } else if (out == NULL) {
+      out = (stbi_uc *) data;
+   } else if (out != data) {
+      memcpy(out, data, count);
+   }
+   if (r->cb && !r->cb(r->user, r->y, rows, out, (int) x, out_n))
+      return stbi__err("stopped", "Row callback stopped the load");
+   r->y += rows;
+   return 1;
+}
+
+static int stbi__rows_emit_image(stbi__rows *r, void *data, stbi__uint32 x, stbi__uint32 y, int img_n, int is16)
+{
+   size_t row_bytes = (size_t) x * img_n * (is16 ? 2 : 1);
+   stbi__uint32 j, n, batch = stbi__rows_batch(x, img_n * (is16 ? 2 : 1));
+   for (j=0; j < y; j += n) {
+      n = y - j < batch ? y - j : batch;
+      if (!stbi__rows_emit(r, (stbi_uc *) data + j * row_bytes, x, n, img_n, is16)) return 0;
+   }
+   return 1;
+}
+
+static int stbi__load_rows(stbi__context *s, int *x, int *y, int *comp, stbi__rows *r)
+{
+   stbi__result_info ri;
+   void *data;
+   int w, h, n, ok, req_comp;
+
+   #ifndef STBI_NO_PNG
+   if (stbi__png_test(s))  return stbi__png_load_rows(s,x,y,comp, r);
+   #endif
+   #ifndef STBI_NO_JPEG
+   if (stbi__jpeg_test(s)) return stbi__jpeg_load_rows(s,x,y,comp, r);
+   #endif
+
+   // the rest are decoded whole, in the channels of the file so that the
+   // conversion to req_comp can go straight into the caller's buffer; their
+   // loaders convert in just the same way. HDR is tonemapped to req_comp
+   // channels from the float data, so gets it up front
+   req_comp = 0;
+   #ifndef STBI_NO_HDR
+   if (stbi__hdr_test(s)) req_comp = r->req_comp;
+   #endif
+   data = stbi__load_main(s, &w, &h, &n, req_comp, &ri, 8);
+   if (data == NULL) return 0;
+   STBI_ASSERT(ri.bits_per_channel == 8 || ri.bits_per_channel == 16);
+   ok = stbi__rows_emit_image(r, data, w, h, req_comp ? req_comp : n, ri.bits_per_channel == 16);
+   STBI_FREE(data);
+   if (ok) {
+      *x = w;
+      *y = h;
+      if (comp) *comp = n;
+   }
+   return ok;
+}
+
+static void stbi__rows_start(stbi__rows *r, int req_comp, stbi_rows_callback *cb, void *user, stbi_uc *dest, size_t dest_len)
+{
+   r->cb = cb;
+   r->user = user;
+   r->dest = dest;
+   r->dest_len = dest_len;
+   r->req_comp = req_comp;
+   r->y = 0;
+   r->buf = NULL;
+   r->buf_len = 0;
+   r->alloc = 0;
+}
+
+static int stbi__load_rows_main(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi_rows_callback *cb, void *user)
+{
+   stbi__rows r;
+   int ok;
+   if (req_comp < 0 || req_comp > 4) return stbi__err("bad req_comp", "Internal error");
+   stbi__rows_start(&r, req_comp, cb, user, NULL, 0);
+   ok = stbi__load_rows(s, x, y, comp, &r);
+   STBI_FREE(r.buf);
+   return ok;
+}
+
+static int stbi__load_into_main(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi_uc *out, size_t out_size)
+{
+   stbi__rows r;
+   int ok, n;
+   if (req_comp < 0 || req_comp > 4) return stbi__err("bad req_comp", "Internal error");
+   stbi__rows_start(&r, req_comp, NULL, NULL, out, out_size);
+   ok = stbi__load_rows(s, x, y, &n, &r);
+   STBI_FREE(r.buf);
+   if (!ok) return 0;
+   if (comp) *comp = n;
+   if (stbi__vertically_flip_on_load)
+      stbi__vertical_flip(out, *x, *y, req_comp ? req_comp : n);
+   return 1;
+}
+
+STBIDEF int stbi_load_rows_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, stbi_rows_callback *cb, void *cb_user)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__load_rows_main(&s,x,y,comp,req_comp,cb,cb_user);
+}
+
+STBIDEF int stbi_load_rows_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp, stbi_rows_callback *cb, void *cb_user)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__load_rows_main(&s,x,y,comp,req_comp,cb,cb_user);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_load_rows(char const *filename, int *x, int *y, int *comp, int req_comp, stbi_rows_callback *cb, void *cb_user)
+{
+   FILE *f = stbi__fopen(filename, "rb");
+   stbi__context s;
+   int result;
+   if (!f) return stbi__err("can't fopen", "Unable to open file");
+   stbi__start_file(&s,f);
+   result = stbi__load_rows_main(&s,x,y,comp,req_comp,cb,cb_user);
+   fclose(f);
+   return result;
+}
+#endif
+
+STBIDEF int stbi_load_into_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, stbi_uc *out, size_t out_size)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__load_into_main(&s,x,y,comp,req_comp,out,out_size);
+}
+
+STBIDEF int stbi_load_into_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp, stbi_uc *out, size_t out_size)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__load_into_main(&s,x,y,comp,req_comp,out,out_size);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_load_into(char const *filename, int *x, int *y, int *comp, int req_comp, stbi_uc *out, size_t out_size)
+{
+   FILE *f = stbi__fopen(filename, "rb");
+   stbi__context s;
+   int result;
+   if (!f) return stbi__err("can't fopen", "Unable to open file");
+   stbi__start_file(&s,f);
+   result = stbi__load_into_main(&s,x,y,comp,req_comp,out,out_size);
+   fclose(f);
+   return result;
+}
+#endif
+
+STBIDEF stbi_decoder *stbi_decoder_create(void)
+{
+   stbi_decoder *dec = (stbi_decoder *) STBI_MALLOC_KEPT(sizeof(*dec));
+   if (!dec) return (stbi_decoder *) stbi__errpuc("outofmem", "Out of memory");
+   memset(dec, 0, sizeof(*dec));
+   return dec;
+}
+
+STBIDEF void stbi_decoder_free(stbi_decoder *dec)
+{
+   int i;
+   if (!dec) return;
+   for (i=0; i < STBI__KEEP_count; ++i)
+      STBI_FREE(dec->kept[i]);
+   STBI_FREE(dec);
+}
+
+STBIDEF stbi_uc *stbi_decoder_load_from_memory(stbi_decoder *dec, stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   s.dec = dec;
+   return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+}
+
+STBIDEF int stbi_decoder_load_into_from_memory(stbi_decoder *dec, stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, stbi_uc *out, size_t out_size)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   s.dec = dec;
+   return stbi__load_into_main(&s,x,y,comp,req_comp,out,out_size);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_decoder_load(stbi_decoder *dec, char const *filename, int *x, int *y, int *comp, int req_comp)
+{
+   FILE *f = stbi__fopen(filename, "rb");
+   stbi__context s;
+   stbi_uc *result;
+   if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+   stbi__start_file(&s,f);
+   s.dec = dec;
+   result = stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+   fclose(f);
+   return result;
+}
+
+STBIDEF int stbi_decoder_load_into(stbi_decoder *dec, char const *filename, int *x, int *y, int *comp, int req_comp, stbi_uc *out, size_t out_size)
+{
+   FILE *f = stbi__fopen(filename, "rb");
+   stbi__context s;
+   int result;
+   if (!f) return stbi__err("can't fopen", "Unable to open file");
+   stbi__start_file(&s,f);
+   s.dec = dec;
+   result = stbi__load_into_main(&s,x,y,comp,req_comp,out,out_size);
+   fclose(f);
+   return result;
+}
+#endif
+
+#ifndef STBI_NO_LINEAR
+static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp)
+{
+   int i,k,n;
+   float *output;
+   if (!data) return NULL;
+   output = (float *) stbi__malloc_mad4(x, y, comp, sizeof(float), 0);
+   if (output == NULL) { STBI_FREE(data); return stbi__errpf("outofmem", "Out of memory"); }
+   // compute number of non-alpha components
+   if (comp & 1) n = comp; else n = comp-1;
+   for (i=0; i < x*y; ++i) {
+      for (k=0; k < n; ++k) {
+         output[i*comp + k] = (float) (pow(data[i*comp+k]/255.0f, stbi__l2h_gamma) * stbi__l2h_scale);
+      }
+   }
+   if (n < comp) {
+      for (i=0; i < x*y; ++i) {
+         output[i*comp + n] = data[i*comp + n]/255.0f;
+      }
+   }
+   STBI_FREE(data);
+   return output;
+}
+#endif
+
+#ifndef STBI_NO_HDR
+#define stbi__float2int(x)   ((int) (x))
+static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
 {
    int i,k,n;
    stbi_uc *output;
@@ -1933,7 +2902,7 @@ static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
 #ifndef STBI_NO_JPEG
 
 // huffman decoding acceleration
-#define FAST_BITS   9  // larger handles more cases; smaller stomps less cache
+#define FAST_BITS   11 // larger handles more cases; smaller stomps less cache
 
 typedef struct
 {
@@ -1951,8 +2920,17 @@ typedef struct
    stbi__context *s;
    stbi__huffman huff_dc[4];
    stbi__huffman huff_ac[4];
-   stbi__uint16 dequant[4][64];
    stbi__int16 fast_ac[4][1 << FAST_BITS];
+   stbi__int16 fast_dc[4][1 << FAST_BITS];
+   // the tables above are kept from image to image by a decoder context;
+   // bit tc*4+th of these masks stands for table th of class tc
+   stbi_uc huff_key[8][16+256]; // code counts and values each was built from
+   int huff_clean;  // built once, over zeros, from huff_key
+   int huff_dirty;  // not all zeros
+
+   // everything from here on starts out cleared for each image
+   stbi__uint16 dequant[4][64];
+   int huff_defined; // defined by this image so far
 
 // sizes for components, interleaved MCUs
    int img_h_max, img_v_max;
@@ -1976,7 +2954,7 @@ typedef struct
       int      coeff_w, coeff_h; // number of 8x8 coefficient blocks
    } img_comp[4];
 
-   stbi__uint32   code_buffer; // jpeg entropy-coded buffer
+   stbi__uint64   code_buffer; // jpeg entropy-coded buffer, next bit in the MSB
    int            code_bits;   // number of valid bits
    unsigned char  marker;      // marker seen while filling entropy buffer
    int            nomore;      // flag if we saw a marker so must stop
@@ -1990,9 +2968,15 @@ typedef struct
    int            jfif;
    int            app14_color_transform; // Adobe APP14 tag
    int            rgb;
+   int            scale_log2;  // output 1/(1<<scale_log2) size, 0..3; 3 = DC only
+   int            luma_only;   // grey output from YCbCr: chroma is never transformed
 
    int scan_n, order[4];
    int restart_interval, todo;
+   stbi_uc *stream_copy; // rest of a callback stream, read in for a threaded decode
+
+   stbi__rows *rows;     // stbi_load_rows consumer, if any
+   int rows_streamed;    // the image went to it as it was decoded
 
 // kernels
    void (*idct_block_kernel)(stbi_uc *out, int out_stride, short data[64]);
@@ -2046,7 +3030,8 @@ static int stbi__build_huffman(stbi__huffman *h, int *count)
 }
 
 // build a table that decodes both magnitude and value of small ACs in
-// one go.
+// one go. run with a DC table it does the same for the DC difference
+// (run is then always 0).
 static void stbi__build_fast_ac(stbi__int16 *fast_ac, stbi__huffman *h)
 {
    int i;
@@ -2072,27 +3057,34 @@ static void stbi__build_fast_ac(stbi__int16 *fast_ac, stbi__huffman *h)
    }
 }
 
+// fills the bit buffer to at least 57 bits, so a refill covers several
+// huffman symbols. anything but 0xff is an ordinary data byte and is taken
+// straight from the context buffer; 0xff (stuffing or a marker) and buffer
+// refills go through stbi__get8.
 static void stbi__grow_buffer_unsafe(stbi__jpeg *j)
 {
+   stbi__context *s = j->s;
    do {
-      unsigned int b = j->nomore ? 0 : stbi__get8(j->s);
-      if (b == 0xff) {
-         int c = stbi__get8(j->s);
-         while (c == 0xff) c = stbi__get8(j->s); // consume fill bytes
-         if (c != 0) {
-            j->marker = (unsigned char) c;
-            j->nomore = 1;
-            return;
+      unsigned int b;
+      if (!j->nomore && s->img_buffer < s->img_buffer_end && *s->img_buffer != 0xff) {
+         b = *s->img_buffer++;
+      } else {
+         b = j->nomore ? 0 : stbi__get8(s);
+         if (b == 0xff) {
+            int c = stbi__get8(s);
+            while (c == 0xff) c = stbi__get8(s); // consume fill bytes
+            if (c != 0) {
+               j->marker = (unsigned char) c;
+               j->nomore = 1;
+               return;
+            }
          }
       }
-      j->code_buffer |= b << (24 - j->code_bits);
+      j->code_buffer |= (stbi__uint64) b << (56 - j->code_bits);
       j->code_bits += 8;
-   } while (j->code_bits <= 24);
+   } while (j->code_bits <= 56);
 }
 
-// (1 << n) - 1
-static const stbi__uint32 stbi__bmask[17]={0,1,3,7,15,31,63,127,255,511,1023,2047,4095,8191,16383,32767,65535};
-
 // decode a jpeg huffman value from the bitstream
 stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
 {
@@ -2103,7 +3095,7 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
 
    // look at the top FAST_BITS and determine what symbol ID it is,
    // if the code is <= FAST_BITS
-   c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+   c = (int) (j->code_buffer >> (64 - FAST_BITS));
    k = h->fast[c];
    if (k < 255) {
       int s = h->size[k];
@@ -2120,7 +3112,7 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
    // end; in other words, regardless of the number of bits, it
    // wants to be compared against something shifted to have 16;
    // that way we don't need to shift inside the loop.
-   temp = j->code_buffer >> 16;
+   temp = (unsigned int) (j->code_buffer >> 48);
    for (k=FAST_BITS+1 ; ; ++k)
       if (temp < h->maxcode[k])
          break;
@@ -2134,10 +3126,10 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
       return -1;
 
    // convert the huffman code to the symbol id
-   c = ((j->code_buffer >> (32 - k)) & stbi__bmask[k]) + h->delta[k];
+   c = (int) (j->code_buffer >> (64 - k)) + h->delta[k];
    if(c < 0 || c >= 256) // symbol id out of bounds!
        return -1;
-   STBI_ASSERT((((j->code_buffer) >> (32 - h->size[c])) & stbi__bmask[h->size[c]]) == h->code[c]);
+   STBI_ASSERT((j->code_buffer >> (64 - h->size[c])) == h->code[c]);
 
    // convert the id to a symbol
    j->code_bits -= k;
@@ -2149,7 +3141,7 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
 static const int stbi__jbias[16] = {0,-1,-3,-7,-15,-31,-63,-127,-255,-511,-1023,-2047,-4095,-8191,-16383,-32767};
 
 // combined JPEG 'receive' and JPEG 'extend', since baseline
-// always extends everything it receives.
+// always extends everything it receives. n is 1..15.
 stbi_inline static int stbi__extend_receive(stbi__jpeg *j, int n)
 {
    unsigned int k;
@@ -2157,23 +3149,21 @@ stbi_inline static int stbi__extend_receive(stbi__jpeg *j, int n)
    if (j->code_bits < n) stbi__grow_buffer_unsafe(j);
    if (j->code_bits < n) return 0; // ran out of bits from stream, return 0s intead of continuing
 
-   sgn = j->code_buffer >> 31; // sign bit always in MSB; 0 if MSB clear (positive), 1 if MSB set (negative)
-   k = stbi_lrot(j->code_buffer, n);
-   j->code_buffer = k & ~stbi__bmask[n];
-   k &= stbi__bmask[n];
+   sgn = (int) (j->code_buffer >> 63); // sign bit always in MSB; 0 if MSB clear (positive), 1 if MSB set (negative)
+   k = (unsigned int) (j->code_buffer >> (64 - n));
+   j->code_buffer <<= n;
    j->code_bits -= n;
    return k + (stbi__jbias[n] & (sgn - 1));
 }
 
-// get some unsigned bits
+// get some unsigned bits, n is 1..16
 stbi_inline static int stbi__jpeg_get_bits(stbi__jpeg *j, int n)
 {
    unsigned int k;
    if (j->code_bits < n) stbi__grow_buffer_unsafe(j);
    if (j->code_bits < n) return 0; // ran out of bits from stream, return 0s intead of continuing
-   k = stbi_lrot(j->code_buffer, n);
-   j->code_buffer = k & ~stbi__bmask[n];
-   k &= stbi__bmask[n];
+   k = (unsigned int) (j->code_buffer >> (64 - n));
+   j->code_buffer <<= n;
    j->code_bits -= n;
    return k;
 }
@@ -2183,10 +3173,10 @@ stbi_inline static int stbi__jpeg_get_bit(stbi__jpeg *j)
    unsigned int k;
    if (j->code_bits < 1) stbi__grow_buffer_unsafe(j);
    if (j->code_bits < 1) return 0; // ran out of bits from stream, return 0s intead of continuing
-   k = j->code_buffer;
+   k = (unsigned int) (j->code_buffer >> 63);
    j->code_buffer <<= 1;
    --j->code_bits;
-   return k & 0x80000000;
+   return k;
 }
 
 // given a value that's at position X in the zigzag stream,
@@ -2206,33 +3196,77 @@ static const stbi_uc stbi__jpeg_dezigzag[64+15] =
    63, 63, 63, 63, 63, 63, 63
 };
 
+// consume the AC terms of a block without storing them; a DC-only decode
+// still has to walk them to find where the next block starts
+static int stbi__jpeg_skip_block_ac(stbi__jpeg *j, stbi__huffman *hac, stbi__int16 *fac)
+{
+   int k = 1;
+   do {
+      int c,r,s;
+      if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
+      c = (int) (j->code_buffer >> (64 - FAST_BITS));
+      r = fac[c];
+      if (r) { // fast-AC path
+         k += ((r >> 4) & 15) + 1; // run
+         s = r & 15; // combined length
+         if (s > j->code_bits) return stbi__err("bad huffman code", "Combined length longer than code bits available");
+         j->code_buffer <<= s;
+         j->code_bits -= s;
+      } else {
+         int rs = stbi__jpeg_huff_decode(j, hac);
+         if (rs < 0) return stbi__err("bad huffman code","Corrupt JPEG");
+         s = rs & 15;
+         r = rs >> 4;
+         if (s == 0) {
+            if (rs != 0xf0) break; // end block
+            k += 16;
+         } else {
+            k += r + 1;
+            stbi__extend_receive(j,s);
+         }
+      }
+   } while (k < 64);
+   return 1;
+}
+
 // decode one 64-entry block--
-static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman *hdc, stbi__huffman *hac, stbi__int16 *fac, int b, stbi__uint16 *dequant)
+static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman *hdc, stbi__huffman *hac, stbi__int16 *fac, stbi__int16 *fdc, int b, stbi__uint16 *dequant)
 {
    int diff,dc,k;
    int t;
 
    if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
-   t = stbi__jpeg_huff_decode(j, hdc);
-   if (t < 0 || t > 15) return stbi__err("bad huffman code","Corrupt JPEG");
+   t = fdc[j->code_buffer >> (64 - FAST_BITS)];
+   if (t && (t & 0xf0) == 0) { // fast-DC path: code and difference in one lookup
+      int s = t & 15;
+      if (s > j->code_bits) return stbi__err("bad huffman code", "Combined length longer than code bits available");
+      j->code_buffer <<= s;
+      j->code_bits -= s;
+      diff = t >> 8;
+   } else {
+      t = stbi__jpeg_huff_decode(j, hdc);
+      if (t < 0 || t > 15) return stbi__err("bad huffman code","Corrupt JPEG");
+      diff = t ? stbi__extend_receive(j, t) : 0;
+   }
 
    // 0 all the ac values now so we can do it 32-bits at a time
    memset(data,0,64*sizeof(data[0]));
 
-   diff = t ? stbi__extend_receive(j, t) : 0;
    if (!stbi__addints_valid(j->img_comp[b].dc_pred, diff)) return stbi__err("bad delta","Corrupt JPEG");
    dc = j->img_comp[b].dc_pred + diff;
    j->img_comp[b].dc_pred = dc;
    if (!stbi__mul2shorts_valid(dc, dequant[0])) return stbi__err("can't merge dc and ac", "Corrupt JPEG");
    data[0] = (short) (dc * dequant[0]);
 
+   if (j->scale_log2 == 3 || (j->luma_only && b != 0)) return stbi__jpeg_skip_block_ac(j, hac, fac);
+
    // decode AC components, see JPEG spec
    k = 1;
    do {
       unsigned int zig;
       int c,r,s;
       if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
-      c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+      c = (int) (j->code_buffer >> (64 - FAST_BITS));
       r = fac[c];
       if (r) { // fast-AC path
          k += (r >> 4) & 15; // run
@@ -2310,7 +3344,7 @@ static int stbi__jpeg_decode_block_prog_ac(stbi__jpeg *j, short data[64], stbi__
          unsigned int zig;
          int c,r,s;
          if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
-         c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+         c = (int) (j->code_buffer >> (64 - FAST_BITS));
          r = fac[c];
          if (r) { // fast-AC path
             k += (r >> 4) & 15; // run
@@ -2704,62 +3738,240 @@ static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
 
 #endif // STBI_SSE2
 
-#ifdef STBI_NEON
-
-// NEON integer IDCT. should produce bit-identical
-// results to the generic C version.
-static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
+#ifdef STBI_AVX2
+// avx2 version of stbi__idct_simd, bit-identical to it. each row of 8 shorts
+// is kept "spread": elements 0-3 in the low 64 bits of lane 0, elements 4-7
+// in the low 64 bits of lane 1. one 256-bit unpack+madd then produces both
+// the _l and _h halves the sse2 version computes separately, and 32-bit
+// results pack straight back into the same layout.
+static STBI__AVX2_TARGET void stbi__idct_avx2(stbi_uc *out, int out_stride, short data[64])
 {
-   int16x8_t row0, row1, row2, row3, row4, row5, row6, row7;
-
-   int16x4_t rot0_0 = vdup_n_s16(stbi__f2f(0.5411961f));
-   int16x4_t rot0_1 = vdup_n_s16(stbi__f2f(-1.847759065f));
-   int16x4_t rot0_2 = vdup_n_s16(stbi__f2f( 0.765366865f));
-   int16x4_t rot1_0 = vdup_n_s16(stbi__f2f( 1.175875602f));
-   int16x4_t rot1_1 = vdup_n_s16(stbi__f2f(-0.899976223f));
-   int16x4_t rot1_2 = vdup_n_s16(stbi__f2f(-2.562915447f));
-   int16x4_t rot2_0 = vdup_n_s16(stbi__f2f(-1.961570560f));
-   int16x4_t rot2_1 = vdup_n_s16(stbi__f2f(-0.390180644f));
-   int16x4_t rot3_0 = vdup_n_s16(stbi__f2f( 0.298631336f));
-   int16x4_t rot3_1 = vdup_n_s16(stbi__f2f( 2.053119869f));
-   int16x4_t rot3_2 = vdup_n_s16(stbi__f2f( 3.072711026f));
-   int16x4_t rot3_3 = vdup_n_s16(stbi__f2f( 1.501321110f));
+   __m256i row0, row1, row2, row3, row4, row5, row6, row7;
+   __m128i c0, c1, c2, c3, c4, c5, c6, c7;
+   __m128i tmp;
 
-#define dct_long_mul(out, inq, coeff) \
-   int32x4_t out##_l = vmull_s16(vget_low_s16(inq), coeff); \
-   int32x4_t out##_h = vmull_s16(vget_high_s16(inq), coeff)
+   #define dct_const(x,y)  _mm256_setr_epi16((x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y))
 
-#define dct_long_mac(out, acc, inq, coeff) \
-   int32x4_t out##_l = vmlal_s16(acc##_l, vget_low_s16(inq), coeff); \
-   int32x4_t out##_h = vmlal_s16(acc##_h, vget_high_s16(inq), coeff)
+   // short[8] -> spread row, and back
+   #define dct_spread(x)   _mm256_permute4x64_epi64(_mm256_castsi128_si256(x), 0x10)
+   #define dct_compact(x)  _mm256_castsi256_si128(_mm256_permute4x64_epi64((x), 0x08))
 
-#define dct_widen(out, inq) \
-   int32x4_t out##_l = vshll_n_s16(vget_low_s16(inq), 12); \
-   int32x4_t out##_h = vshll_n_s16(vget_high_s16(inq), 12)
+   // out(0) = c0[even]*x + c0[odd]*y   (c0, x, y 16-bit, out 32-bit)
+   // out(1) = c1[even]*x + c1[odd]*y
+   #define dct_rot(out0,out1, x,y,c0,c1) \
+      __m256i c0##lo = _mm256_unpacklo_epi16((x),(y)); \
+      __m256i out0 = _mm256_madd_epi16(c0##lo, c0); \
+      __m256i out1 = _mm256_madd_epi16(c0##lo, c1)
 
-// wide add
-#define dct_wadd(out, a, b) \
-   int32x4_t out##_l = vaddq_s32(a##_l, b##_l); \
-   int32x4_t out##_h = vaddq_s32(a##_h, b##_h)
+   // out = in << 12  (in 16-bit, out 32-bit)
+   #define dct_widen(out, in) \
+      __m256i out = _mm256_srai_epi32(_mm256_unpacklo_epi16(_mm256_setzero_si256(), (in)), 4)
 
-// wide sub
-#define dct_wsub(out, a, b) \
-   int32x4_t out##_l = vsubq_s32(a##_l, b##_l); \
-   int32x4_t out##_h = vsubq_s32(a##_h, b##_h)
+   // butterfly a/b, add bias, then shift by "s" and pack
+   #define dct_bfly32o(out0, out1, a,b,bias,s) \
+      { \
+         __m256i abiased = _mm256_add_epi32(a, bias); \
+         __m256i sum = _mm256_srai_epi32(_mm256_add_epi32(abiased, b), s); \
+         __m256i dif = _mm256_srai_epi32(_mm256_sub_epi32(abiased, b), s); \
+         out0 = _mm256_packs_epi32(sum, sum); \
+         out1 = _mm256_packs_epi32(dif, dif); \
+      }
 
-// butterfly a/b, then shift using "shiftop" by "s" and pack
-#define dct_bfly32o(out0,out1, a,b,shiftop,s) \
-   { \
-      dct_wadd(sum, a, b); \
-      dct_wsub(dif, a, b); \
-      out0 = vcombine_s16(shiftop(sum_l, s), shiftop(sum_h, s)); \
-      out1 = vcombine_s16(shiftop(dif_l, s), shiftop(dif_h, s)); \
-   }
+   // 8-bit interleave step (for transposes)
+   #define dct_interleave8(a, b) \
+      tmp = a; \
+      a = _mm_unpacklo_epi8(a, b); \
+      b = _mm_unpackhi_epi8(tmp, b)
 
-#define dct_pass(shiftop, shift) \
-   { \
-      /* even part */ \
-      int16x8_t sum26 = vaddq_s16(row2, row6); \
+   #define dct_pass(bias,shift) \
+      { \
+         /* even part */ \
+         dct_rot(t2e,t3e, row2,row6, rot0_0,rot0_1); \
+         __m256i sum04 = _mm256_add_epi16(row0, row4); \
+         __m256i dif04 = _mm256_sub_epi16(row0, row4); \
+         dct_widen(t0e, sum04); \
+         dct_widen(t1e, dif04); \
+         __m256i x0 = _mm256_add_epi32(t0e, t3e); \
+         __m256i x3 = _mm256_sub_epi32(t0e, t3e); \
+         __m256i x1 = _mm256_add_epi32(t1e, t2e); \
+         __m256i x2 = _mm256_sub_epi32(t1e, t2e); \
+         /* odd part */ \
+         dct_rot(y0o,y2o, row7,row3, rot2_0,rot2_1); \
+         dct_rot(y1o,y3o, row5,row1, rot3_0,rot3_1); \
+         __m256i sum17 = _mm256_add_epi16(row1, row7); \
+         __m256i sum35 = _mm256_add_epi16(row3, row5); \
+         dct_rot(y4o,y5o, sum17,sum35, rot1_0,rot1_1); \
+         __m256i x4 = _mm256_add_epi32(y0o, y4o); \
+         __m256i x5 = _mm256_add_epi32(y1o, y5o); \
+         __m256i x6 = _mm256_add_epi32(y2o, y5o); \
+         __m256i x7 = _mm256_add_epi32(y3o, y4o); \
+         dct_bfly32o(row0,row7, x0,x7,bias,shift); \
+         dct_bfly32o(row1,row6, x1,x6,bias,shift); \
+         dct_bfly32o(row2,row5, x2,x5,bias,shift); \
+         dct_bfly32o(row3,row4, x3,x4,bias,shift); \
+      }
+
+   __m256i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
+   __m256i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f( 0.765366865f), stbi__f2f(0.5411961f));
+   __m256i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
+   __m256i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
+   __m256i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f( 0.298631336f), stbi__f2f(-1.961570560f));
+   __m256i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f( 3.072711026f));
+   __m256i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f( 2.053119869f), stbi__f2f(-0.390180644f));
+   __m256i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f( 1.501321110f));
+
+   // rounding biases in column/row passes, see stbi__idct_block for explanation.
+   __m256i bias_0 = _mm256_set1_epi32(512);
+   __m256i bias_1 = _mm256_set1_epi32(65536 + (128<<17));
+
+   // load
+   row0 = dct_spread(_mm_load_si128((const __m128i *) (data + 0*8)));
+   row1 = dct_spread(_mm_load_si128((const __m128i *) (data + 1*8)));
+   row2 = dct_spread(_mm_load_si128((const __m128i *) (data + 2*8)));
+   row3 = dct_spread(_mm_load_si128((const __m128i *) (data + 3*8)));
+   row4 = dct_spread(_mm_load_si128((const __m128i *) (data + 4*8)));
+   row5 = dct_spread(_mm_load_si128((const __m128i *) (data + 5*8)));
+   row6 = dct_spread(_mm_load_si128((const __m128i *) (data + 6*8)));
+   row7 = dct_spread(_mm_load_si128((const __m128i *) (data + 7*8)));
+
+   // column pass
+   dct_pass(bias_0, 10);
+
+   {
+      // 16bit 8x8 transpose, done as two 4x8 halves side by side: pairing
+      // row k with row k+4 puts rows 0-3 in lane 0 and rows 4-7 in lane 1
+      __m256i a0 = _mm256_permute2x128_si256(row0, row4, 0x20); // columns 0-3
+      __m256i a1 = _mm256_permute2x128_si256(row1, row5, 0x20);
+      __m256i a2 = _mm256_permute2x128_si256(row2, row6, 0x20);
+      __m256i a3 = _mm256_permute2x128_si256(row3, row7, 0x20);
+      __m256i b0 = _mm256_permute2x128_si256(row0, row4, 0x31); // columns 4-7
+      __m256i b1 = _mm256_permute2x128_si256(row1, row5, 0x31);
+      __m256i b2 = _mm256_permute2x128_si256(row2, row6, 0x31);
+      __m256i b3 = _mm256_permute2x128_si256(row3, row7, 0x31);
+      __m256i a01 = _mm256_unpacklo_epi16(a0, a1);
+      __m256i a23 = _mm256_unpacklo_epi16(a2, a3);
+      __m256i b01 = _mm256_unpacklo_epi16(b0, b1);
+      __m256i b23 = _mm256_unpacklo_epi16(b2, b3);
+      // each result holds two transposed rows, spread, in its low/high qwords
+      row0 = _mm256_unpacklo_epi32(a01, a23);
+      row2 = _mm256_unpackhi_epi32(a01, a23);
+      row4 = _mm256_unpacklo_epi32(b01, b23);
+      row6 = _mm256_unpackhi_epi32(b01, b23);
+      row1 = _mm256_unpackhi_epi64(row0, row0);
+      row3 = _mm256_unpackhi_epi64(row2, row2);
+      row5 = _mm256_unpackhi_epi64(row4, row4);
+      row7 = _mm256_unpackhi_epi64(row6, row6);
+   }
+
+   // row pass
+   dct_pass(bias_1, 17);
+
+   c0 = dct_compact(row0);
+   c1 = dct_compact(row1);
+   c2 = dct_compact(row2);
+   c3 = dct_compact(row3);
+   c4 = dct_compact(row4);
+   c5 = dct_compact(row5);
+   c6 = dct_compact(row6);
+   c7 = dct_compact(row7);
+
+   {
+      // pack
+      __m128i p0 = _mm_packus_epi16(c0, c1); // a0a1a2a3...a7b0b1b2b3...b7
+      __m128i p1 = _mm_packus_epi16(c2, c3);
+      __m128i p2 = _mm_packus_epi16(c4, c5);
+      __m128i p3 = _mm_packus_epi16(c6, c7);
+
+      // 8bit 8x8 transpose pass 1
+      dct_interleave8(p0, p2); // a0e0a1e1...
+      dct_interleave8(p1, p3); // c0g0c1g1...
+
+      // transpose pass 2
+      dct_interleave8(p0, p1); // a0c0e0g0...
+      dct_interleave8(p2, p3); // b0d0f0h0...
+
+      // transpose pass 3
+      dct_interleave8(p0, p2); // a0b0c0d0...
+      dct_interleave8(p1, p3); // a4b4c4d4...
+
+      // store
+      _mm_storel_epi64((__m128i *) out, p0); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p0, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p2); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p2, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p1); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p1, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p3); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p3, 0x4e));
+   }
+
+#undef dct_const
+#undef dct_spread
+#undef dct_compact
+#undef dct_rot
+#undef dct_widen
+#undef dct_bfly32o
+#undef dct_interleave8
+#undef dct_pass
+}
+#endif // STBI_AVX2
+
+#ifdef STBI_NEON
+
+// NEON integer IDCT. should produce bit-identical
+// results to the generic C version.
+static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
+{
+   int16x8_t row0, row1, row2, row3, row4, row5, row6, row7;
+
+   int16x4_t rot0_0 = vdup_n_s16(stbi__f2f(0.5411961f));
+   int16x4_t rot0_1 = vdup_n_s16(stbi__f2f(-1.847759065f));
+   int16x4_t rot0_2 = vdup_n_s16(stbi__f2f( 0.765366865f));
+   int16x4_t rot1_0 = vdup_n_s16(stbi__f2f( 1.175875602f));
+   int16x4_t rot1_1 = vdup_n_s16(stbi__f2f(-0.899976223f));
+   int16x4_t rot1_2 = vdup_n_s16(stbi__f2f(-2.562915447f));
+   int16x4_t rot2_0 = vdup_n_s16(stbi__f2f(-1.961570560f));
+   int16x4_t rot2_1 = vdup_n_s16(stbi__f2f(-0.390180644f));
+   int16x4_t rot3_0 = vdup_n_s16(stbi__f2f( 0.298631336f));
+   int16x4_t rot3_1 = vdup_n_s16(stbi__f2f( 2.053119869f));
+   int16x4_t rot3_2 = vdup_n_s16(stbi__f2f( 3.072711026f));
+   int16x4_t rot3_3 = vdup_n_s16(stbi__f2f( 1.501321110f));
+
+#define dct_long_mul(out, inq, coeff) \
+   int32x4_t out##_l = vmull_s16(vget_low_s16(inq), coeff); \
+   int32x4_t out##_h = vmull_s16(vget_high_s16(inq), coeff)
+
+#define dct_long_mac(out, acc, inq, coeff) \
+   int32x4_t out##_l = vmlal_s16(acc##_l, vget_low_s16(inq), coeff); \
+   int32x4_t out##_h = vmlal_s16(acc##_h, vget_high_s16(inq), coeff)
+
+#define dct_widen(out, inq) \
+   int32x4_t out##_l = vshll_n_s16(vget_low_s16(inq), 12); \
+   int32x4_t out##_h = vshll_n_s16(vget_high_s16(inq), 12)
+
+// wide add
+#define dct_wadd(out, a, b) \
+   int32x4_t out##_l = vaddq_s32(a##_l, b##_l); \
+   int32x4_t out##_h = vaddq_s32(a##_h, b##_h)
+
+// wide sub
+#define dct_wsub(out, a, b) \
+   int32x4_t out##_l = vsubq_s32(a##_l, b##_l); \
+   int32x4_t out##_h = vsubq_s32(a##_h, b##_h)
+
+// butterfly a/b, then shift using "shiftop" by "s" and pack
+#define dct_bfly32o(out0,out1, a,b,shiftop,s) \
+   { \
+      dct_wadd(sum, a, b); \
+      dct_wsub(dif, a, b); \
+      out0 = vcombine_s16(shiftop(sum_l, s), shiftop(sum_h, s)); \
+      out1 = vcombine_s16(shiftop(dif_l, s), shiftop(dif_h, s)); \
+   }
+
+#define dct_pass(shiftop, shift) \
+   { \
+      /* even part */ \
+      int16x8_t sum26 = vaddq_s16(row2, row6); \
       dct_long_mul(p1e, sum26, rot0_0); \
       dct_long_mac(t2e, p1e, row6, rot0_1); \
       dct_long_mac(t3e, p1e, row2, rot0_2); \
@@ -2912,6 +4124,75 @@ static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
 
 #endif // STBI_NEON
 
+// reduced IDCTs for scaled decoding. each output pixel is the mean of the
+// full IDCT over its (8/N)x(8/N) pixel group, which folds the 8 basis
+// functions into an N x 8 matrix: C(u) times the mean of cos((2x+1)u*pi/16)
+// over the group, in 12-bit fixed point. output N-1-n is output n with the
+// odd terms negated, so only the first N/2 rows are stored
+static const int stbi__idct_fold4[2][8] = {
+   { 2896, 3711,  2676,  1303, 0, -871, -1108, -738 },
+   { 2896, 1537, -2676, -3146, 0, 2102,  1108, -306 },
+};
+static const int stbi__idct_fold2[1][8] = {
+   { 2896, 2624,     0,  -922, 0,  616,     0, -522 },
+};
+
+static void stbi__idct_reduced(stbi_uc *out, int out_stride, short data[64], const int (*m)[8], int n)
+{
+   int i,j,k,val[4*8];
+
+   // columns; keep 2 extra bits of precision like stbi__idct_block
+   for (j=0; j < 8; ++j) {
+      short *d = data + j;
+      if (d[ 8]==0 && d[16]==0 && d[24]==0 && d[32]==0 && d[40]==0 && d[48]==0 && d[56]==0) {
+         // no vertical frequencies: the column is flat
+         int dcterm = (d[0] * m[0][0] + 512) >> 10;
+         for (i=0; i < n; ++i) val[i*8+j] = dcterm;
+         continue;
+      }
+      for (i=0; i < n/2; ++i) {
+         int e = 0, o = 0;
+         for (k=0; k < 8; k += 2) e += d[k*8] * m[i][k];
+         for (k=1; k < 8; k += 2) o += d[k*8] * m[i][k];
+         val[i*8+j]       = (e + o + 512) >> 10;
+         val[(n-1-i)*8+j] = (e - o + 512) >> 10;
+      }
+   }
+
+   // rows; the final shift removes both passes' scale and the 2D 1/4,
+   // with rounding and the +128 bias folded into the even part
+   for (j=0; j < n; ++j, out += out_stride) {
+      int *v = val + j*8;
+      for (i=0; i < n/2; ++i) {
+         int e = 65536*128 + 32768, o = 0;
+         for (k=0; k < 8; k += 2) e += v[k] * m[i][k];
+         for (k=1; k < 8; k += 2) o += v[k] * m[i][k];
+         out[i]     = stbi__clamp((e + o) >> 16);
+         out[n-1-i] = stbi__clamp((e - o) >> 16);
+      }
+   }
+}
+
+// 1/2 scale
+static void stbi__idct_4x4(stbi_uc *out, int out_stride, short data[64])
+{
+   stbi__idct_reduced(out, out_stride, data, stbi__idct_fold4, 4);
+}
+
+// 1/4 scale
+static void stbi__idct_2x2(stbi_uc *out, int out_stride, short data[64])
+{
+   stbi__idct_reduced(out, out_stride, data, stbi__idct_fold2, 2);
+}
+
+// 1/8 scale: only the DC term survives the averaging, so there's nothing to
+// transform; (dc+4)>>3 is exactly what the full IDCT gives a flat block
+static void stbi__idct_1x1(stbi_uc *out, int out_stride, short data[64])
+{
+   STBI_NOTUSED(out_stride);
+   out[0] = stbi__clamp(((data[0] + 4) >> 3) + 128);
+}
+
 #define STBI__MARKER_none  0xff
 // if there's a pending marker from the entropy stream, return that
 // otherwise, fetch from the stream and get a marker. if there's no
@@ -2946,67 +4227,262 @@ static void stbi__jpeg_reset(stbi__jpeg *j)
    // since we don't even allow 1<<30 pixels
 }
 
-static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
+// MCUs across and down in the current scan. a non-interleaved scan codes
+// one block per MCU, and only as many blocks as this component has actual
+// "pixels", independent of interleaved MCU blocking and such
+static void stbi__jpeg_scan_mcus(stbi__jpeg *z, int *w, int *h)
 {
-   stbi__jpeg_reset(z);
-   if (!z->progressive) {
-      if (z->scan_n == 1) {
-         int i,j;
-         STBI_SIMD_ALIGN(short, data[64]);
-         int n = z->order[0];
-         // non-interleaved data, we just need to process one block at a time,
-         // in trivial scanline order
-         // number of blocks to do just depends on how many actual "pixels" this
-         // component has, independent of interleaved MCU blocking and such
-         int w = (z->img_comp[n].x+7) >> 3;
-         int h = (z->img_comp[n].y+7) >> 3;
-         for (j=0; j < h; ++j) {
-            for (i=0; i < w; ++i) {
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      *w = (z->img_comp[n].x+7) >> 3;
+      *h = (z->img_comp[n].y+7) >> 3;
+   } else {
+      *w = z->img_mcu_x;
+      *h = z->img_mcu_y;
+   }
+}
+
+// decode and transform the baseline MCU at column i, row j of the scan
+stbi_inline static int stbi__jpeg_decode_mcu(stbi__jpeg *z, int i, int j, short data[64])
+{
+   int bs = 8 >> z->scale_log2; // output pixels per block side
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      int ha = z->img_comp[n].ha;
+      if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], z->fast_dc[z->img_comp[n].hd], n, z->dequant[z->img_comp[n].tq])) return 0;
+      z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*bs+i*bs, z->img_comp[n].w2, data);
+   } else {
+      int k,x,y;
+      // scan an interleaved mcu... process scan_n components in order
+      for (k=0; k < z->scan_n; ++k) {
+         int n = z->order[k];
+         // scan out an mcu's worth of this component; that's just determined
+         // by the basic H and V specified for the component
+         for (y=0; y < z->img_comp[n].v; ++y) {
+            for (x=0; x < z->img_comp[n].h; ++x) {
+               int x2 = (i*z->img_comp[n].h + x)*bs;
+               int y2 = (j*z->img_comp[n].v + y)*bs;
                int ha = z->img_comp[n].ha;
-               if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
-               // every data block is an MCU, so countdown the restart interval
-               if (--z->todo <= 0) {
-                  if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
-                  // if it's NOT a restart, then just bail, so we get corrupt data
-                  // rather than no data
-                  if (!STBI__RESTART(z->marker)) return 1;
-                  stbi__jpeg_reset(z);
-               }
+               if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], z->fast_dc[z->img_comp[n].hd], n, z->dequant[z->img_comp[n].tq])) return 0;
+               if (n == 0 || !z->luma_only)
+                  z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
             }
          }
-         return 1;
-      } else { // interleaved
-         int i,j,k,x,y;
-         STBI_SIMD_ALIGN(short, data[64]);
-         for (j=0; j < z->img_mcu_y; ++j) {
-            for (i=0; i < z->img_mcu_x; ++i) {
-               // scan an interleaved mcu... process scan_n components in order
-               for (k=0; k < z->scan_n; ++k) {
-                  int n = z->order[k];
-                  // scan out an mcu's worth of this component; that's just determined
-                  // by the basic H and V specified for the component
-                  for (y=0; y < z->img_comp[n].v; ++y) {
-                     for (x=0; x < z->img_comp[n].h; ++x) {
-                        int x2 = (i*z->img_comp[n].h + x)*8;
-                        int y2 = (j*z->img_comp[n].v + y)*8;
-                        int ha = z->img_comp[n].ha;
-                        if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-                        z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
-                     }
-                  }
-               }
-               // after all interleaved components, that's an interleaved MCU,
-               // so now count down the restart interval
-               if (--z->todo <= 0) {
-                  if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
-                  if (!STBI__RESTART(z->marker)) return 1;
-                  stbi__jpeg_reset(z);
-               }
+      }
+   }
+   return 1;
+}
+
+#ifdef STBI_JPEG_THREADS
+// restart intervals are coded independently (the entropy coder and the DC
+// predictions reset at each RSTn marker) and cover disjoint MCUs, so a
+// baseline scan can be cut at its markers and the pieces decoded at once,
+// each straight into the component planes.
+
+typedef struct
+{
+   stbi__jpeg *z;
+   stbi_uc **seg, **seg_end;  // entropy-coded bytes of each restart interval
+   int first, last;           // intervals [first,last) for this thread
+   int mcu_w, mcu_total;
+   int ok;
+} stbi__jpeg_rst_job;
+
+static void *stbi__jpeg_rst_worker(void *arg)
+{
+   stbi__jpeg_rst_job *job = (stbi__jpeg_rst_job *) arg;
+   stbi__jpeg *z = job->z;
+   stbi__jpeg *j;
+   stbi__context s;
+   int k, m;
+   STBI_SIMD_ALIGN(short, data[64]);
+
+   job->ok = 0;
+   // private copy of the decoder for its bit buffer and DC predictions;
+   // tables and planes are shared, read-only and disjoint respectively
+   j = (stbi__jpeg *) stbi__malloc(sizeof(stbi__jpeg));
+   if (!j) return NULL;
+   memcpy(j, z, sizeof(stbi__jpeg));
+   s = *z->s;
+   s.io.read = NULL;
+   s.read_from_callbacks = 0;
+   j->s = &s;
+
+   for (k=job->first; k < job->last; ++k) {
+      int end = (k+1) * z->restart_interval;
+      if (end > job->mcu_total) end = job->mcu_total;
+      stbi__jpeg_reset(j);
+      // the interval ends where its marker starts; the bit reader then pads
+      // with zeros just as it does after seeing the marker
+      s.img_buffer = job->seg[k];
+      s.img_buffer_end = job->seg_end[k];
+      for (m = k * z->restart_interval; m < end; ++m)
+         if (!stbi__jpeg_decode_mcu(j, m % job->mcu_w, m / job->mcu_w, data)) { STBI_FREE(j); return NULL; }
+   }
+   STBI_FREE(j);
+   job->ok = 1;
+   return NULL;
+}
+
+static int stbi__jpeg_thread_count(void)
+{
+   int n = stbi__jpeg_threads_global;
+   if (n <= 0) {
+      long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      n = cpus > 0 ? (cpus < 64 ? (int) cpus : 64) : 1;
+   }
+   return n;
+}
+
+// for a threaded decode the whole scan has to be in memory; a callback
+// stream is read to the end once and the context switched over to that copy
+static int stbi__jpeg_buffer_stream(stbi__jpeg *z)
+{
+   stbi__context *s = z->s;
+   int have = (int) (s->img_buffer_end - s->img_buffer);
+   int cap = have + (1 << 20);
+   stbi_uc *buf = (stbi_uc *) stbi__malloc(cap);
+   if (!buf) return 0;
+   memcpy(buf, s->img_buffer, have);
+   for (;;) {
+      int n;
+      if (cap - have < (1 << 16)) {
+         stbi_uc *p;
+         if (cap > INT_MAX / 2) { STBI_FREE(buf); return 0; }
+         p = (stbi_uc *) STBI_REALLOC_SIZED(buf, cap, cap*2);
+         if (!p) { STBI_FREE(buf); return 0; }
+         buf = p;
+         cap *= 2;
+      }
+      n = (s->io.read)(s->io_user_data, (char *) buf + have, cap - have);
+      if (n <= 0) break;
+      have += n;
+   }
+   s->callback_already_read += (int) (s->img_buffer_end - s->img_buffer_original);
+   s->img_buffer = s->img_buffer_original = buf;
+   s->img_buffer_end = s->img_buffer_original_end = buf + have;
+   s->read_from_callbacks = 0;
+   s->io.read = NULL;
+   z->stream_copy = buf;
+   return 1;
+}
+
+// find the restart markers of the scan starting at p. returns the number of
+// intervals found, or 0 if it isn't the expected count; *scan_end is where
+// the marker that ends the scan starts (or the end of the data)
+static int stbi__jpeg_find_restarts(stbi_uc *p, stbi_uc *end, stbi_uc **seg, stbi_uc **seg_end, int nseg, stbi_uc **scan_end)
+{
+   int k = 0;
+   seg[0] = p;
+   while (p < end) {
+      stbi_uc *q;
+      p = (stbi_uc *) memchr(p, 0xff, end - p);
+      if (!p) { p = end; break; }
+      q = p+1;
+      while (q < end && *q == 0xff) ++q; // fill bytes
+      if (q == end) break;
+      if (*q == 0) { p = q+1; continue; } // stuffed zero
+      if (!STBI__RESTART(*q)) break; // any other marker ends the scan
+      if (++k == nseg) return 0;
+      seg_end[k-1] = p;
+      seg[k] = p = q+1;
+   }
+   seg_end[k] = p;
+   *scan_end = p;
+   return k+1 == nseg ? nseg : 0;
+}
+
+// returns 1 if the scan was decoded on threads, or 0 if it should be decoded
+// serially (not worth it, not splittable, or an interval failed to decode;
+// the serial decode then reproduces whatever the single-threaded path does)
+static int stbi__jpeg_decode_threaded(stbi__jpeg *z, int mcu_w, int mcu_h)
+{
+   stbi__jpeg_rst_job jobs[64];
+   pthread_t tid[64];
+   int started[64];
+   stbi_uc **seg, *scan_end;
+   int total = mcu_w * mcu_h, nseg, threads, t, ok = 1;
+
+   if (!z->restart_interval) return 0;
+   if ((double) z->s->img_x * z->s->img_y < STBI_JPEG_THREADS_MIN_PIXELS) return 0;
+   nseg = (total + z->restart_interval - 1) / z->restart_interval;
+   threads = stbi__jpeg_thread_count();
+   if (threads > nseg) threads = nseg;
+   if (threads > 64) threads = 64;
+   if (threads < 2) return 0;
+
+   if (z->s->io.read) {
+      // a callback stream that already hit its end has only the buffered
+      // tail left, which is no scan worth splitting
+      if (!z->s->read_from_callbacks) return 0;
+      if (!stbi__jpeg_buffer_stream(z)) return 0;
+   }
+
+   seg = (stbi_uc **) stbi__malloc_mad2(nseg, 2*sizeof(stbi_uc *), 0);
+   if (!seg) return 0;
+   if (!stbi__jpeg_find_restarts(z->s->img_buffer, z->s->img_buffer_end, seg, seg+nseg, nseg, &scan_end)) {
+      STBI_FREE(seg);
+      return 0;
+   }
+
+   for (t=0; t < threads; ++t) {
+      jobs[t].z = z;
+      jobs[t].seg = seg;
+      jobs[t].seg_end = seg+nseg;
+      jobs[t].first = (int) ((stbi__uint64) nseg * t / threads);
+      jobs[t].last  = (int) ((stbi__uint64) nseg * (t+1) / threads);
+      jobs[t].mcu_w = mcu_w;
+      jobs[t].mcu_total = total;
+   }
+   // the calling thread takes the first share; a thread that can't be
+   // started has its share done here too
+   for (t=1; t < threads; ++t)
+      started[t] = pthread_create(&tid[t], NULL, stbi__jpeg_rst_worker, &jobs[t]) == 0;
+   stbi__jpeg_rst_worker(&jobs[0]);
+   for (t=1; t < threads; ++t) {
+      if (started[t])
+         pthread_join(tid[t], NULL);
+      else
+         stbi__jpeg_rst_worker(&jobs[t]);
+   }
+   for (t=0; t < threads; ++t)
+      ok &= jobs[t].ok;
+   STBI_FREE(seg);
+   if (!ok) return 0;
+
+   // leave the stream at the marker after the scan, as the serial decode
+   // would have
+   z->s->img_buffer = scan_end;
+   z->marker = STBI__MARKER_none;
+   return 1;
+}
+#endif // STBI_JPEG_THREADS
+
+static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
+{
+   stbi__jpeg_reset(z);
+   if (!z->progressive) {
+      int i,j,w,h;
+      STBI_SIMD_ALIGN(short, data[64]);
+      stbi__jpeg_scan_mcus(z, &w, &h);
+#ifdef STBI_JPEG_THREADS
+      if (stbi__jpeg_decode_threaded(z, w, h)) return 1;
+#endif
+      for (j=0; j < h; ++j) {
+         for (i=0; i < w; ++i) {
+            if (!stbi__jpeg_decode_mcu(z, i, j, data)) return 0;
+            // count down the restart interval; in a non-interleaved scan
+            // every data block is an MCU
+            if (--z->todo <= 0) {
+               if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
+               // if it's NOT a restart, then just bail, so we get corrupt data
+               // rather than no data
+               if (!STBI__RESTART(z->marker)) return 1;
+               stbi__jpeg_reset(z);
             }
          }
-         return 1;
       }
+      return 1;
    } else {
       if (z->scan_n == 1) {
          int i,j;
@@ -3082,20 +4558,81 @@ static void stbi__jpeg_finish(stbi__jpeg *z)
    if (z->progressive) {
       // dequantize and idct the data
       int i,j,n;
-      for (n=0; n < z->s->img_n; ++n) {
+      int bs = 8 >> z->scale_log2;
+      for (n=0; n < (z->luma_only ? 1 : z->s->img_n); ++n) {
          int w = (z->img_comp[n].x+7) >> 3;
          int h = (z->img_comp[n].y+7) >> 3;
          for (j=0; j < h; ++j) {
             for (i=0; i < w; ++i) {
                short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
                stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*bs+i*bs, z->img_comp[n].w2, data);
             }
          }
       }
    }
 }
 
+static void stbi__jpeg_clear_huffman(stbi__jpeg *z, int t)
+{
+   int th = t & 3;
+   if (t < 4) {
+      memset(z->huff_dc + th, 0, sizeof(z->huff_dc[0]));
+      memset(z->fast_dc[th], 0, sizeof(z->fast_dc[0]));
+   } else {
+      memset(z->huff_ac + th, 0, sizeof(z->huff_ac[0]));
+      memset(z->fast_ac[th], 0, sizeof(z->fast_ac[0]));
+   }
+   z->huff_clean &= ~(1 << t);
+   z->huff_dirty &= ~(1 << t);
+}
+
+// tables left over from an earlier image are all zeros to this one until
+// it defines them, as they would be in a new decoder
+static void stbi__jpeg_clear_stale_huffman(stbi__jpeg *z)
+{
+   int t;
+   for (t=0; t < 8; ++t)
+      if ((z->huff_dirty & ~z->huff_defined) & (1 << t))
+         stbi__jpeg_clear_huffman(z, t);
+}
+
+// builds huffman table th of class tc (0 = DC, 1 = AC) and its fast table.
+// the first definition in an image goes over zeros; if the table kept from
+// the last image was built that way from the same counts and values, it is
+// that table already and is used as is
+static int stbi__jpeg_define_huffman(stbi__jpeg *z, int tc, int th, int *sizes, stbi_uc *v, int n)
+{
+   stbi__huffman *h = tc ? z->huff_ac + th : z->huff_dc + th;
+   stbi_uc *key = z->huff_key[tc*4 + th];
+   int i, t = tc*4 + th, first = !(z->huff_defined & (1 << t));
+
+   z->huff_defined |= 1 << t;
+   if (first) {
+      if (z->huff_clean & (1 << t)) {
+         for (i=0; i < 16; ++i)
+            if (key[i] != sizes[i])
+               break;
+         if (i == 16 && memcmp(key+16, v, n) == 0)
+            return 1;
+      }
+      if (z->huff_dirty & (1 << t))
+         stbi__jpeg_clear_huffman(z, t);
+   }
+   z->huff_clean &= ~(1 << t);
+   z->huff_dirty |= 1 << t;
+   if (!stbi__build_huffman(h, sizes)) return 0;
+   memcpy(h->values, v, n);
+   stbi__build_fast_ac(tc ? z->fast_ac[th] : z->fast_dc[th], h);
+   if (first) {
+      for (i=0; i < 16; ++i)
+         key[i] = (stbi_uc) sizes[i];
+      memcpy(key+16, v, n);
+      z->huff_clean |= 1 << t;
+   }
+   return 1;
+}
+
 static int stbi__process_marker(stbi__jpeg *z, int m)
 {
    int L;
@@ -3126,7 +4663,7 @@ static int stbi__process_marker(stbi__jpeg *z, int m)
       case 0xC4: // DHT - define huffman table
          L = stbi__get16be(z->s)-2;
          while (L > 0) {
-            stbi_uc *v;
+            stbi_uc v[256];
             int sizes[16],i,n=0;
             int q = stbi__get8(z->s);
             int tc = q >> 4;
@@ -3138,17 +4675,9 @@ static int stbi__process_marker(stbi__jpeg *z, int m)
             }
             if(n > 256) return stbi__err("bad DHT header","Corrupt JPEG"); // Loop over i < n would write past end of values!
             L -= 17;
-            if (tc == 0) {
-               if (!stbi__build_huffman(z->huff_dc+th, sizes)) return 0;
-               v = z->huff_dc[th].values;
-            } else {
-               if (!stbi__build_huffman(z->huff_ac+th, sizes)) return 0;
-               v = z->huff_ac[th].values;
-            }
             for (i=0; i < n; ++i)
                v[i] = stbi__get8(z->s);
-            if (tc != 0)
-               stbi__build_fast_ac(z->fast_ac[th], z->huff_ac + th);
+            if (!stbi__jpeg_define_huffman(z, tc, th, sizes, v, n)) return 0;
             L -= n;
          }
          return L==0;
@@ -3204,6 +4733,7 @@ static int stbi__process_scan_header(stbi__jpeg *z)
 {
    int i;
    int Ls = stbi__get16be(z->s);
+   stbi__jpeg_clear_stale_huffman(z);
    z->scan_n = stbi__get8(z->s);
    if (z->scan_n < 1 || z->scan_n > 4 || z->scan_n > (int) z->s->img_n) return stbi__err("bad SOS component count","Corrupt JPEG");
    if (Ls != 6+2*z->scan_n) return stbi__err("bad SOS len","Corrupt JPEG");
@@ -3244,26 +4774,51 @@ static int stbi__free_jpeg_components(stbi__jpeg *z, int ncomp, int why)
    int i;
    for (i=0; i < ncomp; ++i) {
       if (z->img_comp[i].raw_data) {
-         STBI_FREE(z->img_comp[i].raw_data);
+         stbi__keep_free(z->s, STBI__KEEP_jpeg_plane+i, z->img_comp[i].raw_data);
          z->img_comp[i].raw_data = NULL;
          z->img_comp[i].data = NULL;
       }
       if (z->img_comp[i].raw_coeff) {
-         STBI_FREE(z->img_comp[i].raw_coeff);
+         stbi__keep_free(z->s, STBI__KEEP_jpeg_coeff+i, z->img_comp[i].raw_coeff);
          z->img_comp[i].raw_coeff = 0;
          z->img_comp[i].coeff = 0;
       }
       if (z->img_comp[i].linebuf) {
-         STBI_FREE(z->img_comp[i].linebuf);
+         stbi__keep_free(z->s, STBI__KEEP_jpeg_line+i, z->img_comp[i].linebuf);
          z->img_comp[i].linebuf = NULL;
       }
    }
    return why;
 }
 
-static int stbi__process_frame_header(stbi__jpeg *z, int scan)
+// allocates planes of mcu_rows MCU rows for the components
+static int stbi__jpeg_alloc_planes(stbi__jpeg *z, int mcu_rows)
 {
-   stbi__context *s = z->s;
+   int i;
+   for (i=0; i < z->s->img_n; ++i) {
+      z->img_comp[i].h2 = (mcu_rows * z->img_comp[i].v * 8) >> z->scale_log2;
+      z->img_comp[i].raw_data = stbi__keep_malloc(z->s, STBI__KEEP_jpeg_plane+i, z->img_comp[i].w2, z->img_comp[i].h2, 1, 15);
+      if (z->img_comp[i].raw_data == NULL)
+         return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
+      // align blocks for idct using mmx/sse
+      z->img_comp[i].data = (stbi_uc*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
+      if (z->progressive) {
+         // one 64-coefficient block per 8x8 pixels, whatever the output scale
+         z->img_comp[i].coeff_w = z->img_mcu_x * z->img_comp[i].h;
+         z->img_comp[i].coeff_h = z->img_mcu_y * z->img_comp[i].v;
+         z->img_comp[i].raw_coeff = stbi__keep_malloc(z->s, STBI__KEEP_jpeg_coeff+i, z->img_comp[i].coeff_w * 64, z->img_comp[i].coeff_h, sizeof(short), 15);
+         if (z->img_comp[i].raw_coeff == NULL)
+            return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
+         z->img_comp[i].coeff = (short*) (((size_t) z->img_comp[i].raw_coeff + 15) & ~15);
+      }
+   }
+
+   return 1;
+}
+
+static int stbi__process_frame_header(stbi__jpeg *z, int scan)
+{
+   stbi__context *s = z->s;
    int Lf,p,i,q, h_max=1,v_max=1,c;
    Lf = stbi__get16be(s);         if (Lf < 11) return stbi__err("bad SOF len","Corrupt JPEG"); // JPEG
    p  = stbi__get8(s);            if (p != 8) return stbi__err("only 8-bit","JPEG format not supported: 8-bit only"); // JPEG baseline
@@ -3329,28 +4884,17 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       //
       // img_mcu_x, img_mcu_y: <=17 bits; comp[i].h and .v are <=4 (checked earlier)
       // so these muls can't overflow with 32-bit ints (which we require)
-      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
-      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
+      // scaled decodes store (8 >> scale_log2) pixels per block side
+      z->img_comp[i].w2 = (z->img_mcu_x * z->img_comp[i].h * 8) >> z->scale_log2;
       z->img_comp[i].coeff = 0;
       z->img_comp[i].raw_coeff = 0;
       z->img_comp[i].linebuf = NULL;
-      z->img_comp[i].raw_data = stbi__malloc_mad2(z->img_comp[i].w2, z->img_comp[i].h2, 15);
-      if (z->img_comp[i].raw_data == NULL)
-         return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
-      // align blocks for idct using mmx/sse
-      z->img_comp[i].data = (stbi_uc*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
-      if (z->progressive) {
-         // w2, h2 are multiples of 8 (see above)
-         z->img_comp[i].coeff_w = z->img_comp[i].w2 / 8;
-         z->img_comp[i].coeff_h = z->img_comp[i].h2 / 8;
-         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].w2, z->img_comp[i].h2, sizeof(short), 15);
-         if (z->img_comp[i].raw_coeff == NULL)
-            return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
-         z->img_comp[i].coeff = (short*) (((size_t) z->img_comp[i].raw_coeff + 15) & ~15);
-      }
    }
 
-   return 1;
+   // a baseline image decoded for stbi_load_rows may only need a few MCU
+   // rows of planes; that is up to its first scan
+   if (z->rows && !z->progressive) return 1;
+   return stbi__jpeg_alloc_planes(z, z->img_mcu_y);
 }
 
 // use comparisons since in some cases we handle more than one case (e.g. SOF)
@@ -3408,10 +4952,23 @@ static stbi_uc stbi__skip_jpeg_junk_at_end(stbi__jpeg *j)
    return STBI__MARKER_none;
 }
 
+// true if nothing the current scan decodes would be used: the AC scans of a
+// progressive DC-only decode, a chroma-only scan of a luma-only decode, or
+// any scan after the image was streamed out
+static int stbi__jpeg_scan_unused(stbi__jpeg *j)
+{
+   if (j->rows_streamed) return 1;
+   if (j->progressive && j->spec_start != 0 && j->scale_log2 == 3) return 1;
+   if (j->luma_only && j->scan_n == 1 && j->order[0] != 0) return 1;
+   return 0;
+}
+
+static int stbi__jpeg_stream_rows(stbi__jpeg *z);
+
 // decode image to YCbCr format
 static int stbi__decode_jpeg_image(stbi__jpeg *j)
 {
-   int m;
+   int m, first_scan = 1;
    for (m = 0; m < 4; m++) {
       j->img_comp[m].raw_data = NULL;
       j->img_comp[m].raw_coeff = NULL;
@@ -3422,7 +4979,27 @@ static int stbi__decode_jpeg_image(stbi__jpeg *j)
    while (!stbi__EOI(m)) {
       if (stbi__SOS(m)) {
          if (!stbi__process_scan_header(j)) return 0;
-         if (!stbi__parse_entropy_coded_data(j)) return 0;
+         if (first_scan) {
+            // the markers that pick the color transform precede the first
+            // scan; grey output needs only Y unless the planes are R,G,B/CMYK
+            if (j->s->img_n != 3 || j->rgb == 3 || (j->app14_color_transform == 0 && !j->jfif))
+               j->luma_only = 0;
+            first_scan = 0;
+         }
+         if (j->rows && !j->progressive && !j->img_comp[0].raw_data && j->scan_n == j->s->img_n) {
+            // the whole image is in this scan, so it can go to the row
+            // consumer an MCU row at a time
+            if (!stbi__jpeg_stream_rows(j)) return 0;
+         } else if (stbi__jpeg_scan_unused(j)) {
+            // skip the whole scan (restart markers included) without
+            // entropy decoding it
+            do {
+               j->marker = stbi__skip_jpeg_junk_at_end(j);
+            } while (STBI__RESTART(j->marker));
+         } else {
+            if (!j->img_comp[0].raw_data && !stbi__jpeg_alloc_planes(j, j->img_mcu_y)) return 0;
+            if (!stbi__parse_entropy_coded_data(j)) return 0;
+         }
          if (j->marker == STBI__MARKER_none ) {
          j->marker = stbi__skip_jpeg_junk_at_end(j);
             // if we reach eof without hitting a marker, stbi__get_marker() below will fail and we'll eventually return 0
@@ -3643,6 +5220,74 @@ static stbi_uc *stbi__resample_row_hv_2_simd(stbi_uc *out, stbi_uc *in_near, stb
 }
 #endif
 
+#ifdef STBI_AVX2
+// same filter as stbi__resample_row_hv_2_simd, 16 input pixels at a time
+static STBI__AVX2_TARGET stbi_uc *stbi__resample_row_hv_2_avx2(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
+{
+   int i=0,t0,t1;
+
+   if (w == 1) {
+      out[0] = out[1] = stbi__div4(3*in_near[0] + in_far[0] + 2);
+      return out;
+   }
+
+   t1 = 3*in_near[0] + in_far[0];
+   for (; i < ((w-1) & ~15); i += 16) {
+      // vertical pass: 3*near + far
+      __m256i farw  = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_far + i)));
+      __m256i nearw = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_near + i)));
+      __m256i diff  = _mm256_sub_epi16(farw, nearw);
+      __m256i nears = _mm256_slli_epi16(nearw, 2);
+      __m256i curr  = _mm256_add_epi16(nears, diff); // current row
+
+      // "prev"/"next" are the current row shifted by one pixel across the
+      // full 256 bits; alignr only shifts within 128-bit lanes, so the
+      // neighbouring lane is brought in with a cross-lane permute first.
+      __m256i prv0 = _mm256_alignr_epi8(curr, _mm256_permute2x128_si256(curr, curr, 0x08), 14);
+      __m256i nxt0 = _mm256_alignr_epi8(_mm256_permute2x128_si256(curr, curr, 0x81), curr, 2);
+      __m256i prev = _mm256_insert_epi16(prv0, t1, 0);
+      __m256i next = _mm256_insert_epi16(nxt0, 3*in_near[i+16] + in_far[i+16], 15);
+
+      // horizontal filter, polyphase as in the sse2 version
+      __m256i bias = _mm256_set1_epi16(8);
+      __m256i curs = _mm256_slli_epi16(curr, 2);
+      __m256i prvd = _mm256_sub_epi16(prev, curr);
+      __m256i nxtd = _mm256_sub_epi16(next, curr);
+      __m256i curb = _mm256_add_epi16(curs, bias);
+      __m256i even = _mm256_add_epi16(prvd, curb);
+      __m256i odd  = _mm256_add_epi16(nxtd, curb);
+
+      // interleave even and odd pixels, then undo scaling. the in-lane
+      // unpacks and pack leave each lane holding 8 consecutive input pixels.
+      __m256i int0 = _mm256_unpacklo_epi16(even, odd);
+      __m256i int1 = _mm256_unpackhi_epi16(even, odd);
+      __m256i de0  = _mm256_srli_epi16(int0, 4);
+      __m256i de1  = _mm256_srli_epi16(int1, 4);
+
+      _mm256_storeu_si256((__m256i *) (out + i*2), _mm256_packus_epi16(de0, de1));
+
+      // "previous" value for next iter
+      t1 = 3*in_near[i+15] + in_far[i+15];
+   }
+
+   t0 = t1;
+   t1 = 3*in_near[i] + in_far[i];
+   out[i*2] = stbi__div16(3*t1 + t0 + 8);
+
+   for (++i; i < w; ++i) {
+      t0 = t1;
+      t1 = 3*in_near[i]+in_far[i];
+      out[i*2-1] = stbi__div16(3*t0 + t1 + 8);
+      out[i*2  ] = stbi__div16(3*t1 + t0 + 8);
+   }
+   out[w*2-1] = stbi__div4(t1+2);
+
+   STBI_NOTUSED(hs);
+
+   return out;
+}
+#endif
+
 static stbi_uc *stbi__resample_row_generic(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
 {
    // resample with nearest-neighbor
@@ -3817,6 +5462,126 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
 }
 #endif
 
+#ifdef STBI_AVX2
+static STBI__AVX2_TARGET void stbi__YCbCr_to_RGB_avx2(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step)
+{
+   int i = 0;
+
+   if (step == 4) {
+      // the sse2 transform on 16 pixels; each 128-bit lane does 8 of them
+      __m256i signflip  = _mm256_set1_epi8(-0x80);
+      __m256i cr_const0 = _mm256_set1_epi16(   (short) ( 1.40200f*4096.0f+0.5f));
+      __m256i cr_const1 = _mm256_set1_epi16( - (short) ( 0.71414f*4096.0f+0.5f));
+      __m256i cb_const0 = _mm256_set1_epi16( - (short) ( 0.34414f*4096.0f+0.5f));
+      __m256i cb_const1 = _mm256_set1_epi16(   (short) ( 1.77200f*4096.0f+0.5f));
+      __m256i y_bias = _mm256_set1_epi16(128);
+      __m256i xw = _mm256_set1_epi16(255); // alpha channel
+
+      for (; i+15 < count; i += 16) {
+         // load and widen; shorts hold (y<<8)|128 and the biased chroma << 8,
+         // exactly what the sse2 byte unpacks produce
+         __m256i y_w  = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (y+i)));
+         __m256i cr_w = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (pcr+i)));
+         __m256i cb_w = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (pcb+i)));
+         __m256i yw  = _mm256_or_si256(_mm256_slli_epi16(y_w, 8), y_bias);
+         __m256i crw = _mm256_slli_epi16(_mm256_xor_si256(cr_w, signflip), 8);
+         __m256i cbw = _mm256_slli_epi16(_mm256_xor_si256(cb_w, signflip), 8);
+
+         // color transform
+         __m256i yws = _mm256_srli_epi16(yw, 4);
+         __m256i cr0 = _mm256_mulhi_epi16(cr_const0, crw);
+         __m256i cb0 = _mm256_mulhi_epi16(cb_const0, cbw);
+         __m256i cb1 = _mm256_mulhi_epi16(cbw, cb_const1);
+         __m256i cr1 = _mm256_mulhi_epi16(crw, cr_const1);
+         __m256i rws = _mm256_add_epi16(cr0, yws);
+         __m256i gwt = _mm256_add_epi16(cb0, yws);
+         __m256i bws = _mm256_add_epi16(yws, cb1);
+         __m256i gws = _mm256_add_epi16(gwt, cr1);
+
+         // descale
+         __m256i rw = _mm256_srai_epi16(rws, 4);
+         __m256i bw = _mm256_srai_epi16(bws, 4);
+         __m256i gw = _mm256_srai_epi16(gws, 4);
+
+         // back to byte, set up for transpose
+         __m256i brb = _mm256_packus_epi16(rw, bw);
+         __m256i gxb = _mm256_packus_epi16(gw, xw);
+
+         // transpose to interleave channels; lane 0 has pixels 0-3 in o0
+         // and 4-7 in o1, lane 1 has pixels 8-11 and 12-15
+         __m256i t0 = _mm256_unpacklo_epi8(brb, gxb);
+         __m256i t1 = _mm256_unpackhi_epi8(brb, gxb);
+         __m256i o0 = _mm256_unpacklo_epi16(t0, t1);
+         __m256i o1 = _mm256_unpackhi_epi16(t0, t1);
+
+         // store
+         _mm256_storeu_si256((__m256i *) (out + 0), _mm256_permute2x128_si256(o0, o1, 0x20));
+         _mm256_storeu_si256((__m256i *) (out + 32), _mm256_permute2x128_si256(o0, o1, 0x31));
+         out += 64;
+      }
+   } else if (step == 3) {
+      // packed rgb: the scalar formula in 32-bit lanes, 8 pixels at a time.
+      // only 24 bytes are stored per step, so nothing past the row is touched.
+      __m256i c_cr0 = _mm256_set1_epi32( stbi__float2fixed(1.40200f));
+      __m256i c_cr1 = _mm256_set1_epi32(-stbi__float2fixed(0.71414f));
+      __m256i c_cb0 = _mm256_set1_epi32(-stbi__float2fixed(0.34414f));
+      __m256i c_cb1 = _mm256_set1_epi32( stbi__float2fixed(1.77200f));
+      __m256i c128  = _mm256_set1_epi32(128);
+      __m256i round = _mm256_set1_epi32(1<<19);
+      __m256i himask = _mm256_set1_epi32((int) 0xffff0000);
+      // per lane: r0-3 g0-3 b0-3 -> r0 g0 b0 r1 g1 b1 ..., last 4 bytes unused
+      __m256i interleave = _mm256_setr_epi8(0,4,8,1,5,9,2,6,10,3,7,11,-1,-1,-1,-1,
+                                            0,4,8,1,5,9,2,6,10,3,7,11,-1,-1,-1,-1);
+      __m256i gather = _mm256_setr_epi32(0,1,2,4,5,6,3,7);
+
+      for (; i+7 < count; i += 8) {
+         __m256i yv = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *) (y+i)));
+         __m256i cr = _mm256_sub_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *) (pcr+i))), c128);
+         __m256i cb = _mm256_sub_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *) (pcb+i))), c128);
+         __m256i y_fixed = _mm256_add_epi32(_mm256_slli_epi32(yv, 20), round);
+         __m256i r = _mm256_add_epi32(y_fixed, _mm256_mullo_epi32(cr, c_cr0));
+         __m256i g = _mm256_add_epi32(_mm256_add_epi32(y_fixed, _mm256_mullo_epi32(cr, c_cr1)),
+                                      _mm256_and_si256(_mm256_mullo_epi32(cb, c_cb0), himask));
+         __m256i b = _mm256_add_epi32(y_fixed, _mm256_mullo_epi32(cb, c_cb1));
+         __m256i rg, bb, px;
+         r = _mm256_srai_epi32(r, 20);
+         g = _mm256_srai_epi32(g, 20);
+         b = _mm256_srai_epi32(b, 20);
+
+         // saturating packs do the clamp to 0..255
+         rg = _mm256_packs_epi32(r, g);
+         bb = _mm256_packs_epi32(b, b);
+         px = _mm256_shuffle_epi8(_mm256_packus_epi16(rg, bb), interleave);
+         px = _mm256_permutevar8x32_epi32(px, gather);
+         _mm_storeu_si128((__m128i *) out, _mm256_castsi256_si128(px));
+         _mm_storel_epi64((__m128i *) (out + 16), _mm256_extracti128_si256(px, 1));
+         out += 24;
+      }
+   }
+
+   for (; i < count; ++i) {
+      int y_fixed = (y[i] << 20) + (1<<19); // rounding
+      int r,g,b;
+      int cr = pcr[i] - 128;
+      int cb = pcb[i] - 128;
+      r = y_fixed + cr* stbi__float2fixed(1.40200f);
+      g = y_fixed + cr*-stbi__float2fixed(0.71414f) + ((cb*-stbi__float2fixed(0.34414f)) & 0xffff0000);
+      b = y_fixed                                   +   cb* stbi__float2fixed(1.77200f);
+      r >>= 20;
+      g >>= 20;
+      b >>= 20;
+      if ((unsigned) r > 255) { if (r < 0) r = 0; else r = 255; }
+      if ((unsigned) g > 255) { if (g < 0) g = 0; else g = 255; }
+      if ((unsigned) b > 255) { if (b < 0) b = 0; else b = 255; }
+      out[0] = (stbi_uc)r;
+      out[1] = (stbi_uc)g;
+      out[2] = (stbi_uc)b;
+      out[3] = 255;
+      out += step;
+   }
+}
+#endif
+
 // set up the kernels
 static void stbi__setup_jpeg(stbi__jpeg *j)
 {
@@ -3832,6 +5597,14 @@ static void stbi__setup_jpeg(stbi__jpeg *j)
    }
 #endif
 
+#ifdef STBI_AVX2
+   if (stbi__avx2_available()) {
+      j->idct_block_kernel = stbi__idct_avx2;
+      j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_avx2;
+      j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_avx2;
+   }
+#endif
+
 #ifdef STBI_NEON
    j->idct_block_kernel = stbi__idct_simd;
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
@@ -3839,10 +5612,35 @@ static void stbi__setup_jpeg(stbi__jpeg *j)
 #endif
 }
 
+// a cleared decoder for s. loading through a decoder context, this is the
+// context's own, which keeps its huffman tables (see stbi__jpeg_define_huffman)
+static stbi__jpeg *stbi__jpeg_new(stbi__context *s)
+{
+   stbi__jpeg *j = (stbi__jpeg *) stbi__keep_reuse(s, STBI__KEEP_jpeg, sizeof(stbi__jpeg));
+   if (j) {
+      memset(j->dequant, 0, (size_t) ((char *) (j+1) - (char *) j->dequant));
+   } else {
+      j = (stbi__jpeg *) stbi__keep_malloc(s, STBI__KEEP_jpeg, (int) sizeof(stbi__jpeg), 1, 1, 0);
+      if (!j) return NULL;
+      memset(j, 0, sizeof(stbi__jpeg));
+   }
+   j->s = s;
+   return j;
+}
+
+static void stbi__jpeg_free(stbi__jpeg *j)
+{
+   stbi__keep_free(j->s, STBI__KEEP_jpeg, j);
+}
+
 // clean up the temporary component buffers
 static void stbi__cleanup_jpeg(stbi__jpeg *j)
 {
    stbi__free_jpeg_components(j, j->s->img_n, 0);
+   // the context may still point into this, but nothing reads through it
+   // once the image is decoded
+   STBI_FREE(j->stream_copy);
+   j->stream_copy = NULL;
 }
 
 typedef struct
@@ -3862,194 +5660,324 @@ static stbi_uc stbi__blinn_8x8(stbi_uc x, stbi_uc y)
    return (stbi_uc) ((t + (t >>8)) >> 8);
 }
 
-static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
+// resampling and color conversion state for producing output rows from the
+// decoded planes
+typedef struct
 {
-   int n, decode_n, is_rgb;
-   z->s->img_n = 0; // make stbi__cleanup_jpeg safe
+   stbi__resample res_comp[4];
+   int n;        // output components
+   int decode_n; // planes used
+   int is_rgb;
+} stbi__jpeg_output;
 
-   // validate req_comp
-   if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
-
-   // load a jpeg image from whichever source, but leave in YCbCr format
-   if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
+static int stbi__jpeg_output_begin(stbi__jpeg *z, stbi__jpeg_output *o, int req_comp)
+{
+   int k;
 
    // determine actual number of components to generate
-   n = req_comp ? req_comp : z->s->img_n >= 3 ? 3 : 1;
+   o->n = req_comp ? req_comp : z->s->img_n >= 3 ? 3 : 1;
+
+   o->is_rgb = z->s->img_n == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
 
-   is_rgb = z->s->img_n == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
+   if (z->luma_only) // chroma planes were never filled in
+      o->is_rgb = 0;
 
-   if (z->s->img_n == 3 && n < 3 && !is_rgb)
-      decode_n = 1;
+   if (z->s->img_n == 3 && o->n < 3 && !o->is_rgb)
+      o->decode_n = 1;
    else
-      decode_n = z->s->img_n;
+      o->decode_n = z->s->img_n;
 
    // nothing to do if no components requested; check this now to avoid
    // accessing uninitialized coutput[0] later
-   if (decode_n <= 0) { stbi__cleanup_jpeg(z); return NULL; }
+   if (o->decode_n <= 0) return 0;
 
-   // resample and color-convert
-   {
-      int k;
-      unsigned int i,j;
-      stbi_uc *output;
-      stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
-
-      stbi__resample res_comp[4];
-
-      for (k=0; k < decode_n; ++k) {
-         stbi__resample *r = &res_comp[k];
-
-         // allocate line buffer big enough for upsampling off the edges
-         // with upsample factor of 4
-         z->img_comp[k].linebuf = (stbi_uc *) stbi__malloc(z->s->img_x + 3);
-         if (!z->img_comp[k].linebuf) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
-
-         r->hs      = z->img_h_max / z->img_comp[k].h;
-         r->vs      = z->img_v_max / z->img_comp[k].v;
-         r->ystep   = r->vs >> 1;
-         r->w_lores = (z->s->img_x + r->hs-1) / r->hs;
-         r->ypos    = 0;
-         r->line0   = r->line1 = z->img_comp[k].data;
-
-         if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
-         else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
-         else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
-         else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
-         else                               r->resample = stbi__resample_row_generic;
-      }
+   for (k=0; k < o->decode_n; ++k) {
+      stbi__resample *r = &o->res_comp[k];
 
-      // can't error after this so, this is safe
-      output = (stbi_uc *) stbi__malloc_mad3(n, z->s->img_x, z->s->img_y, 1);
-      if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
-
-      // now go ahead and resample
-      for (j=0; j < z->s->img_y; ++j) {
-         stbi_uc *out = output + n * z->s->img_x * j;
-         for (k=0; k < decode_n; ++k) {
-            stbi__resample *r = &res_comp[k];
-            int y_bot = r->ystep >= (r->vs >> 1);
-            coutput[k] = r->resample(z->img_comp[k].linebuf,
-                                     y_bot ? r->line1 : r->line0,
-                                     y_bot ? r->line0 : r->line1,
-                                     r->w_lores, r->hs);
-            if (++r->ystep >= r->vs) {
-               r->ystep = 0;
-               r->line0 = r->line1;
-               if (++r->ypos < z->img_comp[k].y)
-                  r->line1 += z->img_comp[k].w2;
-            }
+      // allocate line buffer big enough for upsampling off the edges
+      // with upsample factor of 4
+      z->img_comp[k].linebuf = (stbi_uc *) stbi__keep_malloc(z->s, STBI__KEEP_jpeg_line+k, z->s->img_x, 1, 1, 3);
+      if (!z->img_comp[k].linebuf) return stbi__err("outofmem", "Out of memory");
+
+      r->hs      = z->img_h_max / z->img_comp[k].h;
+      r->vs      = z->img_v_max / z->img_comp[k].v;
+      r->ystep   = r->vs >> 1;
+      r->w_lores = (z->s->img_x + r->hs-1) / r->hs;
+      r->ypos    = 0;
+      r->line0   = r->line1 = z->img_comp[k].data;
+
+      if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
+      else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
+      else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
+      else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
+      else                               r->resample = stbi__resample_row_generic;
+   }
+   return 1;
+}
+
+// resamples and color converts the next output row into out
+static void stbi__jpeg_output_row(stbi__jpeg *z, stbi__jpeg_output *o, stbi_uc *out)
+{
+   int k, n = o->n;
+   unsigned int i;
+   stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
+
+   for (k=0; k < o->decode_n; ++k) {
+      stbi__resample *r = &o->res_comp[k];
+      int y_bot = r->ystep >= (r->vs >> 1);
+      coutput[k] = r->resample(z->img_comp[k].linebuf,
+                               y_bot ? r->line1 : r->line0,
+                               y_bot ? r->line0 : r->line1,
+                               r->w_lores, r->hs);
+      if (++r->ystep >= r->vs) {
+         r->ystep = 0;
+         r->line0 = r->line1;
+         if (++r->ypos < z->img_comp[k].y) {
+            r->line1 += z->img_comp[k].w2;
+            // planes that hold only a few MCU rows wrap around
+            if (r->line1 == z->img_comp[k].data + z->img_comp[k].w2 * z->img_comp[k].h2)
+               r->line1 = z->img_comp[k].data;
          }
-         if (n >= 3) {
-            stbi_uc *y = coutput[0];
-            if (z->s->img_n == 3) {
-               if (is_rgb) {
-                  for (i=0; i < z->s->img_x; ++i) {
-                     out[0] = y[i];
-                     out[1] = coutput[1][i];
-                     out[2] = coutput[2][i];
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else {
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else if (z->s->img_n == 4) {
-               if (z->app14_color_transform == 0) { // CMYK
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(coutput[0][i], m);
-                     out[1] = stbi__blinn_8x8(coutput[1][i], m);
-                     out[2] = stbi__blinn_8x8(coutput[2][i], m);
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else if (z->app14_color_transform == 2) { // YCCK
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(255 - out[0], m);
-                     out[1] = stbi__blinn_8x8(255 - out[1], m);
-                     out[2] = stbi__blinn_8x8(255 - out[2], m);
-                     out += n;
-                  }
-               } else { // YCbCr + alpha?  Ignore the fourth channel for now
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = out[1] = out[2] = y[i];
-                  out[3] = 255; // not used if n==3
-                  out += n;
-               }
+      }
+   }
+   if (n >= 3) {
+      stbi_uc *y = coutput[0];
+      if (z->s->img_n == 3) {
+         if (o->is_rgb) {
+            for (i=0; i < z->s->img_x; ++i) {
+               out[0] = y[i];
+               out[1] = coutput[1][i];
+               out[2] = coutput[2][i];
+               out[3] = 255;
+               out += n;
+            }
          } else {
-            if (is_rgb) {
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i)
-                     *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-               else {
-                  for (i=0; i < z->s->img_x; ++i, out += 2) {
-                     out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-                     out[1] = 255;
-                  }
-               }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
-               for (i=0; i < z->s->img_x; ++i) {
-                  stbi_uc m = coutput[3][i];
-                  stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
-                  stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
-                  stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
-                  out[0] = stbi__compute_y(r, g, b);
-                  out[1] = 255;
-                  out += n;
-               }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
-                  out[1] = 255;
-                  out += n;
-               }
-            } else {
-               stbi_uc *y = coutput[0];
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
-               else
-                  for (i=0; i < z->s->img_x; ++i) { *out++ = y[i]; *out++ = 255; }
+            z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+         }
+      } else if (z->s->img_n == 4) {
+         if (z->app14_color_transform == 0) { // CMYK
+            for (i=0; i < z->s->img_x; ++i) {
+               stbi_uc m = coutput[3][i];
+               out[0] = stbi__blinn_8x8(coutput[0][i], m);
+               out[1] = stbi__blinn_8x8(coutput[1][i], m);
+               out[2] = stbi__blinn_8x8(coutput[2][i], m);
+               out[3] = 255;
+               out += n;
+            }
+         } else if (z->app14_color_transform == 2) { // YCCK
+            z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+            for (i=0; i < z->s->img_x; ++i) {
+               stbi_uc m = coutput[3][i];
+               out[0] = stbi__blinn_8x8(255 - out[0], m);
+               out[1] = stbi__blinn_8x8(255 - out[1], m);
+               out[2] = stbi__blinn_8x8(255 - out[2], m);
+               out += n;
+            }
+         } else { // YCbCr + alpha?  Ignore the fourth channel for now
+            z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+         }
+      } else
+         for (i=0; i < z->s->img_x; ++i) {
+            out[0] = out[1] = out[2] = y[i];
+            out[3] = 255; // not used if n==3
+            out += n;
+         }
+   } else {
+      if (o->is_rgb) {
+         if (n == 1)
+            for (i=0; i < z->s->img_x; ++i)
+               *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+         else {
+            for (i=0; i < z->s->img_x; ++i, out += 2) {
+               out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+               out[1] = 255;
             }
          }
+      } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
+         for (i=0; i < z->s->img_x; ++i) {
+            stbi_uc m = coutput[3][i];
+            stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
+            stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
+            stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
+            out[0] = stbi__compute_y(r, g, b);
+            out[1] = 255;
+            out += n;
+         }
+      } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
+         for (i=0; i < z->s->img_x; ++i) {
+            out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
+            out[1] = 255;
+            out += n;
+         }
+      } else {
+         stbi_uc *y = coutput[0];
+         if (n == 1)
+            for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
+         else
+            for (i=0; i < z->s->img_x; ++i) { *out++ = y[i]; *out++ = 255; }
       }
-      stbi__cleanup_jpeg(z);
-      *out_x = z->s->img_x;
-      *out_y = z->s->img_y;
-      if (comp) *comp = z->s->img_n >= 3 ? 3 : 1; // report original components, not output
-      return output;
    }
 }
 
+static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
+{
+   stbi__jpeg_output o;
+   stbi_uc *output;
+   unsigned int j;
+   z->s->img_n = 0; // make stbi__cleanup_jpeg safe
+
+   // validate req_comp
+   if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
+
+   // grey output from a YCbCr image only needs the Y plane; the decoder
+   // clears this again if the planes turn out not to be YCbCr
+   z->luma_only = (req_comp == 1 || req_comp == 2);
+
+   // load a jpeg image from whichever source, but leave in YCbCr format
+   if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
+
+   if (z->scale_log2) {
+      // the planes were decoded at reduced size, so resample and convert
+      // as if that were the image
+      int k, round = (1 << z->scale_log2) - 1;
+      z->s->img_x = (z->s->img_x + round) >> z->scale_log2;
+      z->s->img_y = (z->s->img_y + round) >> z->scale_log2;
+      for (k=0; k < z->s->img_n; ++k) {
+         z->img_comp[k].x = (z->img_comp[k].x + round) >> z->scale_log2;
+         z->img_comp[k].y = (z->img_comp[k].y + round) >> z->scale_log2;
+      }
+   }
+
+   // resample and color-convert
+   if (!stbi__jpeg_output_begin(z, &o, req_comp)) { stbi__cleanup_jpeg(z); return NULL; }
+
+   // can't error after this so, this is safe
+   output = (stbi_uc *) stbi__malloc_mad3(o.n, z->s->img_x, z->s->img_y, 1);
+   if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
+
+   // now go ahead and resample
+   for (j=0; j < z->s->img_y; ++j)
+      stbi__jpeg_output_row(z, &o, output + o.n * z->s->img_x * j);
+
+   stbi__cleanup_jpeg(z);
+   *out_x = z->s->img_x;
+   *out_y = z->s->img_y;
+   if (comp) *comp = z->s->img_n >= 3 ? 3 : 1; // report original components, not output
+   return output;
+}
+
+// produces the output rows up to y_end (starting at *y) and hands them to
+// the row consumer in batches
+static int stbi__jpeg_output_rows(stbi__jpeg *z, stbi__jpeg_output *o, stbi__uint32 *y, stbi__uint32 y_end)
+{
+   stbi__uint32 x = z->s->img_x;
+   int k, n, batch = stbi__rows_batch(x, o->n);
+   stbi_uc *strip;
+   while (*y < y_end) {
+      n = y_end - *y < (stbi__uint32) batch ? (int) (y_end - *y) : batch;
+      // emitted as is, so the batch can live in the consumer's buffer: the
+      // caller's for stbi_load_into, except with the last row of the image,
+      // as some converters store a byte past the last pixel (the 4th for 3
+      // components, the 2nd for 1). plus one byte in ours for that
+      if (z->rows->dest && *y + n < z->s->img_y)
+         strip = stbi__rows_dest(z->rows, x, n, o->n);
+      else
+         strip = stbi__rows_reserve(z->rows, (size_t) batch * x * o->n + 1);
+      if (strip == NULL) return 0;
+      for (k=0; k < n; ++k, ++*y)
+         stbi__jpeg_output_row(z, o, strip + (size_t) k * x * o->n);
+      if (!stbi__rows_emit(z->rows, strip, x, n, o->n, 0)) return 0;
+   }
+   return 1;
+}
+
+// decodes a baseline scan holding every component into planes of three MCU
+// rows, handing each MCU row's output rows on once the next MCU row (which
+// the upsampling filters reach into) is decoded
+static int stbi__jpeg_stream_rows(stbi__jpeg *z)
+{
+   stbi__jpeg_output o;
+   stbi__uint32 y = 0, rows_per;
+   int i,j,w,h,slots,decoding=1;
+   STBI_SIMD_ALIGN(short, data[64]);
+
+   if (!stbi__jpeg_alloc_planes(z, 3)) return 0;
+   if (!stbi__jpeg_output_begin(z, &o, z->rows->req_comp)) return 0;
+
+   // a single component scan goes by block rows rather than MCU rows
+   stbi__jpeg_scan_mcus(z, &w, &h);
+   slots = z->scan_n == 1 ? 3 * z->img_comp[z->order[0]].v : 3;
+   rows_per = z->scan_n == 1 ? 8 : z->img_mcu_h;
+
+   stbi__jpeg_reset(z);
+   for (j=0; j < h; ++j) {
+      for (i=0; decoding && i < w; ++i) {
+         if (!stbi__jpeg_decode_mcu(z, i, j % slots, data)) return 0;
+         if (--z->todo <= 0) {
+            if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
+            // not a restart: stop decoding, as stbi__parse_entropy_coded_data
+            // does, but still put out every row
+            if (!STBI__RESTART(z->marker)) decoding = 0;
+            else stbi__jpeg_reset(z);
+         }
+      }
+      if (j > 0 && !stbi__jpeg_output_rows(z, &o, &y, j * rows_per)) return 0;
+   }
+   if (!stbi__jpeg_output_rows(z, &o, &y, z->s->img_y)) return 0;
+   z->rows_streamed = 1;
+   return 1;
+}
+
+static int stbi__jpeg_load_rows(stbi__context *s, int *x, int *y, int *comp, stbi__rows *rows)
+{
+   stbi__jpeg_output o;
+   stbi__uint32 row = 0;
+   int ok = 0;
+   stbi__jpeg* j = stbi__jpeg_new(s);
+   if (!j) return stbi__err("outofmem", "Out of memory");
+   j->rows = rows;
+   stbi__setup_jpeg(j);
+   s->img_n = 0; // make stbi__cleanup_jpeg safe
+   j->luma_only = (rows->req_comp == 1 || rows->req_comp == 2);
+   if (stbi__decode_jpeg_image(j)) {
+      if (j->rows_streamed)
+         ok = 1;
+      else if (!j->img_comp[0].raw_data) // no scan was ever decoded
+         ok = stbi__err("no SOS", "Corrupt JPEG");
+      else
+         ok = stbi__jpeg_output_begin(j, &o, rows->req_comp) && stbi__jpeg_output_rows(j, &o, &row, s->img_y);
+   }
+   if (ok) {
+      *x = s->img_x;
+      *y = s->img_y;
+      if (comp) *comp = s->img_n >= 3 ? 3 : 1;
+   }
+   stbi__cleanup_jpeg(j);
+   stbi__jpeg_free(j);
+   return ok;
+}
+
 static void *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
 {
    unsigned char* result;
-   stbi__jpeg* j = (stbi__jpeg*) stbi__malloc(sizeof(stbi__jpeg));
+   stbi__jpeg* j = stbi__jpeg_new(s);
    if (!j) return stbi__errpuc("outofmem", "Out of memory");
-   memset(j, 0, sizeof(stbi__jpeg));
    STBI_NOTUSED(ri);
-   j->s = s;
    stbi__setup_jpeg(j);
    result = load_jpeg_image(j, x,y,comp,req_comp);
-   STBI_FREE(j);
+   stbi__jpeg_free(j);
    return result;
 }
 
 static int stbi__jpeg_test(stbi__context *s)
 {
    int r;
-   stbi__jpeg* j = (stbi__jpeg*)stbi__malloc(sizeof(stbi__jpeg));
+   stbi__jpeg* j = stbi__jpeg_new(s);
    if (!j) return stbi__err("outofmem", "Out of memory");
-   memset(j, 0, sizeof(stbi__jpeg));
-   j->s = s;
    stbi__setup_jpeg(j);
    r = stbi__decode_jpeg_header(j, STBI__SCAN_type);
    stbi__rewind(s);
-   STBI_FREE(j);
+   stbi__jpeg_free(j);
    return r;
 }
 
@@ -4068,15 +5996,158 @@ static int stbi__jpeg_info_raw(stbi__jpeg *j, int *x, int *y, int *comp)
 static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
 {
    int result;
-   stbi__jpeg* j = (stbi__jpeg*) (stbi__malloc(sizeof(stbi__jpeg)));
-   if (!j) return stbi__err("outofmem", "Out of memory");
-   memset(j, 0, sizeof(stbi__jpeg));
-   j->s = s;
-   result = stbi__jpeg_info_raw(j, x, y, comp);
-   STBI_FREE(j);
+   stbi__jpeg* j = stbi__jpeg_new(s);
+   if (!j) return stbi__err("outofmem", "Out of memory");
+   result = stbi__jpeg_info_raw(j, x, y, comp);
+   stbi__jpeg_free(j);
+   return result;
+}
+
+static stbi_uc *stbi__jpeg_load_scaled(stbi__context *s, int *x, int *y, int *comp, int req_comp, int scale_log2)
+{
+   unsigned char* result;
+   int n;
+   stbi__jpeg* j;
+   if (!stbi__jpeg_test(s)) return stbi__errpuc("not JPEG", "Image is not a JPEG");
+   j = stbi__jpeg_new(s);
+   if (!j) return stbi__errpuc("outofmem", "Out of memory");
+   stbi__setup_jpeg(j);
+   j->scale_log2 = scale_log2;
+   if (scale_log2 == 1)
+      j->idct_block_kernel = stbi__idct_4x4;
+   else if (scale_log2 == 2)
+      j->idct_block_kernel = stbi__idct_2x2;
+   else if (scale_log2 == 3)
+      j->idct_block_kernel = stbi__idct_1x1;
+   result = load_jpeg_image(j, x,y,&n,req_comp);
+   stbi__jpeg_free(j);
+   if (comp) *comp = n;
+   if (result && stbi__vertically_flip_on_load)
+      stbi__vertical_flip(result, *x, *y, req_comp ? req_comp : n);
+   return result;
+}
+
+static int stbi__jpeg_scale_log2(int scale)
+{
+   switch (scale) {
+      case 1: return 0;
+      case 2: return 1;
+      case 4: return 2;
+      case 8: return 3;
+      default: return -1;
+   }
+}
+
+STBIDEF stbi_uc *stbi_load_jpeg_dc_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__jpeg_load_scaled(&s,x,y,comp,req_comp,3);
+}
+
+STBIDEF stbi_uc *stbi_load_jpeg_scaled_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, int scale)
+{
+   stbi__context s;
+   int scale_log2 = stbi__jpeg_scale_log2(scale);
+   if (scale_log2 < 0) return stbi__errpuc("bad scale", "JPEG scale must be 1, 2, 4 or 8");
+   stbi__start_mem(&s,buffer,len);
+   return stbi__jpeg_load_scaled(&s,x,y,comp,req_comp,scale_log2);
+}
+
+STBIDEF stbi_uc *stbi_load_jpeg_luma_from_memory(stbi_uc const *buffer, int len, int *x, int *y)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__jpeg_load_scaled(&s,x,y,NULL,1,0);
+}
+
+static int stbi__jpeg_load_luma_into(stbi__context *s, int *x, int *y, stbi_uc *out, size_t out_size)
+{
+   if (!stbi__jpeg_test(s)) return stbi__err("not JPEG", "Image is not a JPEG");
+   return stbi__load_into_main(s,x,y,NULL,1,out,out_size);
+}
+
+STBIDEF int stbi_load_jpeg_luma_into_from_memory(stbi_uc const *buffer, int len, int *x, int *y, stbi_uc *out, size_t out_size)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__jpeg_load_luma_into(&s,x,y,out,out_size);
+}
+
+STBIDEF int stbi_decoder_load_jpeg_luma_into_from_memory(stbi_decoder *dec, stbi_uc const *buffer, int len, int *x, int *y, stbi_uc *out, size_t out_size)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   s.dec = dec;
+   return stbi__jpeg_load_luma_into(&s,x,y,out,out_size);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_jpeg_dc(char const *filename, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   unsigned char *result;
+   FILE *f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+   stbi__start_file(&s,f);
+   result = stbi__jpeg_load_scaled(&s,x,y,comp,req_comp,3);
+   fclose(f);
+   return result;
+}
+
+STBIDEF stbi_uc *stbi_load_jpeg_scaled(char const *filename, int *x, int *y, int *comp, int req_comp, int scale)
+{
+   stbi__context s;
+   unsigned char *result;
+   FILE *f;
+   int scale_log2 = stbi__jpeg_scale_log2(scale);
+   if (scale_log2 < 0) return stbi__errpuc("bad scale", "JPEG scale must be 1, 2, 4 or 8");
+   f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+   stbi__start_file(&s,f);
+   result = stbi__jpeg_load_scaled(&s,x,y,comp,req_comp,scale_log2);
+   fclose(f);
+   return result;
+}
+
+STBIDEF stbi_uc *stbi_load_jpeg_luma(char const *filename, int *x, int *y)
+{
+   stbi__context s;
+   unsigned char *result;
+   FILE *f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+   stbi__start_file(&s,f);
+   result = stbi__jpeg_load_scaled(&s,x,y,NULL,1,0);
+   fclose(f);
+   return result;
+}
+
+STBIDEF int stbi_load_jpeg_luma_into(char const *filename, int *x, int *y, stbi_uc *out, size_t out_size)
+{
+   stbi__context s;
+   int result;
+   FILE *f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__err("can't fopen", "Unable to open file");
+   stbi__start_file(&s,f);
+   result = stbi__jpeg_load_luma_into(&s,x,y,out,out_size);
+   fclose(f);
+   return result;
+}
+
+STBIDEF int stbi_decoder_load_jpeg_luma_into(stbi_decoder *dec, char const *filename, int *x, int *y, stbi_uc *out, size_t out_size)
+{
+   stbi__context s;
+   int result;
+   FILE *f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__err("can't fopen", "Unable to open file");
+   stbi__start_file(&s,f);
+   s.dec = dec;
+   result = stbi__jpeg_load_luma_into(&s,x,y,out,out_size);
+   fclose(f);
    return result;
 }
 #endif
+#endif
 
 // public domain zlib decode    v0.2  Sean Barrett 2006-11-18
 //    simple implementation
@@ -4088,7 +6159,7 @@ static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
 #ifndef STBI_NO_ZLIB
 
 // fast-way is faster to check than jpeg huffman, but slow way is slower
-#define STBI__ZFAST_BITS  9 // accelerate all cases in default tables
+#define STBI__ZFAST_BITS  11 // accelerate all cases in default tables, and most literal pairs
 #define STBI__ZFAST_MASK  ((1 << STBI__ZFAST_BITS) - 1)
 #define STBI__ZNSYMS 288 // number of symbols in literal/length alphabet
 
@@ -4168,30 +6239,42 @@ static int stbi__zbuild_huffman(stbi__zhuffman *z, const stbi_uc *sizelist, int
    return 1;
 }
 
-// zlib-from-memory implementation for PNG reading
-//    because PNG allows splitting the zlib stream arbitrarily,
-//    and it's annoying structurally to have PNG call ZLIB call PNG,
-//    we require PNG read all the IDATs and combine them into a single
-//    memory buffer
+// zlib implementation for PNG reading
+//    the public zlib functions decode from and to memory. PNG instead
+//    streams: z_read is called for more input whenever the buffer runs
+//    out, so the IDAT chunks are inflated as they are read, and z_write
+//    is handed the output before the window slides down, so the output
+//    never has to be held in full
 
-typedef struct
+typedef struct stbi__zbuf stbi__zbuf;
+struct stbi__zbuf
 {
    stbi_uc *zbuffer, *zbuffer_end;
    int num_bits;
    int hit_zeof_once;
-   stbi__uint32 code_buffer;
+   stbi__uint64 code_buffer;
 
    char *zout;
    char *zout_start;
    char *zout_end;
    int   z_expandable;
 
+   // streaming only (NULL otherwise): z_read makes more input available and
+   // returns 0 at the end of it; z_write takes output from z_done on and
+   // returns how many bytes it used, or -1 on error
+   int (*z_read)(void *user, stbi__zbuf *z);
+   int (*z_write)(void *user, stbi_uc *data, int len);
+   void *z_user;
+   char *z_done;
+
    stbi__zhuffman z_length, z_distance;
-} stbi__zbuf;
+   stbi__uint32 lit2[1 << STBI__ZFAST_BITS]; // literal pairs, see stbi__zbuild_lit2
+   int z_fixed; // the three tables above hold the fixed code already
+};
 
 stbi_inline static int stbi__zeof(stbi__zbuf *z)
 {
-   return (z->zbuffer >= z->zbuffer_end);
+   return (z->zbuffer >= z->zbuffer_end) && !(z->z_read && z->z_read(z->z_user, z));
 }
 
 stbi_inline static stbi_uc stbi__zget8(stbi__zbuf *z)
@@ -4199,23 +6282,42 @@ stbi_inline static stbi_uc stbi__zget8(stbi__zbuf *z)
    return stbi__zeof(z) ? 0 : *z->zbuffer++;
 }
 
+// compilers turn this into one load on little-endian targets
+stbi_inline static stbi__uint64 stbi__zget64le(const stbi_uc *p)
+{
+   return (stbi__uint64) p[0]       | ((stbi__uint64) p[1] <<  8) |
+         ((stbi__uint64) p[2] << 16) | ((stbi__uint64) p[3] << 24) |
+         ((stbi__uint64) p[4] << 32) | ((stbi__uint64) p[5] << 40) |
+         ((stbi__uint64) p[6] << 48) | ((stbi__uint64) p[7] << 56);
+}
+
+// tops the bit buffer up to 57..63 bits. bits above num_bits stay zero.
 static void stbi__fill_bits(stbi__zbuf *z)
 {
+   if (z->code_buffer >= ((stbi__uint64) 1 << z->num_bits)) {
+      z->zbuffer = z->zbuffer_end;  /* treat this as EOF so we fail. */
+      z->z_read = NULL;
+      return;
+   }
+   if (z->zbuffer_end - z->zbuffer >= 8) {
+      // as many whole bytes as fit, from a single 8-byte load
+      int bits = (63 - z->num_bits) & ~7;
+      z->code_buffer |= (stbi__zget64le(z->zbuffer) & (((stbi__uint64) 1 << bits) - 1)) << z->num_bits;
+      z->zbuffer += bits >> 3;
+      z->num_bits += bits;
+      return;
+   }
    do {
-      if (z->code_buffer >= (1U << z->num_bits)) {
-        z->zbuffer = z->zbuffer_end;  /* treat this as EOF so we fail. */
-        return;
-      }
-      z->code_buffer |= (unsigned int) stbi__zget8(z) << z->num_bits;
+      z->code_buffer |= (stbi__uint64) stbi__zget8(z) << z->num_bits;
       z->num_bits += 8;
-   } while (z->num_bits <= 24);
+   } while (z->num_bits <= 56);
 }
 
 stbi_inline static unsigned int stbi__zreceive(stbi__zbuf *z, int n)
 {
    unsigned int k;
    if (z->num_bits < n) stbi__fill_bits(z);
-   k = z->code_buffer & ((1 << n) - 1);
+   k = (unsigned int) (z->code_buffer & ((1 << n) - 1));
    z->code_buffer >>= n;
    z->num_bits -= n;
    return k;
@@ -4226,7 +6328,7 @@ static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
    int b,s,k;
    // not resolved by fast table, so compute it the slow way
    // use jpeg approach, which requires MSbits at top
-   k = stbi__bit_reverse(a->code_buffer, 16);
+   k = stbi__bit_reverse((int) (a->code_buffer & 0xffff), 16);
    for (s=STBI__ZFAST_BITS+1; ; ++s)
       if (k < z->maxcode[s])
          break;
@@ -4270,13 +6372,36 @@ stbi_inline static int stbi__zhuffman_decode(stbi__zbuf *a, stbi__zhuffman *z)
    return stbi__zhuffman_decode_slowpath(a, z);
 }
 
+// hands the finished output to z_write, then moves the window down to the
+// 32K of history that matches can still reach, plus whatever z_write left
+static int stbi__zslide(stbi__zbuf *z)
+{
+   char *keep;
+   int used = z->z_write(z->z_user, (stbi_uc *) z->z_done, (int) (z->zout - z->z_done));
+   if (used < 0) return 0;
+   z->z_done += used;
+   keep = z->zout - z->zout_start > 32768 ? z->zout - 32768 : z->zout_start;
+   if (z->z_done < keep) keep = z->z_done;
+   if (keep > z->zout_start) {
+      memmove(z->zout_start, keep, z->zout - keep);
+      z->z_done -= keep - z->zout_start;
+      z->zout   -= keep - z->zout_start;
+   }
+   return 1;
+}
+
 static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room for n bytes
 {
    char *q;
-   unsigned int cur, limit, old_limit;
+   unsigned int cur, limit, old_limit, done;
    z->zout = zout;
+   if (z->z_write) {
+      if (!stbi__zslide(z)) return 0;
+      if (z->zout + n <= z->zout_end) return 1;
+   }
    if (!z->z_expandable) return stbi__err("output buffer limit","Corrupt PNG");
    cur   = (unsigned int) (z->zout - z->zout_start);
+   done  = z->z_write ? (unsigned int) (z->z_done - z->zout_start) : 0;
    limit = old_limit = (unsigned) (z->zout_end - z->zout_start);
    if (UINT_MAX - cur < (unsigned) n) return stbi__err("outofmem", "Out of memory");
    while (cur + n > limit) {
@@ -4289,9 +6414,29 @@ static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room
    z->zout_start = q;
    z->zout       = q + cur;
    z->zout_end   = q + limit;
+   if (z->z_write) z->z_done = q + done;
    return 1;
 }
 
+// for each STBI__ZFAST_BITS of lookahead whose first two codes are both
+// literals and fit in it: the two bytes and their combined code length, so
+// the block decoder can emit both with one lookup. 0 where that doesn't apply
+static void stbi__zbuild_lit2(stbi__uint32 *lit2, const stbi__zhuffman *z)
+{
+   int i;
+   for (i=0; i < (1 << STBI__ZFAST_BITS); ++i) {
+      int b1 = z->fast[i], b2, s1;
+      lit2[i] = 0;
+      if (!b1 || (b1 & 511) >= 256) continue;
+      s1 = b1 >> 9;
+      // fast[] repeats each code over all the bits above it, so the
+      // remaining lookahead picks the second code if it is short enough
+      b2 = z->fast[i >> s1];
+      if (!b2 || (b2 & 511) >= 256 || s1 + (b2 >> 9) > STBI__ZFAST_BITS) continue;
+      lit2[i] = (stbi__uint32) (((s1 + (b2 >> 9)) << 16) | ((b2 & 255) << 8) | (b1 & 255));
+   }
+}
+
 static const int stbi__zlength_base[31] = {
    3,4,5,6,7,8,9,10,11,13,
    15,17,19,23,27,31,35,43,51,59,
@@ -4310,7 +6455,19 @@ static int stbi__parse_huffman_block(stbi__zbuf *a)
 {
    char *zout = a->zout;
    for(;;) {
-      int z = stbi__zhuffman_decode(a, &a->z_length);
+      int z;
+      stbi__uint32 pair;
+      if (a->num_bits < 16 && !stbi__zeof(a)) stbi__fill_bits(a);
+      pair = a->lit2[a->code_buffer & STBI__ZFAST_MASK];
+      if (pair && (int) (pair >> 16) <= a->num_bits && a->zout_end - zout >= 2) {
+         zout[0] = (char) (pair & 255);
+         zout[1] = (char) ((pair >> 8) & 255);
+         zout += 2;
+         a->code_buffer >>= pair >> 16;
+         a->num_bits -= pair >> 16;
+         continue;
+      }
+      z = stbi__zhuffman_decode(a, &a->z_length);
       if (z < 256) {
          if (z < 0) return stbi__err("bad huffman code","Corrupt PNG"); // error in huffman codes
          if (zout >= a->zout_end) {
@@ -4347,8 +6504,19 @@ static int stbi__parse_huffman_block(stbi__zbuf *a)
          }
          p = (stbi_uc *) (zout - dist);
          if (dist == 1) { // run of one byte; common in images.
-            stbi_uc v = *p;
-            if (len) { do *zout++ = v; while (--len); }
+            memset(zout, *p, len);
+            zout += len;
+         } else if (dist >= 8 && a->zout_end - zout >= len + 8) {
+            // 8 bytes per step: with dist >= 8 no step reads what it writes.
+            // the last step may run up to 7 bytes past the match, into room
+            // that the next output overwrites
+            char *end = zout + len;
+            do {
+               memcpy(zout, p, 8);
+               zout += 8;
+               p += 8;
+            } while (zout < end);
+            zout = end;
          } else {
             if (len) { do *zout++ = *p++; while (--len); }
          }
@@ -4408,14 +6576,16 @@ static int stbi__compute_huffman_codes(stbi__zbuf *a)
 
 static int stbi__parse_uncompressed_block(stbi__zbuf *a)
 {
-   stbi_uc header[4];
-   int len,nlen,k;
+   stbi_uc header[4], ahead[8];
+   int len,nlen,k,n=0;
    if (a->num_bits & 7)
       stbi__zreceive(a, a->num_bits & 7); // discard
-   // drain the bit-packed data into header
+   // drain the bit-packed data into header; the bit buffer can hold up to 7
+   // bytes, and any past the header are the start of the stored data
    k = 0;
    while (a->num_bits > 0) {
-      header[k++] = (stbi_uc) (a->code_buffer & 255); // suppress MSVC run-time check
+      stbi_uc b = (stbi_uc) (a->code_buffer & 255); // suppress MSVC run-time check
+      if (k < 4) header[k++] = b; else ahead[n++] = b;
       a->code_buffer >>= 8;
       a->num_bits -= 8;
    }
@@ -4426,12 +6596,31 @@ static int stbi__parse_uncompressed_block(stbi__zbuf *a)
    len  = header[1] * 256 + header[0];
    nlen = header[3] * 256 + header[2];
    if (nlen != (len ^ 0xffff)) return stbi__err("zlib corrupt","Corrupt PNG");
-   if (a->zbuffer + len > a->zbuffer_end) return stbi__err("read past buffer","Corrupt PNG");
+   if (n > len) {
+      // a block shorter than what was read ahead: the rest goes back into
+      // the bit buffer for the next block
+      for (k=n-1; k >= len; --k) {
+         a->code_buffer = (a->code_buffer << 8) | ahead[k];
+         a->num_bits += 8;
+      }
+      n = len;
+   }
+   if (!a->z_read && a->zbuffer + (len - n) > a->zbuffer_end) return stbi__err("read past buffer","Corrupt PNG");
    if (a->zout + len > a->zout_end)
       if (!stbi__zexpand(a, a->zout, len)) return 0;
-   memcpy(a->zout, a->zbuffer, len);
-   a->zbuffer += len;
-   a->zout += len;
+   memcpy(a->zout, ahead, n);
+   a->zout += n;
+   len -= n;
+   // a streamed block can span several input buffers
+   while (len > 0) {
+      if (stbi__zeof(a)) return stbi__err("read past buffer","Corrupt PNG");
+      n = (int) (a->zbuffer_end - a->zbuffer);
+      if (n > len) n = len;
+      memcpy(a->zout, a->zbuffer, n);
+      a->zbuffer += n;
+      a->zout += n;
+      len -= n;
+   }
    return 1;
 }
 
@@ -4496,10 +6685,16 @@ static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
       } else {
          if (type == 1) {
             // use fixed code lengths
-            if (!stbi__zbuild_huffman(&a->z_length  , stbi__zdefault_length  , STBI__ZNSYMS)) return 0;
-            if (!stbi__zbuild_huffman(&a->z_distance, stbi__zdefault_distance,  32)) return 0;
+            if (!a->z_fixed) {
+               if (!stbi__zbuild_huffman(&a->z_length  , stbi__zdefault_length  , STBI__ZNSYMS)) return 0;
+               if (!stbi__zbuild_huffman(&a->z_distance, stbi__zdefault_distance,  32)) return 0;
+               stbi__zbuild_lit2(a->lit2, &a->z_length);
+               a->z_fixed = 1;
+            }
          } else {
+            a->z_fixed = 0;
             if (!stbi__compute_huffman_codes(a)) return 0;
+            stbi__zbuild_lit2(a->lit2, &a->z_length);
          }
          if (!stbi__parse_huffman_block(a)) return 0;
       }
@@ -4513,10 +6708,32 @@ static int stbi__do_zlib(stbi__zbuf *a, char *obuf, int olen, int exp, int parse
    a->zout       = obuf;
    a->zout_end   = obuf + olen;
    a->z_expandable = exp;
+   a->z_read = NULL;
+   a->z_write = NULL;
+   a->z_fixed = 0;
 
    return stbi__parse_zlib(a, parse_header);
 }
 
+#ifndef STBI_NO_PNG
+// streaming decode, see stbi__zbuf. window must have room for 32K of
+// history, whatever z_write may leave unused, and a 64K stored block.
+// a->z_fixed is up to the caller, who may be reusing a's tables
+static int stbi__do_zlib_stream(stbi__zbuf *a, char *window, int wlen, int parse_header,
+                                int (*zread)(void *, stbi__zbuf *), int (*zwrite)(void *, stbi_uc *, int), void *user)
+{
+   a->zbuffer = a->zbuffer_end = NULL;
+   a->zout_start = a->zout = a->z_done = window;
+   a->zout_end   = window + wlen;
+   a->z_expandable = 1;
+   a->z_read  = zread;
+   a->z_write = zwrite;
+   a->z_user  = user;
+   if (!stbi__parse_zlib(a, parse_header)) return 0;
+   return zwrite(user, (stbi_uc *) a->z_done, (int) (a->zout - a->z_done)) >= 0;
+}
+#endif
+
 STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen)
 {
    stbi__zbuf a;
@@ -4618,6 +6835,14 @@ static stbi__pngchunk stbi__get_chunk_header(stbi__context *s)
    return c;
 }
 
+#define STBI__PNG_TYPE(a,b,c,d)  (((unsigned) (a) << 24) + ((unsigned) (b) << 16) + ((unsigned) (c) << 8) + (unsigned) (d))
+
+// IDAT bytes read at a time when the image comes from callbacks
+#define STBI__PNG_IDAT_PIECE  (1 << 16)
+// inflate window, on top of one row. it has to hold the 32K of deflate
+// history, a partial row and a stored block; the rest saves window slides
+#define STBI__PNG_WINDOW      (1 << 18)
+
 static int stbi__check_png_header(stbi__context *s)
 {
    static const stbi_uc png_sig[8] = { 137,80,78,71,13,10,26,10 };
@@ -4627,14 +6852,6 @@ static int stbi__check_png_header(stbi__context *s)
    return 1;
 }
 
-typedef struct
-{
-   stbi__context *s;
-   stbi_uc *idata, *expanded, *out;
-   int depth;
-} stbi__png;
-
-
 enum {
    STBI__F_none=0,
    STBI__F_sub=1,
@@ -4645,6 +6862,43 @@ enum {
    STBI__F_avg_first
 };
 
+typedef void (*stbi__png_unfilter_func)(stbi_uc *cur, const stbi_uc *raw, const stbi_uc *prior, int nk, int filter_bytes);
+
+typedef struct
+{
+   stbi__context *s;
+   stbi_uc *idata, *expanded, *out;  // idata: IDAT input buffer; expanded: inflate window
+   int depth;
+
+   // rows are unfiltered as they come out of inflate; the rows of an
+   // interlaced image arrive pass by pass, each one a small image of its own
+   stbi_uc *filter_buf, *final;
+   stbi__png_unfilter_func unfilter[STBI__F_avg_first+1];
+   int out_n, color, interlaced, pass, filter_bytes;
+   stbi__uint32 pass_x, pass_y, row, row_len;
+
+   // an interlaced image can be cut short after its first `passes` passes;
+   // final then only holds the pixel grid they fill in, every 1<<grid_x
+   // pixels across and 1<<grid_y down, and inflate is stopped
+   int passes, grid_x, grid_y, stopped;
+
+   // IDAT chunks, as inflate reads them
+   stbi__uint32 idat_left;
+   stbi__pngchunk next;
+   int have_next;
+
+   // stbi_load_rows of a non-interlaced image: out holds out_rows rows at a
+   // time, which get the IEND processing (tRNS, iPhone, palette) and go to
+   // the consumer as soon as they are unfiltered
+   stbi__rows *rows;
+   stbi__uint32 out_rows;
+   stbi_uc *palette, *pal_out;
+   int pal_out_n, has_trans, de_iphone;
+   stbi_uc tc[3];
+   stbi__uint16 tc16[3];
+} stbi__png;
+
+
 static stbi_uc first_row_filter[5] =
 {
    STBI__F_none,
@@ -4667,6 +6921,181 @@ static int stbi__paeth(int a, int b, int c)
    return t1;
 }
 
+// SIMD unfiltering. Up has no dependency along the row and is done 16 (or,
+// with AVX2, 32) bytes at a time. Sub, Avg and Paeth depend on the pixel to
+// the left, so they run one whole pixel per step in a register; that covers
+// 3/4-byte pixels and the 6/8-byte pixels of 16-bit RGB/RGBA. Sub with 4- or
+// 8-byte pixels is a prefix sum and is done 16 bytes at a time.
+
+#ifdef STBI_SSE2
+static void stbi__unfilter_up_sse2(stbi_uc *cur, const stbi_uc *raw, const stbi_uc *prior, int nk, int filter_bytes)
+{
+   int k = 0;
+   STBI_NOTUSED(filter_bytes);
+   for (; k+16 <= nk; k += 16) {
+      __m128i r = _mm_loadu_si128((const __m128i *) (raw+k));
+      __m128i b = _mm_loadu_si128((const __m128i *) (prior+k));
+      _mm_storeu_si128((__m128i *) (cur+k), _mm_add_epi8(r, b));
+   }
+   for (; k < nk; ++k)
+      cur[k] = STBI__BYTECAST(raw[k] + prior[k]);
+}
+
+// one pixel of 3/4 (n=4) or 6/8 (n=8) bytes into the low bytes of a register;
+// the bytes past the pixel belong to the next one and are rewritten by it
+stbi_inline static __m128i stbi__png_load_px(const stbi_uc *p, int n)
+{
+   if (n == 4) {
+      int v;
+      memcpy(&v, p, 4);
+      return _mm_cvtsi32_si128(v);
+   }
+   return _mm_loadl_epi64((const __m128i *) p);
+}
+
+stbi_inline static void stbi__png_store_px(stbi_uc *p, __m128i v, int n)
+{
+   if (n == 4) {
+      int t = _mm_cvtsi128_si32(v);
+      memcpy(p, &t, 4);
+   } else
+      _mm_storel_epi64((__m128i *) p, v);
+}
+
+static void stbi__unfilter_sub_sse2(stbi_uc *cur, const stbi_uc *raw, const stbi_uc *prior, int nk, int filter_bytes)
+{
+   int k = filter_bytes, n = filter_bytes <= 4 ? 4 : 8;
+   __m128i a;
+   STBI_NOTUSED(prior);
+   memcpy(cur, raw, filter_bytes);
+   if (filter_bytes == 4 || filter_bytes == 8) {
+      // in-register prefix sum over 16 bytes, plus the last pixel so far
+      a = _mm_setzero_si128();
+      k = 0;
+      for (; k+16 <= nk; k += 16) {
+         __m128i x = _mm_loadu_si128((const __m128i *) (raw+k));
+         if (filter_bytes == 4) {
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+            x = _mm_add_epi8(x, a);
+            a = _mm_shuffle_epi32(x, 0xff);
+         } else {
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+            x = _mm_add_epi8(x, a);
+            a = _mm_unpackhi_epi64(x, x);
+         }
+         _mm_storeu_si128((__m128i *) (cur+k), x);
+      }
+      if (k == 0) k = filter_bytes;
+   } else if (k+n <= nk) {
+      a = stbi__png_load_px(cur, n);
+      for (; k+n <= nk; k += filter_bytes) {
+         a = _mm_add_epi8(stbi__png_load_px(raw+k, n), a);
+         stbi__png_store_px(cur+k, a, n);
+      }
+   }
+   for (; k < nk; ++k)
+      cur[k] = STBI__BYTECAST(raw[k] + cur[k-filter_bytes]);
+}
+
+static void stbi__unfilter_avg_sse2(stbi_uc *cur, const stbi_uc *raw, const stbi_uc *prior, int nk, int filter_bytes)
+{
+   int k, n = filter_bytes <= 4 ? 4 : 8;
+   __m128i a, one = _mm_set1_epi8(1);
+   for (k = 0; k < filter_bytes; ++k)
+      cur[k] = STBI__BYTECAST(raw[k] + (prior[k]>>1));
+   // the first pixel is loaded whole, so skip the vector loop on 1-pixel rows
+   a = k+n <= nk ? stbi__png_load_px(cur, n) : _mm_setzero_si128();
+   for (; k+n <= nk; k += filter_bytes) {
+      __m128i b = stbi__png_load_px(prior+k, n);
+      // pavgb rounds up; take off the carry to get floor((a+b)/2)
+      __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+      a = _mm_add_epi8(stbi__png_load_px(raw+k, n), avg);
+      stbi__png_store_px(cur+k, a, n);
+   }
+   for (; k < nk; ++k)
+      cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k-filter_bytes])>>1));
+}
+
+static void stbi__unfilter_paeth_sse2(stbi_uc *cur, const stbi_uc *raw, const stbi_uc *prior, int nk, int filter_bytes)
+{
+   int k, n = filter_bytes <= 4 ? 4 : 8;
+   __m128i zero = _mm_setzero_si128();
+   __m128i lomask = _mm_set1_epi16(0xff);
+   __m128i a, c;
+   for (k = 0; k < filter_bytes; ++k)
+      cur[k] = STBI__BYTECAST(raw[k] + prior[k]); // prior[k] == stbi__paeth(0,prior[k],0)
+   // a, b, c as 16-bit lanes; the first pixel is loaded whole, so only when
+   // the vector loop runs at all
+   a = c = zero;
+   if (k+n <= nk) {
+      a = _mm_unpacklo_epi8(stbi__png_load_px(cur, n), zero);
+      c = _mm_unpacklo_epi8(stbi__png_load_px(prior, n), zero);
+   }
+   for (; k+n <= nk; k += filter_bytes) {
+      __m128i b = _mm_unpacklo_epi8(stbi__png_load_px(prior+k, n), zero);
+      // the predictor from the spec: distances of a+b-c to a, b and c
+      __m128i bc = _mm_sub_epi16(b, c);
+      __m128i ac = _mm_sub_epi16(a, c);
+      __m128i abc = _mm_add_epi16(bc, ac);
+      __m128i pa = _mm_max_epi16(bc, _mm_sub_epi16(zero, bc));
+      __m128i pb = _mm_max_epi16(ac, _mm_sub_epi16(zero, ac));
+      __m128i pc = _mm_max_epi16(abc, _mm_sub_epi16(zero, abc));
+      // a if pa <= pb and pa <= pc, else b if pb <= pc, else c
+      __m128i not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+      __m128i use_c = _mm_cmpgt_epi16(pb, pc);
+      __m128i bc_sel = _mm_or_si128(_mm_and_si128(use_c, c), _mm_andnot_si128(use_c, b));
+      __m128i pred = _mm_or_si128(_mm_and_si128(not_a, bc_sel), _mm_andnot_si128(not_a, a));
+      // add in 16 bits so the next pixel's a doesn't wait on a pack/unpack
+      a = _mm_and_si128(_mm_add_epi16(_mm_unpacklo_epi8(stbi__png_load_px(raw+k, n), zero), pred), lomask);
+      stbi__png_store_px(cur+k, _mm_packus_epi16(a, a), n);
+      c = b;
+   }
+   for (; k < nk; ++k)
+      cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes], prior[k], prior[k-filter_bytes]));
+}
+#endif // STBI_SSE2
+
+#ifdef STBI_AVX2
+static STBI__AVX2_TARGET void stbi__unfilter_up_avx2(stbi_uc *cur, const stbi_uc *raw, const stbi_uc *prior, int nk, int filter_bytes)
+{
+   int k = 0;
+   STBI_NOTUSED(filter_bytes);
+   for (; k+32 <= nk; k += 32) {
+      __m256i r = _mm256_loadu_si256((const __m256i *) (raw+k));
+      __m256i b = _mm256_loadu_si256((const __m256i *) (prior+k));
+      _mm256_storeu_si256((__m256i *) (cur+k), _mm256_add_epi8(r, b));
+   }
+   for (; k < nk; ++k)
+      cur[k] = STBI__BYTECAST(raw[k] + prior[k]);
+}
+#endif
+
+// picks the unfilter kernels for this image, by filter type; NULL means the
+// scalar code in stbi__create_png_image_raw
+static void stbi__setup_png_unfilter(stbi__png_unfilter_func kernel[STBI__F_avg_first+1], int filter_bytes, int depth)
+{
+   int i;
+   for (i=0; i <= STBI__F_avg_first; ++i)
+      kernel[i] = NULL;
+   STBI_NOTUSED(filter_bytes);
+   STBI_NOTUSED(depth);
+#ifdef STBI_SSE2
+   if (depth >= 8 && stbi__sse2_available()) {
+      kernel[STBI__F_up] = stbi__unfilter_up_sse2;
+      if (filter_bytes == 3 || filter_bytes == 4 || filter_bytes == 6 || filter_bytes == 8) {
+         kernel[STBI__F_sub] = stbi__unfilter_sub_sse2;
+         kernel[STBI__F_avg] = stbi__unfilter_avg_sse2;
+         kernel[STBI__F_paeth] = stbi__unfilter_paeth_sse2;
+      }
+   }
+#endif
+#ifdef STBI_AVX2
+   if (depth >= 8 && stbi__avx2_available())
+      kernel[STBI__F_up] = stbi__unfilter_up_avx2;
+#endif
+}
+
 static const stbi_uc stbi__depth_scale_table[9] = { 0, 0xff, 0x55, 0, 0x11, 0,0,0, 0x01 };
 
 // adds an extra all-255 alpha channel
@@ -4692,222 +7121,299 @@ static void stbi__create_png_alpha_expand8(stbi_uc *dest, stbi_uc *src, stbi__ui
    }
 }
 
-// create the png data from post-deflated data
-static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
+// sets up the next pass that has any pixels in it, or marks the image done
+static int stbi__png_start_pass(stbi__png *a)
 {
-   int bytes = (depth == 16 ? 2 : 1);
+   static const int xorig[] = { 0,4,0,2,0,1,0 };
+   static const int yorig[] = { 0,0,4,0,2,0,1 };
+   static const int xspc[]  = { 8,8,4,4,2,2,1 };
+   static const int yspc[]  = { 8,8,8,4,4,2,2 };
    stbi__context *s = a->s;
-   stbi__uint32 i,j,stride = x*out_n*bytes;
-   stbi__uint32 img_len, img_width_bytes;
-   stbi_uc *filter_buf;
-   int all_ok = 1;
-   int k;
-   int img_n = s->img_n; // copy it into a local for later
-
-   int output_bytes = out_n*bytes;
-   int filter_bytes = img_n*bytes;
-   int width = x;
-
-   STBI_ASSERT(out_n == s->img_n || out_n == s->img_n+1);
-   a->out = (stbi_uc *) stbi__malloc_mad3(x, y, output_bytes, 0); // extra bytes to write off the end into
+   int output_bytes = a->out_n * (a->depth == 16 ? 2 : 1);
+   if (!a->interlaced) {
+      if (a->pass) { a->pass = 7; return 1; }
+      a->pass_x = s->img_x;
+      a->pass_y = s->img_y;
+   } else {
+      for (; a->pass < a->passes; ++a->pass) {
+         // pass1_x[4] = 0, pass1_x[5] = 1, pass1_x[12] = 1
+         a->pass_x = (s->img_x - xorig[a->pass] + xspc[a->pass]-1) / xspc[a->pass];
+         a->pass_y = (s->img_y - yorig[a->pass] + yspc[a->pass]-1) / yspc[a->pass];
+         if (a->pass_x && a->pass_y) break;
+      }
+      if (a->pass == a->passes) {
+         a->out = a->final;
+         a->final = NULL;
+         a->pass = 7;
+         return 1;
+      }
+   }
+   if (!stbi__mad3sizes_valid(s->img_n, a->pass_x, a->depth, 7)) return stbi__err("too large", "Corrupt PNG");
+   a->row_len = ((s->img_n * a->pass_x * a->depth + 7) >> 3) + 1;
+   if (!stbi__mad2sizes_valid(a->row_len, a->pass_y, 0)) return stbi__err("too large", "Corrupt PNG");
+   a->out_rows = a->pass_y;
+   if (a->rows) {
+      stbi__uint32 batch = stbi__rows_batch(a->pass_x, output_bytes);
+      if (a->out_rows > batch) a->out_rows = batch;
+   }
+   a->out = (stbi_uc *) stbi__malloc_mad3(a->pass_x, a->out_rows, output_bytes, 0);
    if (!a->out) return stbi__err("outofmem", "Out of memory");
+   a->row = 0;
+   return 1;
+}
 
-   // note: error exits here don't need to clean up a->out individually,
-   // stbi__do_png always does on error.
-   if (!stbi__mad3sizes_valid(img_n, x, depth, 7)) return stbi__err("too large", "Corrupt PNG");
-   img_width_bytes = (((img_n * x * depth) + 7) >> 3);
-   if (!stbi__mad2sizes_valid(img_width_bytes, y, img_width_bytes)) return stbi__err("too large", "Corrupt PNG");
-   img_len = (img_width_bytes + 1) * y;
-
-   // we used to check for exact match between raw_len and img_len on non-interlaced PNGs,
-   // but issue #276 reported a PNG in the wild that had extra data at the end (all zeros),
-   // so just check for raw_len < img_len always.
-   if (raw_len < img_len) return stbi__err("not enough pixels","Corrupt PNG");
-
-   // Allocate two scan lines worth of filter workspace buffer.
-   filter_buf = (stbi_uc *) stbi__malloc_mad2(img_width_bytes, 2, 0);
-   if (!filter_buf) return stbi__err("outofmem", "Out of memory");
-
-   // Filtering for low-bit-depth images
-   if (depth < 8) {
-      filter_bytes = 1;
-      width = img_width_bytes;
+// copies a finished pass into its pixels of the final image
+static int stbi__png_end_pass(stbi__png *a)
+{
+   static const int xorig[] = { 0,4,0,2,0,1,0 };
+   static const int yorig[] = { 0,0,4,0,2,0,1 };
+   static const int xspc[]  = { 8,8,4,4,2,2,1 };
+   static const int yspc[]  = { 8,8,8,4,4,2,2 };
+   if (a->interlaced) {
+      int out_bytes = a->out_n * (a->depth == 16 ? 2 : 1);
+      int p = a->pass;
+      stbi__uint32 i,j, final_x = (a->s->img_x + (1 << a->grid_x) - 1) >> a->grid_x;
+      for (j=0; j < a->pass_y; ++j) {
+         for (i=0; i < a->pass_x; ++i) {
+            int out_y = (j*yspc[p]+yorig[p]) >> a->grid_y;
+            int out_x = (i*xspc[p]+xorig[p]) >> a->grid_x;
+            memcpy(a->final + out_y*final_x*out_bytes + out_x*out_bytes,
+                   a->out + (j*a->pass_x+i)*out_bytes, out_bytes);
+         }
+      }
+      STBI_FREE(a->out);
+      a->out = NULL;
    }
+   ++a->pass;
+   return stbi__png_start_pass(a);
+}
 
-   for (j=0; j < y; ++j) {
-      // cur/prior filter buffers alternate
-      stbi_uc *cur = filter_buf + (j & 1)*img_width_bytes;
-      stbi_uc *prior = filter_buf + (~j & 1)*img_width_bytes;
-      stbi_uc *dest = a->out + stride*j;
-      int nk = width * filter_bytes;
-      int filter = *raw++;
+// prepares to take the inflated rows of an image
+static int stbi__png_begin_rows(stbi__png *a, int out_n, int color, int interlaced)
+{
+   stbi__context *s = a->s;
+   stbi__uint32 img_width_bytes;
+   STBI_ASSERT(out_n == s->img_n || out_n == s->img_n+1);
+   a->out_n = out_n;
+   a->color = color;
+   a->interlaced = interlaced;
+   a->pass = 0;
+
+   // note: error exits here don't need to clean up, stbi__do_png always does
+   if (!stbi__mad3sizes_valid(s->img_n, s->img_x, a->depth, 7)) return stbi__err("too large", "Corrupt PNG");
+   img_width_bytes = (((s->img_n * s->img_x * a->depth) + 7) >> 3);
+   // Two scan lines worth of filter workspace buffer, wide enough for every pass.
+   a->filter_buf = (stbi_uc *) stbi__keep_malloc(s, STBI__KEEP_png_filter, img_width_bytes, 2, 1, 0);
+   if (!a->filter_buf) return stbi__err("outofmem", "Out of memory");
 
-      // check filter type
-      if (filter > 4) {
-         all_ok = stbi__err("invalid filter","Corrupt PNG");
-         break;
-      }
+   // Filtering for low-bit-depth images
+   a->filter_bytes = a->depth < 8 ? 1 : s->img_n * (a->depth == 16 ? 2 : 1);
+   stbi__setup_png_unfilter(a->unfilter, a->filter_bytes, a->depth);
 
-      // if first row, use special filter that doesn't sample previous row
-      if (j == 0) filter = first_row_filter[filter];
+   if (a->passes < 7 && !interlaced) return stbi__err("not interlaced", "PNG is not interlaced");
+   {
+      // the pixel spacing left by the passes that are decoded
+      static const int grid_x[] = { 3,2,2,1,1,0,0 };
+      static const int grid_y[] = { 3,3,2,2,1,1,0 };
+      a->grid_x = grid_x[a->passes-1];
+      a->grid_y = grid_y[a->passes-1];
+   }
+   a->stopped = 0;
+   if (interlaced) {
+      stbi__uint32 final_x = (s->img_x + (1 << a->grid_x) - 1) >> a->grid_x;
+      stbi__uint32 final_y = (s->img_y + (1 << a->grid_y) - 1) >> a->grid_y;
+      a->final = (stbi_uc *) stbi__malloc_mad3(final_x, final_y, out_n * (a->depth == 16 ? 2 : 1), 0);
+      if (!a->final) return stbi__err("outofmem", "Out of memory");
+   }
+   return stbi__png_start_pass(a);
+}
+
+// unfilters one row of the current pass into a->out
+static int stbi__png_unfilter_row(stbi__png *a, stbi_uc *raw)
+{
+   int bytes = (a->depth == 16 ? 2 : 1);
+   int depth = a->depth, color = a->color, out_n = a->out_n;
+   int img_n = a->s->img_n;
+   int filter_bytes = a->filter_bytes;
+   stbi__uint32 i, j = a->row, x = a->pass_x;
+   stbi__uint32 img_width_bytes = a->row_len - 1;
+   // cur/prior filter buffers alternate
+   stbi_uc *cur = a->filter_buf + (j & 1)*img_width_bytes;
+   stbi_uc *prior = a->filter_buf + (~j & 1)*img_width_bytes;
+   stbi_uc *dest = a->out + x*out_n*bytes*(j % a->out_rows);
+   int nk = img_width_bytes;
+   int filter = *raw++;
+   int k;
 
-      // perform actual filtering
-      switch (filter) {
-      case STBI__F_none:
-         memcpy(cur, raw, nk);
-         break;
-      case STBI__F_sub:
-         memcpy(cur, raw, filter_bytes);
-         for (k = filter_bytes; k < nk; ++k)
-            cur[k] = STBI__BYTECAST(raw[k] + cur[k-filter_bytes]);
-         break;
-      case STBI__F_up:
-         for (k = 0; k < nk; ++k)
-            cur[k] = STBI__BYTECAST(raw[k] + prior[k]);
-         break;
-      case STBI__F_avg:
-         for (k = 0; k < filter_bytes; ++k)
-            cur[k] = STBI__BYTECAST(raw[k] + (prior[k]>>1));
-         for (k = filter_bytes; k < nk; ++k)
-            cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k-filter_bytes])>>1));
-         break;
-      case STBI__F_paeth:
-         for (k = 0; k < filter_bytes; ++k)
-            cur[k] = STBI__BYTECAST(raw[k] + prior[k]); // prior[k] == stbi__paeth(0,prior[k],0)
-         for (k = filter_bytes; k < nk; ++k)
-            cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes], prior[k], prior[k-filter_bytes]));
-         break;
-      case STBI__F_avg_first:
-         memcpy(cur, raw, filter_bytes);
-         for (k = filter_bytes; k < nk; ++k)
-            cur[k] = STBI__BYTECAST(raw[k] + (cur[k-filter_bytes] >> 1));
-         break;
+   // check filter type
+   if (filter > 4) return stbi__err("invalid filter","Corrupt PNG");
+
+   // if first row, use special filter that doesn't sample previous row
+   if (j == 0) filter = first_row_filter[filter];
+
+   // perform actual filtering
+   if (a->unfilter[filter]) a->unfilter[filter](cur, raw, prior, nk, filter_bytes);
+   else switch (filter) {
+   case STBI__F_none:
+      memcpy(cur, raw, nk);
+      break;
+   case STBI__F_sub:
+      memcpy(cur, raw, filter_bytes);
+      for (k = filter_bytes; k < nk; ++k)
+         cur[k] = STBI__BYTECAST(raw[k] + cur[k-filter_bytes]);
+      break;
+   case STBI__F_up:
+      for (k = 0; k < nk; ++k)
+         cur[k] = STBI__BYTECAST(raw[k] + prior[k]);
+      break;
+   case STBI__F_avg:
+      for (k = 0; k < filter_bytes; ++k)
+         cur[k] = STBI__BYTECAST(raw[k] + (prior[k]>>1));
+      for (k = filter_bytes; k < nk; ++k)
+         cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k-filter_bytes])>>1));
+      break;
+   case STBI__F_paeth:
+      for (k = 0; k < filter_bytes; ++k)
+         cur[k] = STBI__BYTECAST(raw[k] + prior[k]); // prior[k] == stbi__paeth(0,prior[k],0)
+      for (k = filter_bytes; k < nk; ++k)
+         cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes], prior[k], prior[k-filter_bytes]));
+      break;
+   case STBI__F_avg_first:
+      memcpy(cur, raw, filter_bytes);
+      for (k = filter_bytes; k < nk; ++k)
+         cur[k] = STBI__BYTECAST(raw[k] + (cur[k-filter_bytes] >> 1));
+      break;
+   }
+
+   // expand decoded bits in cur to dest, also adding an extra alpha channel if desired
+   if (depth < 8) {
+      stbi_uc scale = (color == 0) ? stbi__depth_scale_table[depth] : 1; // scale grayscale values to 0..255 range
+      stbi_uc *in = cur;
+      stbi_uc *out = dest;
+      stbi_uc inb = 0;
+      stbi__uint32 nsmp = x*img_n;
+
+      // expand bits to bytes first
+      if (depth == 4) {
+         for (i=0; i < nsmp; ++i) {
+            if ((i & 1) == 0) inb = *in++;
+            *out++ = scale * (inb >> 4);
+            inb <<= 4;
+         }
+      } else if (depth == 2) {
+         for (i=0; i < nsmp; ++i) {
+            if ((i & 3) == 0) inb = *in++;
+            *out++ = scale * (inb >> 6);
+            inb <<= 2;
+         }
+      } else {
+         STBI_ASSERT(depth == 1);
+         for (i=0; i < nsmp; ++i) {
+            if ((i & 7) == 0) inb = *in++;
+            *out++ = scale * (inb >> 7);
+            inb <<= 1;
+         }
       }
 
-      raw += nk;
-
-      // expand decoded bits in cur to dest, also adding an extra alpha channel if desired
-      if (depth < 8) {
-         stbi_uc scale = (color == 0) ? stbi__depth_scale_table[depth] : 1; // scale grayscale values to 0..255 range
-         stbi_uc *in = cur;
-         stbi_uc *out = dest;
-         stbi_uc inb = 0;
-         stbi__uint32 nsmp = x*img_n;
-
-         // expand bits to bytes first
-         if (depth == 4) {
-            for (i=0; i < nsmp; ++i) {
-               if ((i & 1) == 0) inb = *in++;
-               *out++ = scale * (inb >> 4);
-               inb <<= 4;
-            }
-         } else if (depth == 2) {
-            for (i=0; i < nsmp; ++i) {
-               if ((i & 3) == 0) inb = *in++;
-               *out++ = scale * (inb >> 6);
-               inb <<= 2;
-            }
-         } else {
-            STBI_ASSERT(depth == 1);
-            for (i=0; i < nsmp; ++i) {
-               if ((i & 7) == 0) inb = *in++;
-               *out++ = scale * (inb >> 7);
-               inb <<= 1;
+      // insert alpha=255 values if desired
+      if (img_n != out_n)
+         stbi__create_png_alpha_expand8(dest, dest, x, img_n);
+   } else if (depth == 8) {
+      if (img_n == out_n)
+         memcpy(dest, cur, x*img_n);
+      else
+         stbi__create_png_alpha_expand8(dest, cur, x, img_n);
+   } else if (depth == 16) {
+      // convert the image data from big-endian to platform-native
+      stbi__uint16 *dest16 = (stbi__uint16*)dest;
+      stbi__uint32 nsmp = x*img_n;
+
+      if (img_n == out_n) {
+         for (i = 0; i < nsmp; ++i, ++dest16, cur += 2)
+            *dest16 = (cur[0] << 8) | cur[1];
+      } else {
+         STBI_ASSERT(img_n+1 == out_n);
+         if (img_n == 1) {
+            for (i = 0; i < x; ++i, dest16 += 2, cur += 2) {
+               dest16[0] = (cur[0] << 8) | cur[1];
+               dest16[1] = 0xffff;
             }
-         }
-
-         // insert alpha=255 values if desired
-         if (img_n != out_n)
-            stbi__create_png_alpha_expand8(dest, dest, x, img_n);
-      } else if (depth == 8) {
-         if (img_n == out_n)
-            memcpy(dest, cur, x*img_n);
-         else
-            stbi__create_png_alpha_expand8(dest, cur, x, img_n);
-      } else if (depth == 16) {
-         // convert the image data from big-endian to platform-native
-         stbi__uint16 *dest16 = (stbi__uint16*)dest;
-         stbi__uint32 nsmp = x*img_n;
-
-         if (img_n == out_n) {
-            for (i = 0; i < nsmp; ++i, ++dest16, cur += 2)
-               *dest16 = (cur[0] << 8) | cur[1];
          } else {
-            STBI_ASSERT(img_n+1 == out_n);
-            if (img_n == 1) {
-               for (i = 0; i < x; ++i, dest16 += 2, cur += 2) {
-                  dest16[0] = (cur[0] << 8) | cur[1];
-                  dest16[1] = 0xffff;
-               }
-            } else {
-               STBI_ASSERT(img_n == 3);
-               for (i = 0; i < x; ++i, dest16 += 4, cur += 6) {
-                  dest16[0] = (cur[0] << 8) | cur[1];
-                  dest16[1] = (cur[2] << 8) | cur[3];
-                  dest16[2] = (cur[4] << 8) | cur[5];
-                  dest16[3] = 0xffff;
-               }
+            STBI_ASSERT(img_n == 3);
+            for (i = 0; i < x; ++i, dest16 += 4, cur += 6) {
+               dest16[0] = (cur[0] << 8) | cur[1];
+               dest16[1] = (cur[2] << 8) | cur[3];
+               dest16[2] = (cur[4] << 8) | cur[5];
+               dest16[3] = 0xffff;
             }
          }
       }
    }
+   return 1;
+}
 
-   STBI_FREE(filter_buf);
-   if (!all_ok) return 0;
+static int stbi__png_emit_rows(stbi__png *a);
 
-   return 1;
+// inflate output sink: unfilters the complete rows in data. anything past
+// the last row is ignored, as the old whole-buffer decode did
+static int stbi__png_write_rows(void *user, stbi_uc *data, int len)
+{
+   stbi__png *a = (stbi__png *) user;
+   int used = 0;
+   while (a->pass < 7 && len - used >= (int) a->row_len) {
+      if (!stbi__png_unfilter_row(a, data + used)) return -1;
+      used += a->row_len;
+      ++a->row;
+      if (a->rows && (a->row % a->out_rows == 0 || a->row == a->pass_y))
+         if (!stbi__png_emit_rows(a)) return -1;
+      if (a->row == a->pass_y)
+         if (!stbi__png_end_pass(a)) return -1;
+   }
+   if (a->pass == 7 && a->passes < 7) {
+      // the wanted passes are done; stop inflate instead of going on
+      a->stopped = 1;
+      return -1;
+   }
+   return a->pass < 7 ? used : len;
 }
 
-static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint32 image_data_len, int out_n, int depth, int color, int interlaced)
-{
-   int bytes = (depth == 16 ? 2 : 1);
-   int out_bytes = out_n * bytes;
-   stbi_uc *final;
-   int p;
-   if (!interlaced)
-      return stbi__create_png_image_raw(a, image_data, image_data_len, out_n, a->s->img_x, a->s->img_y, depth, color);
-
-   // de-interlacing
-   final = (stbi_uc *) stbi__malloc_mad3(a->s->img_x, a->s->img_y, out_bytes, 0);
-   if (!final) return stbi__err("outofmem", "Out of memory");
-   for (p=0; p < 7; ++p) {
-      int xorig[] = { 0,4,0,2,0,1,0 };
-      int yorig[] = { 0,0,4,0,2,0,1 };
-      int xspc[]  = { 8,8,4,4,2,2,1 };
-      int yspc[]  = { 8,8,8,4,4,2,2 };
-      int i,j,x,y;
-      // pass1_x[4] = 0, pass1_x[5] = 1, pass1_x[12] = 1
-      x = (a->s->img_x - xorig[p] + xspc[p]-1) / xspc[p];
-      y = (a->s->img_y - yorig[p] + yspc[p]-1) / yspc[p];
-      if (x && y) {
-         stbi__uint32 img_len = ((((a->s->img_n * x * depth) + 7) >> 3) + 1) * y;
-         if (!stbi__create_png_image_raw(a, image_data, image_data_len, out_n, x, y, depth, color)) {
-            STBI_FREE(final);
-            return 0;
-         }
-         for (j=0; j < y; ++j) {
-            for (i=0; i < x; ++i) {
-               int out_y = j*yspc[p]+yorig[p];
-               int out_x = i*xspc[p]+xorig[p];
-               memcpy(final + out_y*a->s->img_x*out_bytes + out_x*out_bytes,
-                      a->out + (j*x+i)*out_bytes, out_bytes);
-            }
-         }
-         STBI_FREE(a->out);
-         image_data += img_len;
-         image_data_len -= img_len;
+// inflate input source: the data of consecutive IDAT chunks. read straight
+// out of memory when the image is there, else a piece at a time into idata
+static int stbi__png_read_idat(void *user, stbi__zbuf *zb)
+{
+   stbi__png *a = (stbi__png *) user;
+   stbi__context *s = a->s;
+   stbi__uint32 n;
+   while (a->idat_left == 0) {
+      if (a->have_next) return 0;
+      stbi__get32be(s); // CRC of the IDAT just finished
+      a->next = stbi__get_chunk_header(s);
+      if (a->next.type != STBI__PNG_TYPE('I','D','A','T') || a->next.length > (1u << 30)) {
+         // for the chunk loop in stbi__parse_png_file to deal with
+         a->have_next = 1;
+         return 0;
       }
+      a->idat_left = a->next.length;
    }
-   a->out = final;
-
+   if (s->io.read == NULL) {
+      n = (stbi__uint32) (s->img_buffer_end - s->img_buffer);
+      if (n > a->idat_left) n = a->idat_left;
+      if (n == 0) return 0;
+      zb->zbuffer = s->img_buffer;
+      s->img_buffer += n;
+   } else {
+      n = a->idat_left < STBI__PNG_IDAT_PIECE ? a->idat_left : STBI__PNG_IDAT_PIECE;
+      if (!stbi__getn(s, a->idata, n)) return 0;
+      zb->zbuffer = a->idata;
+   }
+   zb->zbuffer_end = zb->zbuffer + n;
+   a->idat_left -= n;
    return 1;
 }
 
-static int stbi__compute_transparency(stbi__png *z, stbi_uc tc[3], int out_n)
+static int stbi__compute_transparency(stbi_uc *p, stbi__uint32 pixel_count, stbi_uc tc[3], int out_n)
 {
-   stbi__context *s = z->s;
-   stbi__uint32 i, pixel_count = s->img_x * s->img_y;
-   stbi_uc *p = z->out;
+   stbi__uint32 i;
 
    // compute color-based transparency, assuming we've
    // already got 255 as the alpha value in the output
@@ -4928,11 +7434,9 @@ static int stbi__compute_transparency(stbi__png *z, stbi_uc tc[3], int out_n)
    return 1;
 }
 
-static int stbi__compute_transparency16(stbi__png *z, stbi__uint16 tc[3], int out_n)
+static int stbi__compute_transparency16(stbi__uint16 *p, stbi__uint32 pixel_count, stbi__uint16 tc[3], int out_n)
 {
-   stbi__context *s = z->s;
-   stbi__uint32 i, pixel_count = s->img_x * s->img_y;
-   stbi__uint16 *p = (stbi__uint16*) z->out;
+   stbi__uint32 i;
 
    // compute color-based transparency, assuming we've
    // already got 65535 as the alpha value in the output
@@ -4953,17 +7457,9 @@ static int stbi__compute_transparency16(stbi__png *z, stbi__uint16 tc[3], int ou
    return 1;
 }
 
-static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int pal_img_n)
+static void stbi__expand_png_palette_into(stbi_uc *p, const stbi_uc *orig, stbi__uint32 pixel_count, const stbi_uc *palette, int pal_img_n)
 {
-   stbi__uint32 i, pixel_count = a->s->img_x * a->s->img_y;
-   stbi_uc *p, *temp_out, *orig = a->out;
-
-   p = (stbi_uc *) stbi__malloc_mad2(pixel_count, pal_img_n, 0);
-   if (p == NULL) return stbi__err("outofmem", "Out of memory");
-
-   // between here and free(out) below, exitting would leak
-   temp_out = p;
-
+   stbi__uint32 i;
    if (pal_img_n == 3) {
       for (i=0; i < pixel_count; ++i) {
          int n = orig[i]*4;
@@ -4982,8 +7478,19 @@ static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int
          p += 4;
       }
    }
+}
+
+static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int pal_img_n)
+{
+   stbi__uint32 pixel_count = a->s->img_x * a->s->img_y;
+   stbi_uc *p;
+
+   p = (stbi_uc *) stbi__malloc_mad2(pixel_count, pal_img_n, 0);
+   if (p == NULL) return stbi__err("outofmem", "Out of memory");
+
+   stbi__expand_png_palette_into(p, a->out, pixel_count, palette, pal_img_n);
    STBI_FREE(a->out);
-   a->out = temp_out;
+   a->out = p;
 
    STBI_NOTUSED(len);
 
@@ -5030,13 +7537,11 @@ STBIDEF void stbi_convert_iphone_png_to_rgb_thread(int flag_true_if_should_conve
                                 : stbi__de_iphone_flag_global)
 #endif // STBI_THREAD_LOCAL
 
-static void stbi__de_iphone(stbi__png *z)
+static void stbi__de_iphone(stbi_uc *p, stbi__uint32 pixel_count, int out_n)
 {
-   stbi__context *s = z->s;
-   stbi__uint32 i, pixel_count = s->img_x * s->img_y;
-   stbi_uc *p = z->out;
+   stbi__uint32 i;
 
-   if (s->img_out_n == 3) {  // convert bgr to rgb
+   if (out_n == 3) {  // convert bgr to rgb
       for (i=0; i < pixel_count; ++i) {
          stbi_uc t = p[0];
          p[0] = p[2];
@@ -5044,7 +7549,7 @@ static void stbi__de_iphone(stbi__png *z)
          p += 3;
       }
    } else {
-      STBI_ASSERT(s->img_out_n == 4);
+      STBI_ASSERT(out_n == 4);
       if (stbi__unpremultiply_on_load) {
          // convert bgr to rgb and unpremultiply
          for (i=0; i < pixel_count; ++i) {
@@ -5073,27 +7578,70 @@ static void stbi__de_iphone(stbi__png *z)
    }
 }
 
-#define STBI__PNG_TYPE(a,b,c,d)  (((unsigned) (a) << 24) + ((unsigned) (b) << 16) + ((unsigned) (c) << 8) + (unsigned) (d))
+// applies the IEND processing to the rows in out and hands them on
+static int stbi__png_emit_rows(stbi__png *a)
+{
+   int n = (a->row - 1) % a->out_rows + 1;
+   stbi__uint32 pixel_count = a->pass_x * n;
+   if (a->has_trans) {
+      if (a->depth == 16)
+         stbi__compute_transparency16((stbi__uint16 *) a->out, pixel_count, a->tc16, a->out_n);
+      else
+         stbi__compute_transparency(a->out, pixel_count, a->tc, a->out_n);
+   }
+   if (a->de_iphone)
+      stbi__de_iphone(a->out, pixel_count, a->out_n);
+   if (a->palette) {
+      stbi__expand_png_palette_into(a->pal_out, a->out, pixel_count, a->palette, a->pal_out_n);
+      return stbi__rows_emit(a->rows, a->pal_out, a->pass_x, n, a->pal_out_n, 0);
+   }
+   return stbi__rows_emit(a->rows, a->out, a->pass_x, n, a->out_n, a->depth == 16);
+}
+
+// the inflate state for an image; loading through a decoder context, it is
+// the context's, whose fixed-code tables then carry over. own serves otherwise
+static stbi__zbuf *stbi__png_zbuf(stbi__context *s, stbi__zbuf *own)
+{
+   stbi__zbuf *zb = (stbi__zbuf *) stbi__keep_reuse(s, STBI__KEEP_zbuf, sizeof(stbi__zbuf));
+   if (zb) return zb;
+   if (s->dec)
+      zb = (stbi__zbuf *) stbi__keep_malloc(s, STBI__KEEP_zbuf, (int) sizeof(stbi__zbuf), 1, 1, 0);
+   if (!zb) zb = own;
+   zb->z_fixed = 0;
+   return zb;
+}
 
 static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
 {
    stbi_uc palette[1024], pal_img_n=0;
    stbi_uc has_trans=0, tc[3]={0};
    stbi__uint16 tc16[3];
-   stbi__uint32 ioff=0, idata_limit=0, i, pal_len=0;
-   int first=1,k,interlace=0, color=0, is_iphone=0;
+   stbi__uint32 i, pal_len=0;
+   int first=1,k,interlace=0, color=0, is_iphone=0, seen_idat=0;
    stbi__context *s = z->s;
 
    z->expanded = NULL;
    z->idata = NULL;
    z->out = NULL;
+   z->filter_buf = NULL;
+   z->final = NULL;
+   z->have_next = 0;
+   z->palette = NULL;
+   z->pal_out = NULL;
 
    if (!stbi__check_png_header(s)) return 0;
 
    if (scan == STBI__SCAN_type) return 1;
 
    for (;;) {
-      stbi__pngchunk c = stbi__get_chunk_header(s);
+      stbi__pngchunk c;
+      if (z->have_next) {
+         // read by stbi__png_read_idat looking for more IDAT
+         c = z->next;
+         z->have_next = 0;
+      } else {
+         c = stbi__get_chunk_header(s);
+      }
       switch (c.type) {
          case STBI__PNG_TYPE('C','g','B','I'):
             is_iphone = 1;
@@ -5145,7 +7693,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
 
          case STBI__PNG_TYPE('t','R','N','S'): {
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
-            if (z->idata) return stbi__err("tRNS after IDAT","Corrupt PNG");
+            if (seen_idat) return stbi__err("tRNS after IDAT","Corrupt PNG");
             if (pal_img_n) {
                if (scan == STBI__SCAN_header) { s->img_n = 4; return 1; }
                if (pal_len == 0) return stbi__err("tRNS before PLTE","Corrupt PNG");
@@ -5180,59 +7728,97 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
                return 1;
             }
             if (c.length > (1u << 30)) return stbi__err("IDAT size limit", "IDAT section larger than 2^30 bytes");
-            if ((int)(ioff + c.length) < (int)ioff) return 0;
-            if (ioff + c.length > idata_limit) {
-               stbi__uint32 idata_limit_old = idata_limit;
-               stbi_uc *p;
-               if (idata_limit == 0) idata_limit = c.length > 4096 ? c.length : 4096;
-               while (ioff + c.length > idata_limit)
-                  idata_limit *= 2;
-               STBI_NOTUSED(idata_limit_old);
-               p = (stbi_uc *) STBI_REALLOC_SIZED(z->idata, idata_limit_old, idata_limit); if (p == NULL) return stbi__err("outofmem", "Out of memory");
-               z->idata = p;
+            if (seen_idat) {
+               // the image was decoded from the IDAT run before this one
+               stbi__skip(s, c.length);
+               break;
+            }
+            seen_idat = 1;
+            // the rest of the IDAT run is pulled in by stbi__png_read_idat
+            // as inflate needs it, and the rows unfiltered as they come out
+            {
+               stbi__zbuf own, *zb;
+               int ok, window = STBI__PNG_WINDOW + ((s->img_n * s->img_x * z->depth + 7) >> 3) + 1;
+               if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
+                  s->img_out_n = s->img_n+1;
+               else
+                  s->img_out_n = s->img_n;
+               // the passes of an interlaced image only make whole rows at
+               // the end; stbi__png_load_rows hands those over itself
+               if (interlace) z->rows = NULL;
+               // for stbi__png_load, only worth it if there is a conversion
+               // to do; the result is decoded into directly otherwise
+               if (z->rows && z->rows->alloc && z->depth != 16 && (pal_img_n ? req_comp >= 3 : s->img_out_n == req_comp))
+                  z->rows = NULL;
+               if (z->rows) {
+                  z->has_trans = has_trans;
+                  if (has_trans) {
+                     memcpy(z->tc, tc, sizeof(tc));
+                     memcpy(z->tc16, tc16, sizeof(tc16));
+                  }
+                  z->de_iphone = is_iphone && stbi__de_iphone_flag && s->img_out_n > 2;
+                  if (pal_img_n) {
+                     z->palette = palette;
+                     z->pal_out_n = req_comp >= 3 ? req_comp : pal_img_n;
+                  }
+                  if (!stbi__rows_alloc(z->rows, s->img_x, s->img_y)) return 0;
+               }
+               if (!stbi__png_begin_rows(z, s->img_out_n, color, interlace)) return 0;
+               if (z->palette) {
+                  z->pal_out = (stbi_uc *) stbi__malloc_mad3(s->img_x, z->out_rows, z->pal_out_n, 0);
+                  if (z->pal_out == NULL) return stbi__err("outofmem", "Out of memory");
+               }
+               if (s->io.read) {
+                  z->idata = (stbi_uc *) stbi__keep_malloc(s, STBI__KEEP_png_idata, STBI__PNG_IDAT_PIECE, 1, 1, 0);
+                  if (z->idata == NULL) return stbi__err("outofmem", "Out of memory");
+               }
+               z->expanded = (stbi_uc *) stbi__keep_malloc(s, STBI__KEEP_png_window, window, 1, 1, 0);
+               if (z->expanded == NULL) return stbi__err("outofmem", "Out of memory");
+               z->idat_left = c.length;
+               zb = stbi__png_zbuf(s, &own);
+               ok = stbi__do_zlib_stream(zb, (char *) z->expanded, window, !is_iphone, stbi__png_read_idat, stbi__png_write_rows, z);
+               z->expanded = (stbi_uc *) zb->zout_start; // may have grown
+               if (zb != &own) stbi__keep_free(s, STBI__KEEP_zbuf, zb);
+               if (!ok && !z->stopped) return 0; // zlib should set error
+               if (z->pass < 7) return stbi__err("not enough pixels","Corrupt PNG");
+               // from here on the image is the grid of the decoded passes
+               s->img_x = (s->img_x + (1 << z->grid_x) - 1) >> z->grid_x;
+               s->img_y = (s->img_y + (1 << z->grid_y) - 1) >> z->grid_y;
+               stbi__keep_free(s, STBI__KEEP_png_window, z->expanded); z->expanded = NULL;
+               stbi__keep_free(s, STBI__KEEP_png_idata, z->idata); z->idata = NULL;
+               stbi__keep_free(s, STBI__KEEP_png_filter, z->filter_buf); z->filter_buf = NULL;
+               if (z->have_next) continue; // its CRC is read already
+               stbi__skip(s, z->idat_left);
             }
-            if (!stbi__getn(s, z->idata+ioff,c.length)) return stbi__err("outofdata","Corrupt PNG");
-            ioff += c.length;
             break;
          }
 
          case STBI__PNG_TYPE('I','E','N','D'): {
-            stbi__uint32 raw_len, bpl;
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
             if (scan != STBI__SCAN_load) return 1;
-            if (z->idata == NULL) return stbi__err("no IDAT","Corrupt PNG");
-            // initial guess for decoded data size to avoid unnecessary reallocs
-            bpl = (s->img_x * z->depth + 7) / 8; // bytes per line, per component
-            raw_len = bpl * s->img_y * s->img_n /* pixels */ + s->img_y /* filter mode per row */;
-            z->expanded = (stbi_uc *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, raw_len, (int *) &raw_len, !is_iphone);
-            if (z->expanded == NULL) return 0; // zlib should set error
-            STBI_FREE(z->idata); z->idata = NULL;
-            if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
-               s->img_out_n = s->img_n+1;
-            else
-               s->img_out_n = s->img_n;
-            if (!stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, color, interlace)) return 0;
-            if (has_trans) {
+            if (!seen_idat) return stbi__err("no IDAT","Corrupt PNG");
+            // streamed rows were processed batch by batch
+            if (has_trans && !z->rows) {
+               stbi__uint32 pixel_count = s->img_x * s->img_y;
                if (z->depth == 16) {
-                  if (!stbi__compute_transparency16(z, tc16, s->img_out_n)) return 0;
+                  if (!stbi__compute_transparency16((stbi__uint16 *) z->out, pixel_count, tc16, s->img_out_n)) return 0;
                } else {
-                  if (!stbi__compute_transparency(z, tc, s->img_out_n)) return 0;
+                  if (!stbi__compute_transparency(z->out, pixel_count, tc, s->img_out_n)) return 0;
                }
             }
-            if (is_iphone && stbi__de_iphone_flag && s->img_out_n > 2)
-               stbi__de_iphone(z);
+            if (is_iphone && stbi__de_iphone_flag && s->img_out_n > 2 && !z->rows)
+               stbi__de_iphone(z->out, s->img_x * s->img_y, s->img_out_n);
             if (pal_img_n) {
                // pal_img_n == 3 or 4
                s->img_n = pal_img_n; // record the actual colors we had
                s->img_out_n = pal_img_n;
                if (req_comp >= 3) s->img_out_n = req_comp;
-               if (!stbi__expand_png_palette(z, palette, pal_len, s->img_out_n))
+               if (!z->rows && !stbi__expand_png_palette(z, palette, pal_len, s->img_out_n))
                   return 0;
             } else if (has_trans) {
                // non-paletted image with tRNS -> source image has (constant) alpha
                ++s->img_n;
             }
-            STBI_FREE(z->expanded); z->expanded = NULL;
             // end of PNG chunk, read and skip CRC
             stbi__get32be(s);
             return 1;
@@ -5260,11 +7846,33 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
    }
 }
 
+static void stbi__png_cleanup(stbi__png *p)
+{
+   STBI_FREE(p->out);      p->out      = NULL;
+   stbi__keep_free(p->s, STBI__KEEP_png_window, p->expanded); p->expanded = NULL;
+   stbi__keep_free(p->s, STBI__KEEP_png_idata, p->idata);     p->idata    = NULL;
+   stbi__keep_free(p->s, STBI__KEEP_png_filter, p->filter_buf); p->filter_buf = NULL;
+   STBI_FREE(p->final);    p->final    = NULL;
+   STBI_FREE(p->pal_out);  p->pal_out  = NULL;
+}
+
 static void *stbi__do_png(stbi__png *p, int *x, int *y, int *n, int req_comp, stbi__result_info *ri)
 {
    void *result=NULL;
    if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
    if (stbi__parse_png_file(p, STBI__SCAN_load, req_comp)) {
+      if (p->rows) {
+         // stbi__png_load had the rows converted as they were decoded
+         result = p->rows->dest;
+         p->rows->dest = NULL;
+         ri->bits_per_channel = 8;
+         p->s->img_out_n = req_comp;
+         *x = p->s->img_x;
+         *y = p->s->img_y;
+         if (n) *n = p->s->img_n;
+         stbi__png_cleanup(p);
+         return result;
+      }
       if (p->depth <= 8)
          ri->bits_per_channel = 8;
       else if (p->depth == 16)
@@ -5285,20 +7893,100 @@ static void *stbi__do_png(stbi__png *p, int *x, int *y, int *n, int req_comp, st
       *y = p->s->img_y;
       if (n) *n = p->s->img_n;
    }
-   STBI_FREE(p->out);      p->out      = NULL;
-   STBI_FREE(p->expanded); p->expanded = NULL;
-   STBI_FREE(p->idata);    p->idata    = NULL;
+   stbi__png_cleanup(p);
+
+   return result;
+}
 
+static void *stbi__png_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc)
+{
+   stbi__png p;
+   stbi__rows r;
+   void *result;
+   p.s = s;
+   p.rows = NULL;
+   p.passes = 7;
+   if (req_comp > 0 && req_comp <= 4 && bpc == 8) {
+      // 8 bits in req_comp channels: the rows go through stbi__rows_emit
+      // as they are unfiltered, converted into the result a strip at a time
+      // while still in cache, rather than all together at the end
+      stbi__rows_start(&r, req_comp, NULL, NULL, NULL, 0);
+      r.alloc = 1;
+      p.rows = &r;
+   }
+   result = stbi__do_png(&p, x,y,comp,req_comp, ri);
+   if (p.rows) {
+      STBI_FREE(r.buf);
+      STBI_FREE(r.dest);
+   }
    return result;
 }
 
-static void *stbi__png_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
+static int stbi__png_load_rows(stbi__context *s, int *x, int *y, int *comp, stbi__rows *rows)
+{
+   stbi__png p;
+   int ok;
+   p.s = s;
+   p.rows = rows;
+   p.passes = 7;
+   ok = stbi__parse_png_file(&p, STBI__SCAN_load, rows->req_comp);
+   // an interlaced image was decoded whole
+   if (ok && !p.rows)
+      ok = stbi__rows_emit_image(rows, p.out, s->img_x, s->img_y, s->img_out_n, p.depth == 16);
+   if (ok) {
+      *x = s->img_x;
+      *y = s->img_y;
+      if (comp) *comp = s->img_n;
+   }
+   stbi__png_cleanup(&p);
+   return ok;
+}
+
+static stbi_uc *stbi__png_load_passes(stbi__context *s, int *x, int *y, int *comp, int req_comp, int passes)
 {
    stbi__png p;
+   stbi__result_info ri;
+   void *result;
+   int n;
+   if (passes < 1 || passes > 7) return stbi__errpuc("bad passes", "PNG passes must be 1 to 7");
+   if (!stbi__check_png_header(s)) return stbi__errpuc("not PNG", "Image is not a PNG");
+   stbi__rewind(s);
    p.s = s;
-   return stbi__do_png(&p, x,y,comp,req_comp, ri);
+   p.rows = NULL;
+   p.passes = passes;
+   result = stbi__do_png(&p, x,y,&n,req_comp, &ri);
+   if (result == NULL) return NULL;
+   if (comp) *comp = n;
+   if (ri.bits_per_channel != 8) {
+      result = stbi__convert_16_to_8((stbi__uint16 *) result, *x, *y, req_comp ? req_comp : n);
+      if (result == NULL) return NULL;
+   }
+   if (stbi__vertically_flip_on_load)
+      stbi__vertical_flip(result, *x, *y, req_comp ? req_comp : n);
+   return (stbi_uc *) result;
 }
 
+STBIDEF stbi_uc *stbi_load_png_passes_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, int passes)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__png_load_passes(&s,x,y,comp,req_comp,passes);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_png_passes(char const *filename, int *x, int *y, int *comp, int req_comp, int passes)
+{
+   stbi__context s;
+   unsigned char *result;
+   FILE *f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+   stbi__start_file(&s,f);
+   result = stbi__png_load_passes(&s,x,y,comp,req_comp,passes);
+   fclose(f);
+   return result;
+}
+#endif
+
 static int stbi__png_test(stbi__context *s)
 {
    int r;
@@ -7627,6 +10315,96 @@ static int stbi__pnm_is16(stbi__context *s)
 	   return 1;
    return 0;
 }
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_pnm_mapped(char const *filename, int *x, int *y, int *comp, int req_comp, stbi_pnm_mapping *map)
+{
+#ifdef STBI__PNM_MMAP
+   stbi__context s;
+   struct stat st;
+   stbi_uc *base;
+   size_t len, offset;
+   char magic[2];
+   int fd, n;
+
+   map->base = NULL;
+   map->len = 0;
+   if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
+   if (stbi__vertically_flip_on_load) return stbi__errpuc("flipped", "Mapped pixels can't be flipped");
+
+   fd = open(filename, O_RDONLY);
+   if (fd < 0) return stbi__errpuc("can't fopen", "Unable to open file");
+   // other formats are turned away without the cost of mapping them
+   if (read(fd, magic, 2) != 2 || magic[0] != 'P' || (magic[1] != '5' && magic[1] != '6')) {
+      close(fd);
+      return stbi__errpuc("not PNM", "Image is not a binary PGM or PPM");
+   }
+   if (fstat(fd, &st) != 0 || (stbi__uint64) st.st_size > INT_MAX) {
+      close(fd);
+      return stbi__errpuc("can't map", "File can't be mapped");
+   }
+   len = (size_t) st.st_size;
+   // private and writable, so the result can be used as a stbi_load one;
+   // pages are only copied if written to
+   base = (stbi_uc *) mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (base == (stbi_uc *) MAP_FAILED) return stbi__errpuc("can't map", "File can't be mapped");
+
+   stbi__start_mem(&s, base, (int) len);
+   // leaves s where the pixels start, as stbi__pnm_load reads them
+   switch (stbi__pnm_info(&s, (int *) &s.img_x, (int *) &s.img_y, &n)) {
+      case 0:
+         goto fail;
+      case 8:
+         break;
+      default:
+         stbi__err("16-bit PNM", "16-bit PNM needs converting to 8 bits");
+         goto fail;
+   }
+   if (req_comp && req_comp != n) {
+      stbi__err("conversion", "PNM needs converting to desired_channels");
+      goto fail;
+   }
+   if (s.img_y > STBI_MAX_DIMENSIONS || s.img_x > STBI_MAX_DIMENSIONS) {
+      stbi__err("too large","Very large image (corrupt?)");
+      goto fail;
+   }
+   offset = (size_t) (s.img_buffer - base);
+   if (!stbi__mad3sizes_valid(n, s.img_x, s.img_y, 0) || (size_t) n * s.img_x * s.img_y > len - offset) {
+      stbi__err("bad PNM", "PNM file truncated");
+      goto fail;
+   }
+   map->base = base;
+   map->len = len;
+   *x = s.img_x;
+   *y = s.img_y;
+   if (comp) *comp = n;
+   return base + offset;
+
+fail:
+   munmap(base, len);
+   return NULL;
+#else
+   STBI_NOTUSED(filename);
+   STBI_NOTUSED(x);
+   STBI_NOTUSED(y);
+   STBI_NOTUSED(comp);
+   STBI_NOTUSED(req_comp);
+   map->base = NULL;
+   map->len = 0;
+   return stbi__errpuc("can't map", "File mapping not supported on this platform");
+#endif
+}
+
+STBIDEF void stbi_pnm_unmap(stbi_pnm_mapping *map)
+{
+#ifdef STBI__PNM_MMAP
+   if (map->base) munmap(map->base, map->len);
+#endif
+   map->base = NULL;
+   map->len = 0;
+}
+#endif
 #endif
 
 static int stbi__info_main(stbi__context *s, int *x, int *y, int *comp)
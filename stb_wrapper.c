@@ -1,4 +1,15 @@
+#include "memoria.h"
+#define STBI_MALLOC(sz)           mem_alloc(sz)
+#define STBI_REALLOC(p,newsz)     mem_realloc(p,newsz)
+#define STBI_FREE(p)              mem_free(p)
+#define STBI_MALLOC_KEPT(sz)      mem_alloc_persistent(sz)
+#define STBI_KEPT_LEND(p)         mem_lend(p)
+#define STBI_KEPT_RECLAIM(p)      mem_reclaim(p)
+#define STBIW_MALLOC(sz)          mem_alloc(sz)
+#define STBIW_REALLOC(p,newsz)    mem_realloc(p,newsz)
+#define STBIW_FREE(p)             mem_free(p)
 #define STB_IMAGE_IMPLEMENTATION
+#define STBI_JPEG_THREADS
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb-master/stb_image.h"
 #include "stb-master/stb_image_write.h"
@@ -0,0 +1,98 @@
+#define _XOPEN_SOURCE 700
+#include "stb-master/stb_image_write.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include "prueba.h"
+
+int prueba_failures = 0;
+
+int prueba_dir_create(char *dir, size_t size, const char *name, const char *const *subdirs) {
+    char sub[1024];
+    snprintf(dir, size, "/tmp/%s.XXXXXX", name);
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return -1;
+    }
+    for (int i = 0; subdirs && subdirs[i]; i++) {
+        snprintf(sub, sizeof(sub), "%s/%s", dir, subdirs[i]);
+        if (mkdir(sub, 0755) != 0) {
+            perror("mkdir");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+void prueba_dir_remove(const char *dir) {
+    nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+int prueba_end(const char *name) {
+    if (prueba_failures) return 1;
+    printf("%s: OK\n", name);
+    return 0;
+}
+
+unsigned char *prueba_image(int w, int h, int comp, prueba_fill fill, void *ctx) {
+    unsigned char *img = malloc((size_t)w * h * comp);
+    if (!img) return NULL;
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            fill(x, y, img + ((size_t)y * w + x) * comp, ctx);
+        }
+    }
+    return img;
+}
+
+int prueba_write_jpg(const char *path, int w, int h, int comp, int quality, prueba_fill fill, void *ctx) {
+    unsigned char *img = prueba_image(w, h, comp, fill, ctx);
+    int ok = img && stbi_write_jpg(path, w, h, comp, img, quality);
+    free(img);
+    return ok;
+}
+
+unsigned long long prueba_rand(unsigned long long *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+unsigned char *prueba_zlib_stored(const unsigned char *data, size_t len, size_t *out_len) {
+    size_t blocks = len ? (len + 65534) / 65535 : 1;
+    unsigned char *z = malloc(2 + len + 5 * blocks + 4);
+    size_t n = 0, off = 0;
+    unsigned long a = 1, b = 0;
+    if (!z) return NULL;
+    z[n++] = 0x78;
+    z[n++] = 0x01;
+    do {
+        size_t part = len - off < 65535 ? len - off : 65535;
+        z[n++] = off + part == len;     // BFINAL en el ultimo, BTYPE 00
+        z[n++] = part & 255;
+        z[n++] = part >> 8;
+        z[n++] = ~part & 255;
+        z[n++] = (~part >> 8) & 255;
+        memcpy(z + n, data + off, part);
+        n += part;
+        off += part;
+    } while (off < len);
+    for (size_t i = 0; i < len; i++) {
+        a = (a + data[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    unsigned long adler = b << 16 | a;
+    for (int i = 3; i >= 0; i--) z[n++] = adler >> (8 * i);
+    *out_len = n;
+    return z;
+}
@@ -0,0 +1,41 @@
+#ifndef PRUEBA_H
+#define PRUEBA_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/*
+ * Lo comun a las pruebas de tests/: comprobaciones que cuentan los fallos
+ * sin abortar, un directorio temporal por prueba e imagenes sinteticas.
+ * Cada prueba se ejecuta desde la raiz del repositorio (make test).
+ */
+
+#define PRUEBA_DATOS "tests/datos"
+
+extern int prueba_failures;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { fprintf(stderr, "FALLO %s:%d: ", __FILE__, __LINE__); \
+                   fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n"); prueba_failures++; } \
+} while (0)
+
+// Crea /tmp/<name>.XXXXXX en dir (size bytes) y dentro los subdirectorios dados
+int prueba_dir_create(char *dir, size_t size, const char *name, const char *const *subdirs);
+// Borra el directorio con todo lo que quede dentro
+void prueba_dir_remove(const char *dir);
+// "name: OK" y 0 si no hubo fallos, 1 si los hubo
+int prueba_end(const char *name);
+
+// Da el color del pixel (x, y); se llama por filas, de arriba abajo
+typedef void (*prueba_fill)(int x, int y, unsigned char *pixel, void *ctx);
+// Imagen de w x h con comp canales, de malloc
+unsigned char *prueba_image(int w, int h, int comp, prueba_fill fill, void *ctx);
+int prueba_write_jpg(const char *path, int w, int h, int comp, int quality, prueba_fill fill, void *ctx);
+
+// Generador pseudoaleatorio (xorshift64) para que las imagenes sean reproducibles
+unsigned long long prueba_rand(unsigned long long *state);
+
+// Flujo zlib de len bytes en bloques almacenados (sin comprimir), de malloc
+unsigned char *prueba_zlib_stored(const unsigned char *data, size_t len, size_t *out_len);
+
+#endif
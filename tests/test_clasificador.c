@@ -0,0 +1,180 @@
+#include "stb-master/stb_image.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "clasificador.h"
+#include "memoria.h"
+#include "prueba.h"
+
+static char full_sum_color(const char *path) {
+    int w, h, c;
+    unsigned char *img = stbi_load(path, &w, &h, &c, 3);
+    unsigned long long sums[3] = {0, 0, 0};
+    if (!img) return 0;
+    for (size_t i = 0; i < (size_t)w * h; i++)
+        for (int k = 0; k < 3; k++) sums[k] += img[i * 3 + k];
+    stbi_image_free(img);
+    if (sums[0] >= sums[1] && sums[0] >= sums[2]) return 'r';
+    if (sums[1] >= sums[2]) return 'g';
+    return 'b';
+}
+
+static char classified_color(const char *dir, const char *name) {
+    static const char colors[3] = {'r', 'g', 'b'};
+    static const char *sub[3] = {"rojas", "verdes", "azules"};
+    char path[512];
+    for (int i = 0; i < 3; i++) {
+        snprintf(path, sizeof(path), "%s/%s/%s", dir, sub[i], name);
+        if (access(path, F_OK) == 0) {
+            unlink(path);
+            return colors[i];
+        }
+    }
+    return 0;
+}
+
+/*
+ * JPEG casi empatado entre rojo y verde: verde por 0.2 niveles en la suma
+ * completa, pero las medias DC de sus bloques dan ventaja al rojo. Los
+ * bloques saturados en ajedrez son los que más desplazan las DC.
+ */
+static void near_tie_pixel(int x, int y, unsigned char *p, void *ctx) {
+    int g = 100 + (int)(prueba_rand(ctx) % 64) - 32;
+    int r = g + (y < 24 ? 8 : 0);
+    if ((x / 8 + y / 8) & 1) r = g = 250;
+    p[0] = r;
+    p[1] = g;
+    p[2] = 60;
+}
+
+// Clasifica dir/name como lo haría el servidor y devuelve el color elegido
+static char classify(const char *dir, const char *name, enum classify_mode mode) {
+    char path[512], red[512], green[512], blue[512];
+    struct classify_options opts;
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    snprintf(red, sizeof(red), "%s/rojas", dir);
+    snprintf(green, sizeof(green), "%s/verdes", dir);
+    snprintf(blue, sizeof(blue), "%s/azules", dir);
+    classify_options_default(&opts);
+    opts.mode = mode;
+    mem_request_begin();
+    int result = classify_image(path, name, red, green, blue, &opts);
+    mem_request_end(NULL);
+    CHECK(result == 0, "classify_image falló con %s", name);
+    return classified_color(dir, name);
+}
+
+static void test_near_tie(const char *dir, enum classify_mode mode) {
+    char path[512];
+    unsigned long long rng = 88172645463325252ULL;
+    snprintf(path, sizeof(path), "%s/empate.jpg", dir);
+    prueba_write_jpg(path, 512, 384, 3, 75, near_tie_pixel, &rng);
+    char expected = full_sum_color(path);
+    CHECK(expected == 'g', "la imagen de prueba debería ser verde por poco (es %c)", expected);
+
+    char got = classify(dir, "empate.jpg", mode);
+    CHECK(got == expected, "casi empate (modo %d): clasificada como %c, la suma completa da %c",
+          mode, got ? got : '?', expected);
+}
+
+static unsigned long crc32_update(unsigned long crc, const unsigned char *p, size_t n) {
+    crc = ~crc & 0xffffffffUL;
+    for (size_t i = 0; i < n; i++) {
+        crc ^= p[i];
+        for (int k = 0; k < 8; k++) crc = (crc >> 1) ^ (0xedb88320UL & -(crc & 1));
+    }
+    return ~crc & 0xffffffffUL;
+}
+
+static void put_be32(FILE *f, unsigned long v) {
+    unsigned char b[4] = { v >> 24, v >> 16, v >> 8, v };
+    fwrite(b, 1, 4, f);
+}
+
+static void write_chunk(FILE *f, const char *type, const unsigned char *data, size_t n) {
+    put_be32(f, n);
+    fwrite(type, 1, 4, f);
+    fwrite(data, 1, n, f);
+    unsigned long crc = crc32_update(0, (const unsigned char *)type, 4);
+    put_be32(f, crc32_update(crc, data, n));
+}
+
+/*
+ * PNG RGB entrelazado (Adam7), sin filtros y con el zlib en bloques
+ * almacenados: stbi_write_png no escribe PNG entrelazados.
+ */
+static void write_interlaced_png(const char *path, int w, int h, const unsigned char *rgb) {
+    static const int x0[7] = {0, 4, 0, 2, 0, 1, 0}, y0[7] = {0, 0, 4, 0, 2, 0, 1};
+    static const int dx[7] = {8, 8, 4, 4, 2, 2, 1}, dy[7] = {8, 8, 8, 4, 4, 2, 2};
+    size_t raw_len = 0, n = 0;
+    for (int p = 0; p < 7; p++) {
+        size_t pw = (w - x0[p] + dx[p] - 1) / dx[p], ph = (h - y0[p] + dy[p] - 1) / dy[p];
+        if (pw && ph) raw_len += ph * (1 + pw * 3);
+    }
+    unsigned char *raw = malloc(raw_len);
+    for (int p = 0; p < 7; p++) {
+        for (int y = y0[p]; y < h; y += dy[p]) {
+            if (x0[p] >= w) break;
+            raw[n++] = 0;
+            for (int x = x0[p]; x < w; x += dx[p]) {
+                memcpy(raw + n, rgb + ((size_t)y * w + x) * 3, 3);
+                n += 3;
+            }
+        }
+    }
+
+    size_t zn;
+    unsigned char *z = prueba_zlib_stored(raw, raw_len, &zn);
+
+    unsigned char ihdr[13] = { w >> 24, w >> 16, w >> 8, w, h >> 24, h >> 16, h >> 8, h,
+                               8, 2, 0, 0, 1 };
+    FILE *f = fopen(path, "wb");
+    fwrite("\x89PNG\r\n\x1a\n", 1, 8, f);
+    write_chunk(f, "IHDR", ihdr, sizeof(ihdr));
+    write_chunk(f, "IDAT", z, zn);
+    write_chunk(f, "IEND", NULL, 0);
+    fclose(f);
+    free(z);
+    free(raw);
+}
+
+/*
+ * El muestreo tiene que sacar sus muestras de la imagen entera: en un PNG
+ * entrelazado la primera pasada Adam7 solo tiene los píxeles (8i, 8j), y
+ * aquí esos son todos azules en una imagen roja.
+ */
+static void grid_pixel(int x, int y, unsigned char *p, void *ctx) {
+    int grid = x % 8 == 0 && y % 8 == 0;
+    (void)ctx;
+    p[0] = grid ? 0 : 200;
+    p[1] = 0;
+    p[2] = grid ? 255 : 0;
+}
+
+static void test_sampled_interlaced(const char *dir) {
+    int w = 2048, h = 2048;
+    char path[512];
+    unsigned char *rgb = prueba_image(w, h, 3, grid_pixel, NULL);
+    snprintf(path, sizeof(path), "%s/rejilla.png", dir);
+    write_interlaced_png(path, w, h, rgb);
+    free(rgb);
+
+    char expected = full_sum_color(path);
+    CHECK(expected == 'r', "la imagen de prueba debería ser roja (es %c)", expected ? expected : '?');
+    char got = classify(dir, "rejilla.png", CLASSIFY_SAMPLED);
+    CHECK(got == expected, "PNG entrelazado muestreado: clasificado como %c, la suma completa da %c",
+          got ? got : '?', expected);
+}
+
+int main(void) {
+    static const char *const subdirs[] = {"rojas", "verdes", "azules", NULL};
+    char dir[64];
+    if (prueba_dir_create(dir, sizeof(dir), "test_clasificador", subdirs) != 0) return 1;
+
+    test_near_tie(dir, CLASSIFY_FULL);
+    test_sampled_interlaced(dir);
+
+    prueba_dir_remove(dir);
+    return prueba_end("test_clasificador");
+}
@@ -0,0 +1,48 @@
+#include <stdio.h>
+#include "histogram.h"
+#include "memoria.h"
+#include "prueba.h"
+
+#define W 2000
+#define H 1500
+
+static void gradient_pixel(int x, int y, unsigned char *p, void *ctx) {
+    (void)ctx;
+    p[0] = x * 255 / W;
+    p[1] = y * 255 / H;
+    p[2] = (x ^ y) & 255;
+}
+
+/*
+ * Una decodificacion de varios MB tiene que verse en el pico de la etapa,
+ * tambien en las peticiones siguientes, cuando los buffers de trabajo que
+ * se conservan entre peticiones ya no se vuelven a reservar.
+ */
+static void test_decode_peak(const char *in, const char *out) {
+    struct eq_options opts;
+    eq_options_default(&opts);
+    for (int request = 0; request < 2; request++) {
+        struct mem_request_stats stats;
+        mem_request_begin();
+        int result = process_histogram_equalization(in, out, &opts);
+        mem_request_end(&stats);
+        CHECK(result == 0, "process_histogram_equalization fallo");
+        CHECK(stats.stage[MEM_STAGE_DECODE].peak >= (unsigned long long)W * H,
+              "peticion %d: pico de decodificacion %llu, menor que la imagen (%d bytes)",
+              request, stats.stage[MEM_STAGE_DECODE].peak, W * H);
+        CHECK(stats.peak >= stats.stage[MEM_STAGE_DECODE].peak, "pico total menor que el de una etapa");
+    }
+}
+
+int main(void) {
+    char dir[64], in[128], out[128];
+    if (prueba_dir_create(dir, sizeof(dir), "test_memoria", NULL) != 0) return 1;
+    snprintf(in, sizeof(in), "%s/grande.jpg", dir);
+    snprintf(out, sizeof(out), "%s/grande_equalized.jpg", dir);
+    prueba_write_jpg(in, W, H, 3, 90, gradient_pixel, NULL);
+
+    test_decode_peak(in, out);
+
+    prueba_dir_remove(dir);
+    return prueba_end("test_memoria");
+}
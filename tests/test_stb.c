@@ -0,0 +1,251 @@
+#include "stb-master/stb_image.h"
+#include "stb-master/stb_image_write.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "prueba.h"
+
+/*
+ * Regresiones de los cambios hechos a stb_image.h: el inflate, los filtros
+ * PNG, el stbi_decoder que conserva tablas entre imagenes y la decodificacion
+ * JPEG en varios hilos. Los ficheros de tests/datos se generaron con zlib y
+ * Pillow, que no comparten codigo con stb.
+ */
+
+static unsigned char *read_file(const char *name, int *len) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", PRUEBA_DATOS, name);
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        CHECK(0, "no se pudo abrir %s", path);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    long n = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    unsigned char *buf = malloc(n);
+    if (buf && fread(buf, 1, n, f) != (size_t)n) {
+        free(buf);
+        buf = NULL;
+    }
+    fclose(f);
+    CHECK(buf != NULL, "no se pudo leer %s", path);
+    *len = (int)n;
+    return buf;
+}
+
+// Mismo texto que el que se comprimio para fijo.zlib y dinamico.zlib
+static void texto(unsigned char *out, int n, unsigned long seed) {
+    static const char *const words[7] = {
+        "rojo ", "verde ", "azul ", "histograma ", "ecualizacion\n", "muestreo ", "x"
+    };
+    unsigned long x = seed;
+    int len = 0;
+    while (len < n) {
+        x = (x * 1103515245 + 12345) & 0x7fffffff;
+        const char *w = words[(x >> 16) % 7];
+        for (int i = 0; w[i] && len < n; i++) out[len++] = w[i];
+    }
+}
+
+static unsigned char *zlib_data(int *len) {
+    int n = 30000 + 1000 + 900 + 30000 + 5000, off = 0;
+    unsigned char *d = malloc(n);
+    texto(d, 30000, 1);
+    off += 30000;
+    memset(d + off, 'a', 1000);
+    off += 1000;
+    for (int i = 0; i < 300; i++, off += 3) memcpy(d + off, "abc", 3);
+    memcpy(d + off, d, 30000);
+    off += 30000;
+    texto(d + off, 5000, 2);
+    *len = n;
+    return d;
+}
+
+static void check_inflate(const char *what, const unsigned char *z, int zlen,
+                          const unsigned char *expected, int len) {
+    int got_len = 0;
+    char *got = stbi_zlib_decode_malloc((const char *)z, zlen, &got_len);
+    CHECK(got != NULL, "%s: stbi_zlib_decode_malloc fallo (%s)", what, stbi_failure_reason());
+    if (!got) return;
+    CHECK(got_len == len, "%s: %d bytes, se esperaban %d", what, got_len, len);
+    CHECK(got_len != len || memcmp(got, expected, len) == 0, "%s: los datos no coinciden", what);
+    stbi_image_free(got);
+}
+
+// Bloques almacenados, con codigos fijos y con codigos dinamicos (BTYPE 0, 1 y 2)
+static void test_inflate(void) {
+    int len, zlen;
+    unsigned char *data = zlib_data(&len);
+    size_t stored_len;
+    unsigned char *stored = prueba_zlib_stored(data, len, &stored_len);
+    check_inflate("almacenado", stored, (int)stored_len, data, len);
+    free(stored);
+
+    static const char *const files[2] = {"fijo.zlib", "dinamico.zlib"};
+    for (int i = 0; i < 2; i++) {
+        unsigned char *z = read_file(files[i], &zlen);
+        if (!z) continue;
+        check_inflate(files[i], z, zlen, data, len);
+        free(z);
+    }
+    free(data);
+}
+
+struct png_buffer {
+    unsigned char *data;
+    int len, cap;
+};
+
+static void png_append(void *ctx, void *data, int size) {
+    struct png_buffer *b = ctx;
+    if (b->len + size > b->cap) {
+        b->cap = (b->len + size) * 2;
+        b->data = realloc(b->data, b->cap);
+    }
+    memcpy(b->data + b->len, data, size);
+    b->len += size;
+}
+
+static void noise_pixel(int x, int y, unsigned char *p, void *ctx) {
+    unsigned long long r = prueba_rand(ctx);
+    // mitad degradado y mitad ruido, para que cada filtro vea diferencias de todo tamaño
+    for (int k = 0; k < 4; k++) p[k] = x < 40 ? x * 3 + y * 5 + k * 60 : (unsigned char)(r >> (8 * k));
+}
+
+/*
+ * Cada filtro PNG (0 ninguno, 1 sub, 2 up, 3 average, 4 paeth) con 1 a 4
+ * canales, en 8 y 16 bits: lo que se lee tiene que ser lo escrito.
+ */
+static void test_png_filters(void) {
+    int w = 83, h = 29;
+    unsigned long long rng = 0x9e3779b97f4a7c15ULL;
+    unsigned char *img = prueba_image(w, h, 4, noise_pixel, &rng);
+    unsigned short *img16 = malloc((size_t)w * h * 4 * sizeof(*img16));
+    for (int i = 0; i < w * h * 4; i++) img16[i] = img[i] * 257 ^ (i * 7 & 255);
+
+    for (int filter = 0; filter <= 4; filter++) {
+        stbi_write_force_png_filter = filter;
+        for (int comp = 1; comp <= 4; comp++) {
+            unsigned char *src = malloc((size_t)w * h * comp);
+            unsigned short *src16 = malloc((size_t)w * h * comp * sizeof(*src16));
+            for (int i = 0; i < w * h; i++) {
+                for (int k = 0; k < comp; k++) {
+                    src[i * comp + k] = img[i * 4 + k];
+                    src16[i * comp + k] = img16[i * 4 + k];
+                }
+            }
+
+            struct png_buffer b = {NULL, 0, 0};
+            int x, y, c;
+            stbi_write_png_to_func(png_append, &b, w, h, comp, src, w * comp);
+            unsigned char *got = stbi_load_from_memory(b.data, b.len, &x, &y, &c, 0);
+            CHECK(got && x == w && y == h && c == comp, "filtro %d, %d canales: no se pudo leer el PNG", filter, comp);
+            CHECK(!got || memcmp(got, src, (size_t)w * h * comp) == 0, "filtro %d, %d canales: los pixeles no coinciden", filter, comp);
+            stbi_image_free(got);
+
+            b.len = 0;
+            stbi_write_png_16_to_func(png_append, &b, w, h, comp, src16, w * comp * 2);
+            stbi_us *got16 = stbi_load_16_from_memory(b.data, b.len, &x, &y, &c, 0);
+            CHECK(got16 && x == w && y == h && c == comp, "filtro %d, %d canales, 16 bits: no se pudo leer el PNG", filter, comp);
+            CHECK(!got16 || memcmp(got16, src16, (size_t)w * h * comp * 2) == 0,
+                  "filtro %d, %d canales, 16 bits: los pixeles no coinciden", filter, comp);
+            stbi_image_free(got16);
+
+            free(b.data);
+            free(src16);
+            free(src);
+        }
+    }
+    stbi_write_force_png_filter = -1;
+    free(img16);
+    free(img);
+}
+
+static void rgb_pixel(int x, int y, unsigned char *p, void *ctx) {
+    int shift = *(int *)ctx;
+    p[0] = (x * 7 + shift) & 255;
+    p[1] = (y * 3) & 255;
+    p[2] = (x * y + shift) & 255;
+}
+
+static void gray_pixel(int x, int y, unsigned char *p, void *ctx) {
+    (void)ctx;
+    p[0] = (x + y * 2) & 255;
+}
+
+static void check_same_as_stbi_load(stbi_decoder *dec, const char *path) {
+    int x, y, c, rx, ry, rc;
+    unsigned char *ref = stbi_load(path, &rx, &ry, &rc, 0);
+    unsigned char *got = stbi_decoder_load(dec, path, &x, &y, &c, 0);
+    CHECK(ref && got, "%s: no se pudo decodificar", path);
+    if (ref && got) {
+        CHECK(x == rx && y == ry && c == rc, "%s: %dx%dx%d con el decoder, %dx%dx%d con stbi_load",
+              path, x, y, c, rx, ry, rc);
+        CHECK(x != rx || y != ry || c != rc || memcmp(got, ref, (size_t)x * y * c) == 0,
+              "%s: el decoder no da los mismos pixeles que stbi_load", path);
+    }
+    stbi_image_free(got);
+    stbi_image_free(ref);
+}
+
+/*
+ * Un mismo stbi_decoder con JPEGs de tablas Huffman y tamaños distintos, y
+ * de vuelta al primero: lo que se conserva de una imagen no puede colarse
+ * en la siguiente.
+ */
+static void test_decoder_reuse(const char *dir) {
+    char a[256], gray[256], small[256], restart[256];
+    int shift = 0, other = 91;
+    snprintf(a, sizeof(a), "%s/a.jpg", dir);
+    snprintf(gray, sizeof(gray), "%s/gris.jpg", dir);
+    snprintf(small, sizeof(small), "%s/pequena.jpg", dir);
+    snprintf(restart, sizeof(restart), "%s/reinicio.jpg", PRUEBA_DATOS);
+    prueba_write_jpg(a, 640, 480, 3, 90, rgb_pixel, &shift);
+    prueba_write_jpg(gray, 321, 123, 1, 60, gray_pixel, NULL);
+    prueba_write_jpg(small, 37, 19, 3, 40, rgb_pixel, &other);
+
+    static const int order[] = {0, 1, 2, 3, 0, 3, 2};
+    const char *paths[4] = {a, restart, gray, small};
+    stbi_decoder *dec = stbi_decoder_create();
+    CHECK(dec != NULL, "stbi_decoder_create fallo");
+    if (!dec) return;
+    for (size_t i = 0; i < sizeof(order) / sizeof(order[0]); i++)
+        check_same_as_stbi_load(dec, paths[order[i]]);
+    stbi_decoder_free(dec);
+}
+
+// reinicio.jpg tiene marcadores de reinicio cada 5 MCU y pasa del minimo de pixeles para usar hilos
+static void test_jpeg_threads(void) {
+    int len, x, y, c, tx, ty, tc;
+    unsigned char *jpg = read_file("reinicio.jpg", &len);
+    if (!jpg) return;
+    stbi_set_jpeg_threads(1);
+    unsigned char *ref = stbi_load_from_memory(jpg, len, &x, &y, &c, 0);
+    CHECK(ref && (long)x * y >= 1 << 20, "reinicio.jpg: no se pudo decodificar o es demasiado pequeña");
+    for (int threads = 2; threads <= 5; threads += 3) {
+        stbi_set_jpeg_threads(threads);
+        unsigned char *got = stbi_load_from_memory(jpg, len, &tx, &ty, &tc, 0);
+        CHECK(got && tx == x && ty == y && tc == c, "%d hilos: no se pudo decodificar", threads);
+        CHECK(!ref || !got || memcmp(got, ref, (size_t)x * y * c) == 0,
+              "%d hilos: los pixeles no coinciden con la decodificacion en un hilo", threads);
+        stbi_image_free(got);
+    }
+    stbi_set_jpeg_threads(0);
+    stbi_image_free(ref);
+    free(jpg);
+}
+
+int main(void) {
+    char dir[64];
+    if (prueba_dir_create(dir, sizeof(dir), "test_stb", NULL) != 0) return 1;
+
+    test_inflate();
+    test_png_filters();
+    test_decoder_reuse(dir);
+    test_jpeg_threads();
+
+    prueba_dir_remove(dir);
+    return prueba_end("test_stb");
+}